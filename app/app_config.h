@@ -4,3 +4,24 @@
 #define VERSION_MINOR		8
 
 #define KEY_FIFO_SIZE		31       // number of keys in the public FIFO
+#define TOUCH_FIFO_SIZE		32       // number of samples in the touch FIFO
+#define TOUCH_FIFO_BURST	4        // max samples returned by one touch FIFO read
+#define TOUCHPAD_XFER_MAX	16       // max sensor registers in one touchpad passthrough transfer
+#define KEY_LOW_POWER_SCAN_MS	50       // key scan interval while the USB host is suspended or the battery is critical
+#define TRACE_SIZE		256      // number of events in the trace ring, power of two
+#define TRACE_BURST		3        // max events returned by one trace read
+#define DEBUG_LOG_SIZE		512      // bytes of debug output buffered for USB per priority level, power of two
+#define TIMER_COALESCE_US	1000     // timers due within this of an expiry run in the same wakeup
+#define REWAKE_SLEEP_MIN_S	10       // shorter rewake waits stay awake
+#define BATTERY_SAMPLE_MS	250      // battery voltage sampling period
+#define BATTERY_OVERSAMPLE	16       // ADC conversions averaged per sample
+#define BATTERY_FILTER_SHIFT	2        // samples are low passed with a factor of 1 / (1 << this)
+#define BATTERY_DIVIDER		2        // battery voltage is divided by this at the ADC pin
+#define BATTERY_THRESHOLD_STEP_MV	20   // unit of the low and critical battery thresholds
+#define BATTERY_HYSTERESIS_MV	100      // margin above a threshold to leave its battery level
+#define BATTERY_CRITICAL_BKL	0x08     // keyboard backlight limit at critical battery
+
+// Battery percentage at voltages in mV, highest first, interpolated between
+#define BATTERY_CURVE { \
+	{ 4200, 100 }, { 4100, 90 }, { 4000, 79 }, { 3900, 66 }, { 3800, 52 }, \
+	{ 3700, 36 }, { 3600, 18 }, { 3500, 7 }, { 3400, 2 }, { 3300, 0 } }
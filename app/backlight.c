@@ -1,13 +1,31 @@
+#include "app_config.h"
 #include "backlight.h"
+#include "battery.h"
 #include "reg.h"
 
 #include <hardware/pwm.h>
 #include <pico/stdlib.h>
 
+static bool battery_critical;
+
 void backlight_sync(void)
 {
-	pwm_set_gpio_level(PIN_BKL, reg_get_value(REG_ID_BKL)  * 0x80);
+	uint8_t level = reg_get_value(REG_ID_BKL);
+
+	// Dimmed to stretch what is left of the battery
+	if (battery_critical) {
+		level = MIN(level, BATTERY_CRITICAL_BKL);
+	}
+
+	pwm_set_gpio_level(PIN_BKL, level * 0x80);
+}
+
+static void battery_level_cb(enum battery_level level)
+{
+	battery_critical = (level == BATTERY_LEVEL_CRITICAL);
+	backlight_sync();
 }
+static struct battery_callback battery_callback = { .func = battery_level_cb };
 
 void backlight_init(void)
 {
@@ -18,5 +36,7 @@ void backlight_init(void)
 	pwm_config config = pwm_get_default_config();
 	pwm_init(slice_num, &config, true);
 
+	battery_add_level_callback(&battery_callback);
+
 	backlight_sync();
 }
@@ -0,0 +1,171 @@
+#include "app_config.h"
+#include "battery.h"
+#include "reg.h"
+#include "timer.h"
+
+#include <hardware/adc.h>
+#include <pico/stdlib.h>
+
+#define ADC_BITS 12
+#define ADC_VREF_MV 3300
+
+// Fixed point fraction bits of the averaged reading
+#define AVG_SHIFT 4
+
+struct curve_point
+{
+	uint16_t mv;
+	uint8_t percent;
+};
+
+// Discharge curve, highest voltage first
+static const struct curve_point curve[] = BATTERY_CURVE;
+#define CURVE_LEN (sizeof(curve) / sizeof(curve[0]))
+
+static struct
+{
+	struct timer sample_timer;
+
+	// Averaged ADC reading in 1/(1 << AVG_SHIFT) counts, 0 until sampled
+	uint32_t avg;
+
+	enum battery_level level;
+	struct battery_callback *level_callbacks;
+} self;
+
+// Mean of BATTERY_OVERSAMPLE conversions, in 1/(1 << AVG_SHIFT) counts
+static uint32_t oversample(void)
+{
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i < BATTERY_OVERSAMPLE; i++) {
+		sum += adc_read();
+	}
+
+	return (sum << AVG_SHIFT) / BATTERY_OVERSAMPLE;
+}
+
+// Falling below a threshold takes effect at once, rising past it only
+// with BATTERY_HYSTERESIS_MV to spare, so noise can't toggle the level
+static enum battery_level next_level(uint16_t mv)
+{
+	const uint16_t low_mv = reg_get_value(REG_ID_BAT_LOW) * BATTERY_THRESHOLD_STEP_MV;
+	const uint16_t critical_mv = reg_get_value(REG_ID_BAT_CRITICAL) * BATTERY_THRESHOLD_STEP_MV;
+
+	if ((mv < critical_mv)
+	 || ((self.level == BATTERY_LEVEL_CRITICAL) && (mv < critical_mv + BATTERY_HYSTERESIS_MV))) {
+		return BATTERY_LEVEL_CRITICAL;
+	}
+
+	if ((mv < low_mv)
+	 || ((self.level != BATTERY_LEVEL_OK) && (mv < low_mv + BATTERY_HYSTERESIS_MV))) {
+		return BATTERY_LEVEL_LOW;
+	}
+
+	return BATTERY_LEVEL_OK;
+}
+
+static void update_level(void)
+{
+	const enum battery_level level = next_level(battery_get_mv());
+
+	if (level == self.level) {
+		return;
+	}
+	self.level = level;
+
+	struct battery_callback *cb = self.level_callbacks;
+	while (cb) {
+		cb->func(level);
+		cb = cb->next;
+	}
+}
+
+static void sample_timer_callback(struct timer *timer)
+{
+	const uint32_t sample = oversample();
+
+	// Low pass across samples, load changes move the voltage more than noise
+	if (self.avg == 0) {
+		self.avg = sample;
+	} else {
+		self.avg = self.avg - (self.avg >> BATTERY_FILTER_SHIFT) + (sample >> BATTERY_FILTER_SHIFT);
+	}
+
+	update_level();
+
+	timer_advance_us(timer, BATTERY_SAMPLE_MS * 1000);
+}
+
+void battery_add_level_callback(struct battery_callback *callback)
+{
+	// first callback
+	if (!self.level_callbacks) {
+		self.level_callbacks = callback;
+		return;
+	}
+
+	// find last and insert after
+	struct battery_callback *cb = self.level_callbacks;
+	while (cb->next)
+		cb = cb->next;
+
+	cb->next = callback;
+}
+
+void battery_init(void)
+{
+	adc_init();
+	adc_gpio_init(PIN_BAT_ADC);
+	adc_select_input(0);
+
+	// First reading is taken now, so registers never see an empty cache
+	self.sample_timer.func = sample_timer_callback;
+	sample_timer_callback(&self.sample_timer);
+}
+
+void battery_resample(void)
+{
+	self.avg = 0;
+	sample_timer_callback(&self.sample_timer);
+}
+
+enum battery_level battery_get_level(void)
+{
+	return self.level;
+}
+
+uint16_t battery_get_raw(void)
+{
+	return self.avg >> AVG_SHIFT;
+}
+
+uint16_t battery_get_mv(void)
+{
+	const int32_t mv = ((uint64_t)self.avg * ADC_VREF_MV * BATTERY_DIVIDER) >> (ADC_BITS + AVG_SHIFT);
+
+	// Signed calibration offset
+	return MAX(0, mv + (int8_t)reg_get_value(REG_ID_BAT_CAL));
+}
+
+uint8_t battery_get_percent(void)
+{
+	const uint16_t mv = battery_get_mv();
+	uint i;
+
+	if (mv >= curve[0].mv) {
+		return curve[0].percent;
+	}
+
+	// Interpolate within the segment holding the voltage
+	for (i = 1; i < CURVE_LEN; i++) {
+		if (mv >= curve[i].mv) {
+			return curve[i].percent + (mv - curve[i].mv)
+				* (curve[i - 1].percent - curve[i].percent)
+				/ (curve[i - 1].mv - curve[i].mv);
+		}
+	}
+
+	return curve[CURVE_LEN - 1].percent;
+}
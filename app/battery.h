@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+enum battery_level
+{
+	BATTERY_LEVEL_OK = 0,
+	BATTERY_LEVEL_LOW = 1,
+	BATTERY_LEVEL_CRITICAL = 2,
+};
+
+struct battery_callback
+{
+	void (*func)(enum battery_level level);
+	struct battery_callback *next;
+};
+
+void battery_add_level_callback(struct battery_callback *callback);
+
+void battery_init(void);
+
+// Restart the average from a reading taken now, for when the cached one may
+// be stale, like after a dormant sleep stopped the sampling
+void battery_resample(void);
+
+// Cached, averaged readings, safe to call from interrupts
+uint16_t battery_get_raw(void);
+uint16_t battery_get_mv(void);
+uint8_t battery_get_percent(void);
+enum battery_level battery_get_level(void);
@@ -7,14 +7,13 @@
 #include "touchpad.h"
 #include "usb.h"
 
-#include <pico/mutex.h>
+#include <hardware/irq.h>
+#include <hardware/sync.h>
 #include <pico/stdio/driver.h>
 #include <pico/stdlib.h>
 #include <stdio.h>
 #include <tusb.h>
 
-#define PICO_STDIO_USB_STDOUT_TIMEOUT_US 500000
-
 static void key_cb(uint8_t key, enum key_state state)
 {
 	printf("key: 0x%02X/%d/%c, state: %d\r\n", key, key, key, state);
@@ -33,46 +32,142 @@ static void gpioexp_cb(uint8_t gpio, uint8_t gpio_idx)
 }
 static struct gpioexp_callback gpioexp_callback = { .func = gpioexp_cb };
 
-// copied from pico_stdio_usb in the SDK
-static void usb_out_chars(const char *buf, int length)
+// Log rings, filled by printf and drained to the CDC interface by the USB task.
+// There is one ring per execution priority. Code can't be preempted by code
+// at its own priority, so each ring has a single writer and needs no lock.
+#define LOG_RINGS	6 // thread mode, four interrupt priority levels, system exceptions
+#define LOG_MASK	(DEBUG_LOG_SIZE - 1)
+#define STAMP_LEN	12 // "[sssss.mmm] "
+
+struct log_ring
+{
+	char buf[DEBUG_LOG_SIZE];
+	volatile uint32_t head; // free running, only moved by the writer
+	volatile uint32_t line_head; // head after the last complete line
+	volatile uint32_t tail; // free running, only moved by the USB task
+	uint32_t dropped;
+	bool mid_line; // last chunk didn't end its line
+};
+
+static struct
+{
+	struct log_ring rings[LOG_RINGS];
+} self;
+
+#ifdef ENABLE_USB
+static struct log_ring *log_ring_current(void)
 {
-	static uint64_t last_avail_time;
-	uint32_t owner;
+	const uint exception = __get_current_exception();
 
-	if (!mutex_try_enter(usb_get_mutex(), &owner)) {
-		if (owner == get_core_num())
-			return;
+	if (exception == 0)
+		return &self.rings[0];
 
-		mutex_enter_blocking(usb_get_mutex());
+	// NMI, HardFault, SVCall, PendSV and SysTick
+	if (exception < VTABLE_FIRST_IRQ)
+		return &self.rings[LOG_RINGS - 1];
+
+	// Cortex-M0+ only implements the top two priority bits
+	return &self.rings[1 + (irq_get_priority(exception - VTABLE_FIRST_IRQ) >> 6)];
+}
+
+static uint32_t log_put(struct log_ring *ring, uint32_t pos, const char *buf, uint32_t len)
+{
+	for (uint32_t i = 0; i < len; ++i)
+		ring->buf[(pos + i) & LOG_MASK] = buf[i];
+
+	return pos + len;
+}
+
+// Fixed width, no printf, so the cost doesn't depend on the value
+static uint32_t format_stamp(char *out)
+{
+	uint32_t ms = to_ms_since_boot(get_absolute_time());
+
+	out[0] = '[';
+	for (int i = 9; i >= 1; --i) {
+		if (i == 6) {
+			out[i] = '.';
+			continue;
+		}
+
+		out[i] = '0' + (ms % 10);
+		ms /= 10;
 	}
+	out[10] = ']';
+	out[11] = ' ';
+
+	return STAMP_LEN;
+}
+
+static uint32_t format_dropped(char *out, uint32_t dropped)
+{
+	static const char msg[] = "bytes dropped\r\n";
+	char digits[10];
+	uint32_t len = 0;
+	int i = 0;
+
+	do {
+		digits[i++] = '0' + (dropped % 10);
+		dropped /= 10;
+	} while (dropped && (i < (int)sizeof(digits)));
+
+	while (i)
+		out[len++] = digits[--i];
+
+	out[len++] = ' ';
+	for (uint32_t j = 0; j < sizeof(msg) - 1; ++j)
+		out[len++] = msg[j];
+
+	return len;
+}
+
+// Never waits for the host or other writers, callers in interrupts and the
+// scan loop keep their timing. Anything that doesn't fit is counted and
+// reported later.
+static void usb_out_chars(const char *buf, int length)
+{
+	struct log_ring *ring = log_ring_current();
+	char prefix[2 * STAMP_LEN + 32];
+	uint32_t prefix_len = 0;
 
-	if (tud_cdc_connected()) {
-		for (int i = 0; i < length;) {
-			int n = length - i;
-			int avail = tud_cdc_write_available();
-			if (n > avail) n = avail;
-			if (n) {
-				int n2 = tud_cdc_write(buf + i, n);
-				tud_task();
-				tud_cdc_write_flush();
-				i += n2;
-				last_avail_time = time_us_64();
-			} else {
-				tud_task();
-				tud_cdc_write_flush();
-				if (!tud_cdc_connected() ||
-					(!tud_cdc_write_available() && time_us_64() > last_avail_time + PICO_STDIO_USB_STDOUT_TIMEOUT_US)) {
-					break;
-				}
-			}
+	if (length <= 0)
+		return;
+
+	if (!ring->mid_line) {
+		if (ring->dropped) {
+			prefix_len += format_stamp(&prefix[prefix_len]);
+			prefix_len += format_dropped(&prefix[prefix_len], ring->dropped);
 		}
-	} else {
-		// reset our timeout
-		last_avail_time = 0;
+
+		prefix_len += format_stamp(&prefix[prefix_len]);
+	}
+
+	const uint32_t space = DEBUG_LOG_SIZE - (ring->head - ring->tail);
+
+	if (prefix_len + (uint32_t)length > space) {
+		ring->dropped += length;
+		return;
 	}
 
-	mutex_exit(usb_get_mutex());
+	if (!ring->mid_line)
+		ring->dropped = 0;
+
+	uint32_t head = log_put(ring, ring->head, prefix, prefix_len);
+	head = log_put(ring, head, buf, length);
+
+	ring->mid_line = (buf[length - 1] != '\n');
+
+	// Publish the data before the index the USB task reads
+	__dmb();
+	ring->head = head;
+
+	// Only whole lines are sent, so lines of different rings don't mix
+	if (!ring->mid_line)
+		ring->line_head = head;
+
+	usb_schedule_task();
 }
+
 static struct stdio_driver stdio_usb =
 {
 	.out_chars = usb_out_chars,
@@ -80,12 +175,58 @@ static struct stdio_driver stdio_usb =
 	.crlf_enabled = PICO_STDIO_DEFAULT_CRLF
 #endif
 };
+#endif
+
+// Return false if the CDC FIFO is full
+static bool log_ring_drain(struct log_ring *ring, uint32_t *written)
+{
+	const uint32_t line_head = ring->line_head;
+
+	while (ring->tail != line_head) {
+		const uint32_t offset = ring->tail & LOG_MASK;
+		uint32_t len = line_head - ring->tail;
+
+		if (len > DEBUG_LOG_SIZE - offset)
+			len = DEBUG_LOG_SIZE - offset;
+
+		const uint32_t n = tud_cdc_write(&ring->buf[offset], len);
+		if (n == 0)
+			return false;
+
+		ring->tail += n;
+		*written += n;
+	}
+
+	return true;
+}
+
+void debug_usb_drain(void)
+{
+	uint32_t written = 0;
+
+	for (uint i = 0; i < LOG_RINGS; ++i) {
+		// Same as before the ring, nobody is listening so the output is lost
+		if (!tud_cdc_connected()) {
+			self.rings[i].tail = self.rings[i].line_head;
+			continue;
+		}
+
+		if (!log_ring_drain(&self.rings[i], &written))
+			break;
+	}
+
+	// The rest goes out when the endpoint completes and the task runs again
+	if (written)
+		tud_cdc_write_flush();
+}
 
 void debug_init(void)
 {
 	stdio_init_all();
 
+#ifdef ENABLE_USB
 	stdio_set_driver_enabled(&stdio_usb, true);
+#endif
 
 	printf("I2C Puppet SW v%d.%d\r\n", VERSION_MAJOR, VERSION_MINOR);
 
@@ -1,3 +1,6 @@
 #pragma once
 
 void debug_init(void);
+
+// Called by the USB task to move buffered output to the CDC interface
+void debug_usb_drain(void);
@@ -1,5 +1,6 @@
 #include "app_config.h"
 #include "fifo.h"
+#include "trace.h"
 
 static struct
 {
@@ -31,6 +32,8 @@ bool fifo_enqueue(const struct fifo_item item)
 	self.write_idx %= KEY_FIFO_SIZE;
 	++self.count;
 
+	TRACE(TRACE_FIFO_PUSH, item.scancode, self.count);
+
 	return true;
 }
 
@@ -44,6 +47,8 @@ void fifo_enqueue_force(const struct fifo_item item)
 
 	self.read_idx++;
 	self.read_idx %= KEY_FIFO_SIZE;
+
+	TRACE(TRACE_FIFO_PUSH, item.scancode, self.count);
 }
 
 struct fifo_item fifo_dequeue(void)
@@ -56,5 +61,7 @@ struct fifo_item fifo_dequeue(void)
 	self.read_idx %= KEY_FIFO_SIZE;
 	--self.count;
 
+	TRACE(TRACE_FIFO_POP, item.scancode, self.count);
+
 	return item;
 }
@@ -1,6 +1,7 @@
 #include "interrupt.h"
 
 #include "app_config.h"
+#include "battery.h"
 #include "gpioexp.h"
 #include "keyboard.h"
 #include "reg.h"
@@ -44,6 +45,7 @@ static void key_lock_cb(bool caps_changed, bool num_changed)
 		gpio_put(PIN_INT, 1);
 	}
 }
+static struct key_lock_callback key_lock_callback = { .func = key_lock_cb };
 
 static void touch_cb(int8_t x, int8_t y)
 {
@@ -61,6 +63,36 @@ static void touch_cb(int8_t x, int8_t y)
 }
 static struct touch_callback touch_callback = { .func = touch_cb };
 
+static void touchpad_xfer_cb(void)
+{
+	if (!reg_is_bit_set(REG_ID_CF2, CF2_TOUCHPAD_XFER_INT))
+		return;
+
+	reg_set_bit(REG_ID_INT2, INT2_TOUCHPAD_XFER);
+	reg_set_bit(REG_ID_INT, INT_INT2);
+
+	gpio_put(PIN_INT, 0);
+	busy_wait_ms(reg_get_value(REG_ID_IND));
+	gpio_put(PIN_INT, 1);
+}
+static struct touchpad_xfer_callback touchpad_xfer_callback = { .func = touchpad_xfer_cb };
+
+static void battery_level_cb(enum battery_level level)
+{
+	(void)level;
+
+	if (!reg_is_bit_set(REG_ID_CF2, CF2_BATTERY_INT))
+		return;
+
+	reg_set_bit(REG_ID_INT2, INT2_BATTERY);
+	reg_set_bit(REG_ID_INT, INT_INT2);
+
+	gpio_put(PIN_INT, 0);
+	busy_wait_ms(reg_get_value(REG_ID_IND));
+	gpio_put(PIN_INT, 1);
+}
+static struct battery_callback battery_callback = { .func = battery_level_cb };
+
 static void gpioexp_cb(uint8_t gpio, uint8_t gpio_idx)
 {
 	(void)gpio;
@@ -86,7 +118,13 @@ void interrupt_init(void)
 
 	keyboard_add_key_callback(&key_callback);
 
+	keyboard_add_lock_callback(&key_lock_callback);
+
 	touchpad_add_touch_callback(&touch_callback);
 
+	touchpad_add_xfer_callback(&touchpad_xfer_callback);
+
+	battery_add_level_callback(&battery_callback);
+
 	gpioexp_add_int_callback(&gpioexp_callback);
 }
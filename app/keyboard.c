@@ -1,8 +1,11 @@
 #include "app_config.h"
+#include "battery.h"
 #include "fifo.h"
 #include "keyboard.h"
 #include "reg.h"
 #include "pi.h"
+#include "timer.h"
+#include "trace.h"
 
 #include <pico/stdlib.h>
 
@@ -12,6 +15,15 @@
 static struct
 {
 	struct key_callback *key_callbacks;
+	struct key_lock_callback *lock_callbacks;
+
+	bool capslock;
+	bool numlock;
+
+	bool low_power;
+	bool battery_critical;
+
+	struct timer scan_timer;
 } self;
 
 // Key and buttons definitions
@@ -46,9 +58,9 @@ static bool kbd_pressed[NUM_OF_ROWS][NUM_OF_COLS] = {};
 
 #if NUM_OF_BTNS > 0
 
-// Call end key mapped to GPIO 4
+// Call end key is the power key
 static const char btn_entries[NUM_OF_BTNS] = { KEY_POWER };
-static const uint8_t btn_pins[NUM_OF_BTNS] = { 4 };
+static const uint8_t btn_pins[NUM_OF_BTNS] = { PIN_POWER_KEY };
 #endif
 
 #pragma GCC diagnostic pop
@@ -232,11 +244,10 @@ static void handle_key_event(uint r, uint c, bool pressed)
 	kbd_pressed[r][c] = pressed;
 }
 
-static int64_t timer_task(alarm_id_t id, void *user_data)
+static void scan_timer_callback(struct timer *timer)
 {
-	(void)id;
-	(void)user_data;
 	uint c, r, i;
+	uint32_t period_ms;
 	bool pressed;
 
 	for (c = 0; c < NUM_OF_COLS; c++) {
@@ -269,8 +280,14 @@ static int64_t timer_task(alarm_id_t id, void *user_data)
 	}
 #endif
 
-	// negative value means interval since last alarm time
-	return -(reg_get_value(REG_ID_FRQ) * 1000);
+	period_ms = reg_get_value(REG_ID_FRQ);
+	if (self.low_power || self.battery_critical)
+		period_ms = MAX(period_ms, KEY_LOW_POWER_SCAN_MS);
+
+	// Period of zero stops scanning
+	if (period_ms > 0) {
+		timer_advance_us(timer, (uint64_t)period_ms * 1000);
+	}
 }
 
 void keyboard_inject_event(uint8_t key, enum key_state state)
@@ -279,6 +296,16 @@ void keyboard_inject_event(uint8_t key, enum key_state state)
 	item.scancode = key;
 	item.state = state;
 
+	TRACE(TRACE_KEY, key, state);
+
+	if (state == KEY_STATE_PRESSED) {
+		if (key == _KEY_CAPSLOCK) {
+			keyboard_set_lock_state(!self.capslock, self.numlock);
+		} else if (key == _KEY_NUMLOCK) {
+			keyboard_set_lock_state(self.capslock, !self.numlock);
+		}
+	}
+
 	if (!fifo_enqueue(item)) {
 		if (reg_is_bit_set(REG_ID_CFG, CFG_OVERFLOW_INT)) {
 			reg_set_bit(REG_ID_INT, INT_OVERFLOW);
@@ -343,6 +370,67 @@ void keyboard_remove_key_callback(void *func)
 	}
 }
 
+void keyboard_add_lock_callback(struct key_lock_callback *callback)
+{
+	// first callback
+	if (!self.lock_callbacks) {
+		self.lock_callbacks = callback;
+		return;
+	}
+
+	// find last and insert after
+	struct key_lock_callback *cb = self.lock_callbacks;
+	while (cb->next)
+		cb = cb->next;
+
+	cb->next = callback;
+}
+
+void keyboard_set_low_power(bool enable)
+{
+	self.low_power = enable;
+}
+
+bool keyboard_power_key_idle(void)
+{
+	return (power_hold_key.state == KEY_STATE_IDLE);
+}
+
+static void battery_level_cb(enum battery_level level)
+{
+	self.battery_critical = (level == BATTERY_LEVEL_CRITICAL);
+}
+static struct battery_callback battery_callback = { .func = battery_level_cb };
+
+bool keyboard_get_capslock(void)
+{
+	return self.capslock;
+}
+
+bool keyboard_get_numlock(void)
+{
+	return self.numlock;
+}
+
+void keyboard_set_lock_state(bool capslock, bool numlock)
+{
+	const bool caps_changed = (capslock != self.capslock);
+	const bool num_changed = (numlock != self.numlock);
+
+	if (!caps_changed && !num_changed) {
+		return;
+	}
+
+	self.capslock = capslock;
+	self.numlock = numlock;
+
+	struct key_lock_callback *cb = self.lock_callbacks;
+	while (cb) {
+		cb->func(caps_changed, num_changed);
+		cb = cb->next;
+	}
+}
+
 void keyboard_init(void)
 {
 	uint i;
@@ -404,5 +492,8 @@ void keyboard_init(void)
 	sym_hold_key.col = 1;
 	sym_hold_key.state = KEY_STATE_IDLE;
 
-	add_alarm_in_ms(reg_get_value(REG_ID_FRQ), timer_task, NULL, true);
+	battery_add_level_callback(&battery_callback);
+
+	self.scan_timer.func = scan_timer_callback;
+	timer_arm_ms(&self.scan_timer, reg_get_value(REG_ID_FRQ));
 }
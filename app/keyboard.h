@@ -22,10 +22,29 @@ struct key_callback
 	struct key_callback *next;
 };
 
+struct key_lock_callback
+{
+	void (*func)(bool caps_changed, bool num_changed);
+	struct key_lock_callback *next;
+};
+
 void keyboard_inject_event(uint8_t key, enum key_state state);
 void keyboard_inject_power_key();
 
 void keyboard_add_key_callback(struct key_callback *callback);
 void keyboard_remove_key_callback(void *func);
 
+void keyboard_add_lock_callback(struct key_lock_callback *callback);
+
+// Scan less often, for when nothing needs low latency input
+void keyboard_set_low_power(bool enable);
+
+// No power key press is in progress, or its release has been handled
+bool keyboard_power_key_idle(void);
+
+// Lock state is toggled by lock key presses, or set by the host
+bool keyboard_get_capslock(void);
+bool keyboard_get_numlock(void);
+void keyboard_set_lock_state(bool capslock, bool numlock);
+
 void keyboard_init(void);
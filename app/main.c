@@ -9,6 +9,7 @@
 #include "hardware/structs/scb.h"
 
 #include "backlight.h"
+#include "battery.h"
 #include "debug.h"
 #include "gpioexp.h"
 #include "interrupt.h"
@@ -17,6 +18,9 @@
 #include "reg.h"
 #include "touchpad.h"
 #include "pi.h"
+#include "timer.h"
+#include "update.h"
+#include "usb.h"
 
 // https://github.com/micropython/micropython/blob/5114f2c1ea7c05fc7ab920299967595cfc5307de/ports/rp2/modmachine.c#L179
 // https://github.com/raspberrypi/pico-extras/issues/41
@@ -33,6 +37,12 @@ static void gpio_irq(uint gpio, uint32_t events)
 // TODO: Microphone
 int main(void)
 {
+	// Alarms of every module are timers
+	timer_init();
+
+	// Before anything else can fail on the first boot of an update
+	update_check_boot();
+
 	// This order is important because it determines callback call order
 
 #ifndef NDEBUG
@@ -43,6 +53,14 @@ int main(void)
 
 	reg_init();
 
+#ifdef ENABLE_USB
+	// Debug output until now waits in the log ring, drained once USB runs
+	usb_init();
+#endif
+
+	update_erase_staging();
+	update_worker_init();
+
 	backlight_init();
 
 	gpioexp_init();
@@ -62,6 +80,8 @@ int main(void)
 
 	pi_power_init();
 
+	battery_init();
+
 	pi_power_on(POWER_ON_FW_INIT);
 
 #ifndef NDEBUG
@@ -70,6 +90,8 @@ int main(void)
 
 	while (true) {
 		__wfe();
+
+		pi_sleep_task();
 	}
 
 	return 0;
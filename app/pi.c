@@ -1,13 +1,19 @@
+#include "app_config.h"
 #include "pi.h"
 #include "reg.h"
 #include "keyboard.h"
 #include "gpioexp.h"
 #include "backlight.h"
+#include "battery.h"
 #include "fifo.h"
-#include "hardware/adc.h"
+#include "rtc.h"
+#include "touch_fifo.h"
+#include "timer.h"
+#include "trace.h"
 #include <hardware/pwm.h>
 
 #include "hardware/clocks.h"
+#include "hardware/rtc.h"
 #include "hardware/rosc.h"
 #include "hardware/structs/scb.h"
 
@@ -16,16 +22,26 @@
 
 #define LED_FLASH_CYCLE_MS 3000
 #define LED_FLASH_ON_MS 200
+#define LED_LOCK_LEVEL 0x20 // White, dim enough to not look like a notification
+
+static void pi_power_on_timer_callback(struct timer *timer);
+static void pi_shutdown_timer_callback(struct timer *timer);
+static void pi_power_off_timer_callback(struct timer *timer);
+static void pi_led_flash_timer_callback(struct timer *timer);
 
 // Globals
-alarm_id_t g_power_on_alarm = -1;
-alarm_id_t g_shutdown_alarm = -1;
-alarm_id_t g_power_off_alarm = -1;
+static struct timer g_power_on_timer = { .func = pi_power_on_timer_callback };
+static struct timer g_shutdown_timer = { .func = pi_shutdown_timer_callback };
+static struct timer g_power_off_timer = { .func = pi_power_off_timer_callback };
+static enum power_on_reason g_power_on_reason;
+static bool g_power_off_dormant;
+static volatile bool g_rewake_sleep_pending;
 uint8_t g_dormant_reentry = 0;
 
 struct led_state g_led_state;
 struct led_state g_led_flash_state;
-alarm_id_t g_led_flash_alarm = -1;
+static struct timer g_led_flash_timer = { .func = pi_led_flash_timer_callback };
+bool g_led_lock_on = false;
 
 enum pi_state
 {
@@ -35,16 +51,28 @@ enum pi_state
 
 static enum pi_state g_pi_state;
 
-void pi_power_init(void)
+// Shut down cleanly before the battery browns out and corrupts the SD card
+static void battery_level_cb(enum battery_level level)
 {
-	adc_init();
-	adc_gpio_init(PIN_BAT_ADC);
-	adc_select_input(0);
+	if ((level != BATTERY_LEVEL_CRITICAL) || (g_pi_state == PI_STATE_OFF)) {
+		return;
+	}
+
+	pi_schedule_power_off(0 /* shutdown immediately */, reg_get_shutdown_grace_ms(),
+		true /* dormant */);
+}
+static struct battery_callback battery_callback = { .func = battery_level_cb };
 
+void pi_power_init(void)
+{
 	gpio_init(PIN_PI_PWR);
 	gpio_set_dir(PIN_PI_PWR, GPIO_OUT);
 	gpio_put(PIN_PI_PWR, 0);
 	g_pi_state = PI_STATE_OFF;
+
+	battery_add_level_callback(&battery_callback);
+
+	TRACE(TRACE_POWER, 0, 0);
 }
 
 void pi_power_on(enum power_on_reason reason)
@@ -55,11 +83,26 @@ void pi_power_on(enum power_on_reason reason)
 		return;
 	}
 
+	// Booting on a critical battery would brown out and may corrupt the SD
+	// card. The level is stale after a dormant sleep, so measure it again.
+	if (battery_get_level() == BATTERY_LEVEL_CRITICAL) {
+		battery_resample();
+	}
+	if (battery_get_level() == BATTERY_LEVEL_CRITICAL) {
+
+		// Releasing the power key sleeps again until the next press
+		g_dormant_reentry = 1;
+		return;
+	}
+
 	gpio_put(PIN_PI_PWR, 1);
 	g_pi_state = PI_STATE_ON;
 
+	TRACE(TRACE_POWER, 1, reason);
+
 	// Clear any input queued while Pi was off
 	fifo_flush();
+	touch_fifo_flush();
 
 	// LED green while booting until driver loaded
 	state.setting = LED_SET_ON;
@@ -82,16 +125,14 @@ void pi_power_off(void)
 	g_pi_state = PI_STATE_OFF;
 }
 
-static int64_t pi_power_on_alarm_callback(alarm_id_t _, void* enum_reason)
+static void pi_power_on_timer_callback(struct timer *timer)
 {
-	if (g_power_on_alarm < 0) {
-		return 0;
-	}
+	(void)timer;
 
-	pi_cancel_power_alarms();
-	pi_power_on((enum power_on_reason)enum_reason);
+	TRACE(TRACE_ALARM, TRACE_ALARM_POWER_ON, 0);
 
-	return 0;
+	pi_cancel_power_alarms();
+	pi_power_on(g_power_on_reason);
 }
 
 void pi_reboot(enum power_on_reason reason)
@@ -99,102 +140,62 @@ void pi_reboot(enum power_on_reason reason)
 	// Turn off Pi
 	pi_power_off();
 
-	// Cancel existing alarm if scheduled
-	if (g_power_on_alarm >= 0) {
-		cancel_alarm(g_power_on_alarm);
-		g_power_on_alarm = -1;
-	}
-
-	// Schedule new alarm aftel allowing time for Pi to power off
-	g_power_on_alarm = add_alarm_in_ms(500, pi_power_on_alarm_callback, (void*)reason, true);
+	// Replaces an existing alarm, after allowing time for Pi to power off
+	g_power_on_reason = reason;
+	timer_arm_ms(&g_power_on_timer, 500);
 }
 
 void pi_schedule_power_on(uint32_t ms)
 {
-	// Cancel existing alarm if scheduled
-	if (g_power_on_alarm >= 0) {
-		cancel_alarm(g_power_on_alarm);
-		g_power_on_alarm = -1;
-	}
-
-	// Schedule new alarm
-	g_power_on_alarm = add_alarm_in_ms(ms, pi_power_on_alarm_callback,
-		(void*)POWER_ON_REWAKE, true);
+	// Replaces an existing alarm
+	g_power_on_reason = POWER_ON_REWAKE;
+	timer_arm_ms(&g_power_on_timer, ms);
 }
 
-static int64_t pi_shutdown_alarm_callback(alarm_id_t _, void* __)
+static void pi_shutdown_timer_callback(struct timer *timer)
 {
-	if (g_shutdown_alarm < 0) {
-		return 0;
-	}
+	(void)timer;
 
-	keyboard_inject_power_key();
+	TRACE(TRACE_ALARM, TRACE_ALARM_SHUTDOWN, 0);
 
-	return 0;
+	keyboard_inject_power_key();
 }
 
-static int64_t pi_power_off_alarm_callback(alarm_id_t _, void* int_dormant)
+static void pi_power_off_timer_callback(struct timer *timer)
 {
-	uint8_t dormant = (int_dormant) ? 1 : 0;
+	(void)timer;
 
-	if (g_power_off_alarm < 0) {
-		return 0;
-	}
+	TRACE(TRACE_ALARM, TRACE_ALARM_POWER_OFF, 0);
 
 	pi_power_off();
-	if (dormant) {
-		g_dormant_reentry = dormant;
+	if (g_power_off_dormant) {
+		g_dormant_reentry = 1;
 		dormant_until_power_key_down();
-	}
 
-	return 0;
+	// Nothing else to do until the Pi is woken up
+	} else if (timer_is_armed(&g_power_on_timer) && (g_power_on_reason == POWER_ON_REWAKE)) {
+		g_rewake_sleep_pending = true;
+	}
 }
 
 void pi_schedule_power_off(uint32_t shutdown_ms, uint32_t poweroff_ms, uint8_t dormant)
 {
-	// Cancel shutdown alarm
-	if (g_shutdown_alarm >= 0) {
-		cancel_alarm(g_shutdown_alarm);
-		g_shutdown_alarm = -1;
-	}
-
-	// Cancel power off alarm
-	if (g_power_off_alarm >= 0) {
-		cancel_alarm(g_power_off_alarm);
-		g_power_off_alarm = -1;
-	}
-
-	// Schedule shutdown alarm
+	// Schedule shutdown alarm, replacing an existing one
 	if (shutdown_ms < 10) {
 		shutdown_ms = 10;
 	}
-	g_shutdown_alarm = add_alarm_in_ms(shutdown_ms,
-		pi_shutdown_alarm_callback, NULL, true);
+	timer_arm_ms(&g_shutdown_timer, shutdown_ms);
 
-	// Schedule poweroff alarm
-	g_power_off_alarm = add_alarm_in_ms(shutdown_ms + poweroff_ms,
-		pi_power_off_alarm_callback, (void*)((dormant) ? 1 : 0), true);
+	// Schedule poweroff alarm, replacing an existing one
+	g_power_off_dormant = (dormant != 0);
+	timer_arm_ms(&g_power_off_timer, shutdown_ms + poweroff_ms);
 }
 
 void pi_cancel_power_alarms()
 {
-	// Cancel shutdown alarm
-	if (g_shutdown_alarm >= 0) {
-		cancel_alarm(g_shutdown_alarm);
-		g_shutdown_alarm = -1;
-	}
-
-	// Cancel power off alarm
-	if (g_power_off_alarm >= 0) {
-		cancel_alarm(g_power_off_alarm);
-		g_power_off_alarm = -1;
-	}
-
-	// Cancel power on alarm
-	if (g_power_on_alarm >= 0) {
-		cancel_alarm(g_power_on_alarm);
-		g_power_on_alarm = -1;
-	}
+	timer_cancel(&g_shutdown_timer);
+	timer_cancel(&g_power_off_timer);
+	timer_cancel(&g_power_on_timer);
 }
 
 static void led_sync(bool enable, uint8_t r, uint8_t g, uint8_t b)
@@ -228,6 +229,30 @@ static void led_sync(bool enable, uint8_t r, uint8_t g, uint8_t b)
 
 }
 
+// Caps lock indication replaces the steady LED setting
+static void led_sync_steady(void)
+{
+	if (g_led_lock_on) {
+		led_sync(true, LED_LOCK_LEVEL, LED_LOCK_LEVEL, LED_LOCK_LEVEL);
+	} else {
+		led_sync((g_led_state.setting == LED_SET_ON), g_led_state.r, g_led_state.g,  g_led_state.b);
+	}
+}
+
+static void led_lock_cb(bool caps_changed, bool num_changed)
+{
+	(void)caps_changed;
+	(void)num_changed;
+
+	g_led_lock_on = reg_is_bit_set(REG_ID_CF2, CF2_LOCK_LED) && keyboard_get_capslock();
+
+	// A running flash picks up the change on its next toggle
+	if (!timer_is_armed(&g_led_flash_timer)) {
+		led_sync_steady();
+	}
+}
+static struct key_lock_callback led_lock_callback = { .func = led_lock_cb };
+
 void led_init(void)
 {
 	// Set up PWM channels
@@ -239,17 +264,16 @@ void led_init(void)
 	g_led_state.setting = LED_SET_OFF;
 	g_led_flash_state.setting = LED_SET_OFF;
 	led_sync(true, 0, 0, 0);
+
+	keyboard_add_lock_callback(&led_lock_callback);
 }
 
-static int64_t pi_led_flash_alarm_callback(alarm_id_t _, void* __)
+static void pi_led_flash_timer_callback(struct timer *timer)
 {
 	static bool led_enabled = false;
 	uint32_t alarm_ms;
 
-	// Flash canceled
-	if (g_led_flash_alarm < 0) {
-		return 0;
-	}
+	TRACE(TRACE_ALARM, TRACE_ALARM_LED_FLASH, 0);
 
 	// Toggle LED
 	led_enabled = !led_enabled;
@@ -259,7 +283,7 @@ static int64_t pi_led_flash_alarm_callback(alarm_id_t _, void* __)
 		if (led_enabled) {
 			led_sync(true, g_led_flash_state.r, g_led_flash_state.g,  g_led_flash_state.b);
 		} else {
-			led_sync((g_led_state.setting == LED_SET_ON), g_led_state.r, g_led_state.g,  g_led_state.b);
+			led_sync_steady();
 		}
 
 	// Regular flash
@@ -268,18 +292,15 @@ static int64_t pi_led_flash_alarm_callback(alarm_id_t _, void* __)
 
 	// Flash canceled
 	} else {
-		led_sync((g_led_state.setting == LED_SET_ON), g_led_state.r, g_led_state.g,  g_led_state.b);
-		g_led_flash_alarm = -1;
-		return 0;
+		led_sync_steady();
+		return;
 	}
 
 	// Reschedule timer
 	alarm_ms = (led_enabled)
 		? LED_FLASH_ON_MS
 		: (LED_FLASH_CYCLE_MS - LED_FLASH_ON_MS);
-	g_led_flash_alarm = add_alarm_in_ms(alarm_ms, pi_led_flash_alarm_callback, NULL, true);
-
-	return 0;
+	timer_arm_ms(timer, alarm_ms);
 }
 
 static void pi_led_stop_flash_alarm_callback(uint8_t key, enum key_state state)
@@ -313,9 +334,8 @@ void led_set(struct led_state const* state)
 	if ((state->setting == LED_SET_FLASH_ON) || (state->setting == LED_SET_FLASH_UNTIL_KEY)) {
 
 		// Apply LED setting and schedule new timer using callback
-		if (g_led_flash_alarm < 0) {
-			g_led_flash_alarm = 1;
-			(void)pi_led_flash_alarm_callback(0, NULL);
+		if (!timer_is_armed(&g_led_flash_timer)) {
+			pi_led_flash_timer_callback(&g_led_flash_timer);
 		}
 
 		// Add key calback to disable flash when key is pressed
@@ -325,7 +345,7 @@ void led_set(struct led_state const* state)
 
 	// Regular on / off LED setting
 	} else {
-		led_sync((state->setting == LED_SET_ON), state->r, state->g,  state->b);
+		led_sync_steady();
 	}
 }
 
@@ -385,7 +405,7 @@ void dormant_until_power_key_down(void)
 
 	// Sleep until power key is pressed
 	sleep_run_from_xosc();
-	sleep_goto_dormant_until_pin(4, 0, 0);
+	sleep_goto_dormant_until_pin(PIN_POWER_KEY, 0, 0);
 
 	// Restore clocks, LED, backlight
 	sleep_resume(&ss);
@@ -404,38 +424,106 @@ uint8_t dormant_get_reentry_flag(void)
 static void sleep_callback(void)
 {}
 
-void dormant_seconds(int seconds)
+// Like sleep_goto_sleep_until, but the power key going down also wakes the
+// core, so IO bank 0 keeps its clock to see the edge. Interrupts are masked
+// from the key check to the WFI, which still wakes on them, so a press in
+// between is not lost.
+static void sleep_until_rtc_or_power_key(datetime_t* t)
+{
+	uint32_t irq;
+
+	gpio_set_irq_enabled(PIN_POWER_KEY, GPIO_IRQ_EDGE_FALL, true);
+
+	clocks_hw->sleep_en0 = CLOCKS_SLEEP_EN0_CLK_RTC_RTC_BITS | CLOCKS_SLEEP_EN0_CLK_SYS_IO_BITS;
+	clocks_hw->sleep_en1 = 0;
+	rtc_set_alarm(t, sleep_callback);
+	scb_hw->scr |= M0PLUS_SCR_SLEEPDEEP_BITS;
+
+	irq = save_and_disable_interrupts();
+	if (gpio_get(PIN_POWER_KEY)) {
+		__wfi();
+	}
+	restore_interrupts(irq);
+
+	rtc_disable_alarm();
+	gpio_set_irq_enabled(PIN_POWER_KEY, GPIO_IRQ_EDGE_FALL, false);
+}
+
+static uint32_t rtc_now_seconds(void)
+{
+	datetime_t t;
+
+	rtc_get_datetime(&t);
+
+	return rtc_datetime_to_seconds(&t);
+}
+
+// Sleep with only the RTC and GPIO running until the rewake alarm is due or the
+// power key is pressed. The microsecond timer stops while asleep, so the rewake
+// alarm is moved to what is left of it afterwards.
+// Runs from the main loop, an interrupt handler would not be woken by the
+// RTC alarm.
+void pi_sleep_task(void)
 {
 	struct sleep_state ss;
 	datetime_t t;
+	uint32_t now_s, wake_s, remaining_s;
 
-	// Save clocks, LED, backlight
-	sleep_prepare(&ss);
+	if (!g_rewake_sleep_pending) {
+		return;
+	}
 
-	// Get datetime offset
-	rtc_get_datetime(&t);
-	t.sec += seconds;
-	while (t.sec >= 60) {
-		t.sec -= 60;
-		t.min += 1;
+	// A power key press is left to the key scan, which boots the Pi on a
+	// hold. Sleep again once the key is released without that.
+	if (!gpio_get(PIN_POWER_KEY) || !keyboard_power_key_idle()) {
+		return;
 	}
-	while (t.min >= 60) {
-		t.min -= 60;
-		t.hour += 1;
+	g_rewake_sleep_pending = false;
+
+	// Canceled, or moved by a new rewake, since the Pi was powered off
+	if (!timer_is_armed(&g_power_on_timer) || (g_power_on_reason != POWER_ON_REWAKE)) {
+		return;
 	}
-	// May not work correctly around midnight...
-	while (t.hour >= 24) {
-		t.hour -= 24;
-		t.day += 1;
-		t.dotw = (t.dotw + 1) & 7;
+
+	remaining_s = timer_remaining_us(&g_power_on_timer) / 1000000;
+	if (remaining_s < REWAKE_SLEEP_MIN_S) {
+		return;
 	}
 
-	sleep_run_from_xosc();
-	sleep_goto_sleep_until(&t, sleep_callback);
+	// Not set by the host, count from the epoch
+	if (!rtc_running()) {
+		rtc_seconds_to_datetime(0, &t);
+		rtc_set_datetime(&t);
+
+		// Reads lag a new setting by a few RTC clock cycles
+		sleep_us(64);
+	}
 
-	// Advance RTC
-	rtc_set_datetime(&t);
+	now_s = rtc_now_seconds();
+	wake_s = now_s + remaining_s;
+
+	// Save clocks, LED, backlight
+	sleep_prepare(&ss);
+
+	// Other interrupts may wake the core early, sleep again unless the
+	// rewake is due or the power key is down
+	sleep_run_from_xosc();
+	rtc_seconds_to_datetime(wake_s, &t);
+	while ((now_s < wake_s) && gpio_get(PIN_POWER_KEY)) {
+		sleep_until_rtc_or_power_key(&t);
+		now_s = rtc_now_seconds();
+	}
 
 	// Restore clocks, LED, backlight
 	sleep_resume(&ss);
+
+	// Woken early by the power key, stay awake for the key scan
+	if (now_s < wake_s) {
+		timer_arm_ms(&g_power_on_timer, (wake_s - now_s) * 1000);
+		g_rewake_sleep_pending = true;
+		return;
+	}
+
+	pi_cancel_power_alarms();
+	pi_power_on(POWER_ON_REWAKE);
 }
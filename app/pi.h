@@ -21,6 +21,9 @@ void pi_schedule_power_on(uint32_t ms);
 void pi_schedule_power_off(uint32_t shutdown_ms, uint32_t poweroff_ms, uint8_t dormant);
 void pi_cancel_power_alarms();
 
+// Call from the main loop, sleeps while waiting to rewake a powered off Pi
+void pi_sleep_task(void);
+
 enum led_setting
 {
 	LED_SET_OFF = 0x0,
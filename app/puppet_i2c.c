@@ -1,6 +1,7 @@
 #include "puppet_i2c.h"
 
 #include "reg.h"
+#include "trace.h"
 
 #include <hardware/i2c.h>
 #include <hardware/irq.h>
@@ -20,10 +21,20 @@ static struct
 		uint8_t data;
 	} read_buffer;
 
-	uint8_t write_buffer[2];
+	uint8_t write_buffer[PACKET_MAX_OUT_LEN];
 	uint8_t write_len;
+
+	bool trace_read;
 } self;
 
+// Reading the trace must not fill it with its own I2C traffic
+static bool is_trace_reg(uint8_t reg)
+{
+	reg &= ~PACKET_WRITE_MASK;
+
+	return (reg == REG_ID_TRACE_COUNT) || (reg == REG_ID_TRACE);
+}
+
 static void irq_handler(void)
 {
 	uint32_t intr_stat = self.i2c->hw->intr_stat;
@@ -39,21 +50,32 @@ static void irq_handler(void)
 
 	// the controller sent data
 	if (intr_stat & I2C_IC_INTR_MASK_M_RX_FULL_BITS) {
-		if (self.read_buffer.reg == REG_ID_INVALID) {
-			self.read_buffer.reg = self.i2c->hw->data_cmd & 0xff;
+		const uint32_t data_cmd = self.i2c->hw->data_cmd;
+
+		// The first byte of a write is the register. A register write
+		// takes every following byte of the same write as data.
+		if ((data_cmd & I2C_IC_DATA_CMD_FIRST_DATA_BYTE_BITS)
+		 || (self.read_buffer.reg == REG_ID_INVALID)) {
+			self.read_buffer.reg = data_cmd & 0xff;
 
 			if (self.read_buffer.reg & PACKET_WRITE_MASK) {
-				// it'sq a reg write, we need to wait for the second byte before we process
+				reg_begin_write(self.read_buffer.reg);
 				return;
 			}
 		} else {
-			self.read_buffer.data = self.i2c->hw->data_cmd & 0xff;
+			self.read_buffer.data = data_cmd & 0xff;
 		}
 
 		reg_process_packet(self.read_buffer.reg, self.read_buffer.data, self.write_buffer, &self.write_len);
 
-		// ready for the next operation
-		self.read_buffer.reg = REG_ID_INVALID;
+		self.trace_read = is_trace_reg(self.read_buffer.reg);
+		if (!self.trace_read)
+			TRACE(TRACE_I2C_PACKET, self.read_buffer.reg, self.read_buffer.data);
+
+		// a read is ready for the next operation, a write waits for more data
+		if (!(self.read_buffer.reg & PACKET_WRITE_MASK)) {
+			self.read_buffer.reg = REG_ID_INVALID;
+		}
 
 		return;
 	}
@@ -62,6 +84,9 @@ static void irq_handler(void)
 	if (intr_stat & I2C_IC_INTR_MASK_M_RD_REQ_BITS) {
 		i2c_write_raw_blocking(self.i2c, self.write_buffer, self.write_len);
 
+		if (!self.trace_read)
+			TRACE(TRACE_I2C_READ, 0, self.write_len);
+
 		self.i2c->hw->clr_rd_req;
 		return;
 	}
@@ -2,21 +2,26 @@
 
 #include "app_config.h"
 #include "backlight.h"
+#include "battery.h"
 #include "fifo.h"
 #include "gpioexp.h"
 #include "puppet_i2c.h"
 #include "keyboard.h"
 #include "touchpad.h"
+#include "touch_fifo.h"
+#include "trace.h"
 #include "pi.h"
-#include "hardware/adc.h"
 #include "rtc.h"
+#include "timer.h"
 #include "update.h"
 
+#include <hardware/sync.h>
 #include <pico/stdlib.h>
 #include <RP2040.h> // TODO: When there's more than one RP chip, change this to be more generic
 #include <stdio.h>
+#include <string.h>
 
-// We don't enable this by default cause it spams quite a lot
+// We don't enable this by default cause it fills the trace quickly
 //#define DEBUG_REGS
 
 static struct
@@ -35,14 +40,56 @@ static void touch_cb(int8_t x, int8_t y)
 }
 static struct touch_callback touch_callback = { .func = touch_cb };
 
-static int64_t update_commit_alarm_callback(alarm_id_t _, void* __)
+static void update_commit_timer_callback(struct timer *timer)
 {
+	(void)timer;
+
 	update_commit_and_reboot();
 }
+static struct timer update_commit_timer = { .func = update_commit_timer_callback };
+
+static void update_handle_recv(int rc)
+{
+	// More to read or update failed
+	if (rc) {
+		reg_set_value(REG_ID_UPDATE_DATA, (rc < 0)
+			? (uint8_t)(-rc)
+			: UPDATE_RECV);
+		return;
+	}
+
+	// Update read successfully
+	reg_set_value(REG_ID_UPDATE_DATA, UPDATE_OFF);
+
+	// Called from the update worker, which every other interrupt preempts
+	const uint32_t irq = save_and_disable_interrupts();
+
+	// Send shutdown signal to OS
+	keyboard_inject_power_key();
+
+	// Power off with grace time to give Pi time to shut down
+	uint32_t shutdown_grace_ms = reg_get_shutdown_grace_ms();
+	pi_schedule_power_off(0, shutdown_grace_ms, false /* live */);
+	timer_arm_ms(&update_commit_timer, shutdown_grace_ms + 10);
+
+	restore_interrupts(irq);
+}
+static struct update_callback update_callback = { .func = update_handle_recv };
+
+void reg_begin_write(uint8_t in_reg)
+{
+	switch (in_reg & ~PACKET_WRITE_MASK) {
+	case REG_ID_UPDATE_FRAME:
+		update_frame_begin();
+		break;
+
+	default:
+		break;
+	}
+}
 
 void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, uint8_t *out_len)
 {
-	int rc;
 	const bool is_write = (in_reg & PACKET_WRITE_MASK);
 	const uint8_t reg = (in_reg & ~PACKET_WRITE_MASK);
 	uint16_t adc_value;
@@ -56,6 +103,7 @@ void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, ui
 	// common R/W registers
 	case REG_ID_CFG:
 	case REG_ID_INT:
+	case REG_ID_INT2:
 	case REG_ID_DEB:
 	case REG_ID_FRQ:
 	case REG_ID_BKL:
@@ -67,7 +115,13 @@ void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, ui
 	case REG_ID_IND:
 	case REG_ID_CF2:
 	case REG_ID_SHUTDOWN_GRACE:
+	case REG_ID_BAT_CAL:
+	case REG_ID_BAT_LOW:
+	case REG_ID_BAT_CRITICAL:
 	case REG_ID_TOUCHPAD_MIN_SQUAL:
+	case REG_ID_TOUCHPAD_FULL_SQUAL:
+	case REG_ID_TOUCHPAD_FILTER_MIN:
+	case REG_ID_TOUCHPAD_FILTER_BETA:
 	{
 		if (is_write) {
 			reg_set_value(reg, in_data);
@@ -123,6 +177,13 @@ void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, ui
 		break;
 
 	case REG_ID_TOUCHPAD_VAL:
+		// Touchpad bus is in use by a passthrough transfer
+		if (touchpad_xfer_get_status() == TOUCHPAD_XFER_BUSY) {
+			out_buffer[0] = 0;
+			*out_len = is_write ? 0 : sizeof(uint8_t);
+			break;
+		}
+
 		if (is_write) {
 			touchpad_write_i2c_u8(reg_get_value(REG_ID_TOUCHPAD_REG), in_data);
 		} else {
@@ -131,14 +192,48 @@ void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, ui
 		}
 		break;
 
+	case REG_ID_TOUCHPAD_XFER_REG:
+	case REG_ID_TOUCHPAD_XFER_LEN:
+		if (is_write) {
+			reg_set_value(reg, in_data);
+			if (reg == REG_ID_TOUCHPAD_XFER_REG) {
+				touchpad_xfer_reset_data();
+			}
+		} else {
+			out_buffer[0] = reg_get_value(reg);
+			*out_len = sizeof(uint8_t);
+		}
+		break;
+
+	case REG_ID_TOUCHPAD_XFER_DATA:
+		if (is_write) {
+			touchpad_xfer_push_data(in_data);
+		} else {
+			*out_len = touchpad_xfer_get_data(out_buffer);
+		}
+		break;
+
+	case REG_ID_TOUCHPAD_XFER_CTRL:
+		if (is_write) {
+			touchpad_xfer_start(in_data, reg_get_value(REG_ID_TOUCHPAD_XFER_REG),
+				reg_get_value(REG_ID_TOUCHPAD_XFER_LEN));
+		} else {
+			out_buffer[0] = touchpad_xfer_get_status();
+			*out_len = sizeof(uint8_t);
+		}
+		break;
+
 	case REG_ID_TOUCHPAD_LED:
 		if (is_write) {
-			touchpad_set_led_power(in_data);
+			if (touchpad_xfer_get_status() != TOUCHPAD_XFER_BUSY) {
+				touchpad_set_led_power(in_data);
+			}
 			reg_set_value(reg, in_data);
 		} else {
 			out_buffer[0] = reg_get_value(reg);
 			*out_len = sizeof(uint8_t);
 		}
+		break;
 
 	case REG_ID_GIO: // gpio value
 	{
@@ -253,31 +348,49 @@ void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, ui
 	case REG_ID_UPDATE_DATA:
 	{
 		if (is_write) {
+			update_recv(in_data);
+		} else {
+			out_buffer[0] = reg_get_value(REG_ID_UPDATE_DATA);
+			*out_len = sizeof(uint8_t);
+		}
+		break;
+	}
 
-			if ((rc = update_recv(in_data))) {
-
-				// More to read or update failed
-				reg_set_value(REG_ID_UPDATE_DATA, (rc < 0)
-					? (uint8_t)(-rc)
-					: UPDATE_RECV);
-
-			// Update read successfully
-			} else {
-
-				reg_set_value(REG_ID_UPDATE_DATA, UPDATE_OFF);
+	case REG_ID_UPDATE_FRAME:
+	{
+		if (is_write) {
+			update_frame_recv(in_data);
+		} else {
+			out_buffer[0] = update_frame_get_status();
+			out_buffer[1] = update_frame_get_next_seq();
+			*out_len = sizeof(uint8_t) * 2;
+		}
+		break;
+	}
 
-				// Send shutdown signal to OS
-				keyboard_inject_power_key();
+	case REG_ID_UPDATE_SKIPPED:
+	{
+		if (!is_write) {
+			out_buffer[0] = update_get_skipped_sectors();
+			*out_len = sizeof(uint8_t);
+		}
+		break;
+	}
 
-				// Power off with grace time to give Pi time to shut down
-				uint32_t shutdown_grace_ms = reg_get_shutdown_grace_ms();
-				pi_schedule_power_off(0, shutdown_grace_ms, false /* live */);
-				add_alarm_in_ms(shutdown_grace_ms + 10,
-					update_commit_alarm_callback, NULL, true);
-			}
+	case REG_ID_UPDATE_PROGRESS:
+	{
+		if (!is_write) {
+			*out_len = update_pack_progress(out_buffer);
+		}
+		break;
+	}
 
+	case REG_ID_UPDATE_BOOT:
+	{
+		if (is_write) {
+			update_confirm_boot();
 		} else {
-			out_buffer[0] = reg_get_value(REG_ID_UPDATE_DATA);
+			out_buffer[0] = update_get_boot_state();
 			*out_len = sizeof(uint8_t);
 		}
 		break;
@@ -297,8 +410,12 @@ void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, ui
 			} else if (in_data) {
 				pi_cancel_power_alarms();
 
+				// The Pi can talk to an updated firmware, keep it
+				update_confirm_boot();
+
 				// Clear any input queued while driver was unloaded
 				fifo_flush();
+				touch_fifo_flush();
 			}
 
 		} else {
@@ -323,17 +440,34 @@ void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, ui
 		break;
 
 	case REG_ID_ADC:
-		adc_value = adc_read();
+	case REG_ID_BAT_MV:
+		adc_value = (reg == REG_ID_ADC) ? battery_get_raw() : battery_get_mv();
 		out_buffer[0] = (uint8_t)(adc_value & 0x00FF);
 		out_buffer[1] = (uint8_t)((adc_value & 0xFF00) >> 8);
 		*out_len = sizeof(uint8_t) * 2;
 		break;
 
-	case REG_ID_KEY:
-		out_buffer[0] = fifo_count();
+	case REG_ID_BAT_PCT:
+		out_buffer[0] = battery_get_percent();
+		*out_len = sizeof(uint8_t);
+		break;
+
+	case REG_ID_BAT_LEVEL:
+		out_buffer[0] = battery_get_level();
 		*out_len = sizeof(uint8_t);
 		break;
 
+	case REG_ID_KEY:
+		if (is_write) {
+			keyboard_set_lock_state((in_data & KEY_CAPSLOCK), (in_data & KEY_NUMLOCK));
+		} else {
+			out_buffer[0] = fifo_count();
+			out_buffer[0] |= keyboard_get_capslock() ? KEY_CAPSLOCK : 0x00;
+			out_buffer[0] |= keyboard_get_numlock() ? KEY_NUMLOCK : 0x00;
+			*out_len = sizeof(uint8_t);
+		}
+		break;
+
 	case REG_ID_FIF:
 	{
 		struct fifo_item item = fifo_dequeue();
@@ -344,6 +478,38 @@ void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, ui
 		break;
 	}
 
+	case REG_ID_TOUCH_FIFO_COUNT:
+		out_buffer[0] = touch_fifo_count();
+		*out_len = sizeof(uint8_t);
+		break;
+
+	case REG_ID_TOUCH_FIFO:
+	{
+		// Fixed length response, first byte is number of valid samples
+		memset(out_buffer, 0, 1 + TOUCH_FIFO_BURST * TOUCH_FIFO_ITEM_LEN);
+		out_buffer[0] = touch_fifo_pack(&out_buffer[1], TOUCH_FIFO_BURST);
+		*out_len = 1 + TOUCH_FIFO_BURST * TOUCH_FIFO_ITEM_LEN;
+		break;
+	}
+
+	case REG_ID_TRACE_COUNT:
+		if (is_write) {
+			trace_clear();
+		} else {
+			out_buffer[0] = trace_count();
+			*out_len = sizeof(uint8_t);
+		}
+		break;
+
+	case REG_ID_TRACE:
+	{
+		// Fixed length response, first byte is number of valid events
+		memset(out_buffer, 0, 1 + TRACE_BURST * TRACE_EVENT_LEN);
+		out_buffer[0] = trace_pack(&out_buffer[1], TRACE_BURST);
+		*out_len = 1 + TRACE_BURST * TRACE_EVENT_LEN;
+		break;
+	}
+
 	case REG_ID_RST:
 		NVIC_SystemReset();
 		break;
@@ -355,6 +521,32 @@ void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, ui
 	}
 }
 
+uint8_t reg_get_read_len(uint8_t reg)
+{
+	switch (reg & ~PACKET_WRITE_MASK) {
+	case REG_ID_FIF:
+	case REG_ID_ADC:
+	case REG_ID_BAT_MV:
+	case REG_ID_UPDATE_FRAME:
+		return sizeof(uint8_t) * 2;
+
+	case REG_ID_TOUCH_FIFO:
+		return 1 + TOUCH_FIFO_BURST * TOUCH_FIFO_ITEM_LEN;
+
+	case REG_ID_TRACE:
+		return 1 + TRACE_BURST * TRACE_EVENT_LEN;
+
+	case REG_ID_TOUCHPAD_XFER_DATA:
+		return TOUCHPAD_XFER_MAX;
+
+	case REG_ID_UPDATE_PROGRESS:
+		return UPDATE_PROGRESS_LEN;
+
+	default:
+		return sizeof(uint8_t);
+	}
+}
+
 uint8_t reg_get_value(enum reg_id reg)
 {
 	return self.regs[reg];
@@ -362,11 +554,11 @@ uint8_t reg_get_value(enum reg_id reg)
 
 void reg_set_value(enum reg_id reg, uint8_t value)
 {
+	self.regs[reg] = value;
+
 #ifdef DEBUG_REGS
-	printf("%s: reg: 0x%02X, val: 0x%02X (%d)\r\n", __func__, reg, value, value);
+	TRACE(TRACE_REG, reg, value);
 #endif
-
-	self.regs[reg] = value;
 }
 
 bool reg_is_bit_set(enum reg_id reg, uint8_t bit)
@@ -376,20 +568,20 @@ bool reg_is_bit_set(enum reg_id reg, uint8_t bit)
 
 void reg_set_bit(enum reg_id reg, uint8_t bit)
 {
+	self.regs[reg] |= bit;
+
 #ifdef DEBUG_REGS
-	printf("%s: reg: 0x%02X, bit: %d\r\n", __func__, reg, bit);
+	TRACE(TRACE_REG, reg, self.regs[reg]);
 #endif
-
-	self.regs[reg] |= bit;
 }
 
 void reg_clear_bit(enum reg_id reg, uint8_t bit)
 {
+	self.regs[reg] &= ~bit;
+
 #ifdef DEBUG_REGS
-	printf("%s: reg: 0x%02X, bit: %d\r\n", __func__, reg, bit);
+	TRACE(TRACE_REG, reg, self.regs[reg]);
 #endif
-
-	self.regs[reg] &= ~bit;
 }
 
 void reg_init(void)
@@ -408,9 +600,16 @@ void reg_init(void)
 
 	reg_set_value(REG_ID_SHUTDOWN_GRACE, 30);
 
+	reg_set_value(REG_ID_BAT_LOW, 3500 / BATTERY_THRESHOLD_STEP_MV);
+	reg_set_value(REG_ID_BAT_CRITICAL, 3400 / BATTERY_THRESHOLD_STEP_MV);
+
 	reg_set_value(REG_ID_TOUCHPAD_MIN_SQUAL, 16);
+	reg_set_value(REG_ID_TOUCHPAD_FULL_SQUAL, 48);
+	reg_set_value(REG_ID_TOUCHPAD_FILTER_MIN, 95);
+	reg_set_value(REG_ID_TOUCHPAD_FILTER_BETA, 16);
 
 	touchpad_add_touch_callback(&touch_callback);
+	update_add_recv_callback(&update_callback);
 }
 
 
@@ -29,6 +29,15 @@ enum reg_id
 	REG_ID_TOY = 0x16, // touch delta y since last read, at most (-128 to 127)
 
 	REG_ID_ADC = 0x17,
+	REG_ID_INT2 = 0x18, // interrupt status 2, valid when INT_INT2 is set
+
+	REG_ID_BAT_MV = 0x19, // Averaged battery voltage in mV
+	REG_ID_BAT_PCT = 0x1A, // Battery percentage from the discharge curve
+	REG_ID_BAT_CAL = 0x1B, // Signed battery voltage calibration offset in mV
+	REG_ID_BAT_LOW = 0x1C, // Low battery threshold, in BATTERY_THRESHOLD_STEP_MV
+	REG_ID_BAT_CRITICAL = 0x1D, // Critical battery threshold, shuts down the Pi
+	REG_ID_BAT_LEVEL = 0x1E, // Battery level against the thresholds (see `battery_level` in battery.h)
+
 	REG_ID_LED    = 0x20,
 	REG_ID_LED_R  = 0x21,
 	REG_ID_LED_G  = 0x22,
@@ -51,15 +60,39 @@ enum reg_id
 
 	REG_ID_UPDATE_DATA = 0x30, // Write HEX data to start firmware update mode
 	// Read to get update mode (off, receiving, failed)
+	REG_ID_UPDATE_FRAME = 0x31, // Write a binary update frame in one I2C write
+	// Read for the frame status and next sequence number
+	REG_ID_UPDATE_SKIPPED = 0x32, // Sectors of the last update already in the staging area
+	REG_ID_UPDATE_PROGRESS = 0x33, // Burst read of update progress counters
+	REG_ID_UPDATE_BOOT = 0x34, // Boot state after an update, write to confirm the update
 
 	// Control the touchpad over I2C
 	// Write the register number to TOUCHPAD_REG,
 	// then read or write from TOUCHPAD_VAL
 	REG_ID_TOUCHPAD_REG = 0x40,
 	REG_ID_TOUCHPAD_VAL = 0x41,
-	REG_ID_TOUCHPAD_MIN_SQUAL = 0x42, // Minimum sensor reading quality
+	REG_ID_TOUCHPAD_MIN_SQUAL = 0x42, // Sensor reading quality below which motion is ignored
 	REG_ID_TOUCHPAD_LED = 0x43, // Sensor LED power (0x0 med, 0x3 high, 0x5 low)
 
+	REG_ID_TOUCH_FIFO_COUNT = 0x44, // Number of samples in touch FIFO
+	REG_ID_TOUCH_FIFO = 0x45, // Burst read of timestamped touch samples
+
+	// Touchpad motion filter, see touch_filter.h
+	REG_ID_TOUCHPAD_FULL_SQUAL = 0x46, // Sensor reading quality for full confidence
+	REG_ID_TOUCHPAD_FILTER_MIN = 0x47, // Smoothing factor at rest, in 1/256
+	REG_ID_TOUCHPAD_FILTER_BETA = 0x48, // Smoothing factor increase with speed
+
+	// Asynchronous multi-register touchpad passthrough
+	// Write the first register and count, write data bytes if writing,
+	// then start with XFER_CTRL. INT2_TOUCHPAD_XFER is raised when done.
+	REG_ID_TOUCHPAD_XFER_REG = 0x49, // First sensor register, resets data index
+	REG_ID_TOUCHPAD_XFER_LEN = 0x4A, // Number of sensor registers
+	REG_ID_TOUCHPAD_XFER_DATA = 0x4B, // Write to queue data, read for burst of results
+	REG_ID_TOUCHPAD_XFER_CTRL = 0x4C, // Write to start transfer, read for status
+
+	REG_ID_TRACE_COUNT = 0x4D, // Number of trace events, write to clear
+	REG_ID_TRACE = 0x4E, // Burst read of oldest trace events
+
 	REG_ID_LAST,
 };
 
@@ -79,6 +112,10 @@ enum reg_id
 #define CF2_AUTO_OFF        (1 << 3) // Automatically power off Pi and sleep
 // `shutdown grace` seconds after driver is unloaded
 // Supports power saving after running `shutdown` instead of using power key
+#define CF2_USB_MOUSE_SCROLL	(1 << 4) // Should touch events scroll instead of move over USB HID
+#define CF2_LOCK_LED		(1 << 5) // Should the LED show caps lock
+#define CF2_BATTERY_INT		(1 << 6) // Should battery level changes generate interrupts
+#define CF2_TOUCHPAD_XFER_INT	(1 << 7) // Should completed touchpad passthrough transfers generate interrupts
 
 #define INT_OVERFLOW		(1 << 0)
 #define INT_CAPSLOCK		(1 << 1)
@@ -87,7 +124,10 @@ enum reg_id
 #define INT_PANIC			(1 << 4)
 #define INT_GPIO			(1 << 5)
 #define INT_TOUCH			(1 << 6)
-// Future me: If we need more INT_*, add a INT2 and use (1 << 7) here as indicator that the info is in INT2
+#define INT_INT2			(1 << 7) // Cause is in REG_ID_INT2
+
+#define INT2_TOUCHPAD_XFER	(1 << 0)
+#define INT2_BATTERY		(1 << 1) // Battery level changed, see REG_ID_BAT_LEVEL
 
 #define KEY_CAPSLOCK		(1 << 5) // Caps lock status
 #define KEY_NUMLOCK			(1 << 6) // Num lock status
@@ -102,9 +142,17 @@ enum reg_id
 #define VER_VAL				((VERSION_MAJOR << 4) | (VERSION_MINOR << 0))
 
 #define PACKET_WRITE_MASK	(1 << 7)
+#define PACKET_MAX_OUT_LEN	32 // Largest response to a single register read
+
+// Called when a write to `in_reg` starts, before its first data byte.
+// Every data byte of the write is then passed to reg_process_packet.
+void reg_begin_write(uint8_t in_reg);
 
 void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, uint8_t *out_len);
 
+// Upper bound on bytes returned by reading a register
+uint8_t reg_get_read_len(uint8_t reg);
+
 uint8_t reg_get_value(enum reg_id reg);
 void reg_set_value(enum reg_id reg, uint8_t value);
 
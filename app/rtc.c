@@ -17,9 +17,27 @@ static int zeller(int year, int month, int day)
 	month = (month+9) % 12;
 	return leap (year) + month*30 + ((6*month+5)/10) + day + 1;
 }
+// 0 is Sunday, as in datetime_t
 static int dow(int year, int month, int day)
 {
-	return (zeller (year, month, day) % 7);
+	return ((zeller (year, month, day) + 1) % 7);
+}
+
+static bool is_leap_year(int year)
+{
+	return ((year % 4) == 0) && (((year % 100) != 0) || ((year % 400) == 0));
+}
+
+static int days_in_year(int year)
+{
+	return is_leap_year(year) ? 366 : 365;
+}
+
+static int days_in_month(int year, int month)
+{
+	static const uint8_t days[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+	return ((month == 2) && is_leap_year(year)) ? 29 : days[month - 1];
 }
 
 void rtc_set(uint8_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t min, uint8_t sec)
@@ -49,7 +67,43 @@ uint8_t rtc_get(enum reg_id reg)
 		case REG_ID_RTC_MDAY: return (uint8_t)t.day;
 		case REG_ID_RTC_MON: return (uint8_t)t.month;
 		case REG_ID_RTC_YEAR: return (uint8_t)(t.year - 1900);
+		default: break;
 	}
 
 	return 0;
 }
+
+uint32_t rtc_datetime_to_seconds(datetime_t const* t)
+{
+	uint32_t days = t->day - 1;
+	int year, month;
+
+	for (year = RTC_EPOCH_YEAR; year < t->year; year++) {
+		days += days_in_year(year);
+	}
+	for (month = 1; month < t->month; month++) {
+		days += days_in_month(t->year, month);
+	}
+
+	return ((days * 24 + t->hour) * 60 + t->min) * 60 + t->sec;
+}
+
+void rtc_seconds_to_datetime(uint32_t seconds, datetime_t* t)
+{
+	uint32_t days = seconds / (24 * 60 * 60);
+
+	t->sec = seconds % 60;
+	t->min = (seconds / 60) % 60;
+	t->hour = (seconds / (60 * 60)) % 24;
+
+	// The epoch was a Thursday
+	t->dotw = (days + 4) % 7;
+
+	for (t->year = RTC_EPOCH_YEAR; days >= (uint32_t)days_in_year(t->year); t->year++) {
+		days -= days_in_year(t->year);
+	}
+	for (t->month = 1; days >= (uint32_t)days_in_month(t->year, t->month); t->month++) {
+		days -= days_in_month(t->year, t->month);
+	}
+	t->day = days + 1;
+}
@@ -1,5 +1,15 @@
 #include "reg.h"
 
+#include <pico/util/datetime.h>
+
+// Start of the seconds count, and of the clock if it was never set
+#define RTC_EPOCH_YEAR 1970
+
 void rtc_set(uint8_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t min, uint8_t sec);
 
 uint8_t rtc_get(enum reg_id reg);
+
+// Convert to and from seconds since the epoch, across month and leap year
+// rollovers. Valid until 2106.
+uint32_t rtc_datetime_to_seconds(datetime_t const* t);
+void rtc_seconds_to_datetime(uint32_t seconds, datetime_t* t);
@@ -0,0 +1,181 @@
+#include "app_config.h"
+#include "timer.h"
+
+#include <hardware/sync.h>
+#include <hardware/timer.h>
+#include <pico/stdlib.h>
+
+// Armed timers are kept in deadline order, so the head is the next to expire
+// and sets the hardware alarm. Arming walks the list up to its deadline,
+// canceling and expiry take constant time.
+static struct
+{
+	uint alarm_num;
+	struct timer *head;
+	uint64_t alarm_us; // deadline the hardware alarm is set for, UINT64_MAX if none
+} self;
+
+// Both called with interrupts disabled
+static void unlink(struct timer *timer)
+{
+	if (timer->prev) {
+		timer->prev->next = timer->next;
+	} else {
+		self.head = timer->next;
+	}
+
+	if (timer->next) {
+		timer->next->prev = timer->prev;
+	}
+
+	timer->armed = false;
+}
+
+static void link(struct timer *timer, uint64_t deadline_us)
+{
+	struct timer *prev = NULL;
+	struct timer *next;
+
+	if (timer->armed) {
+		unlink(timer);
+	}
+
+	// After timers with the same deadline, so they run in the order armed
+	for (next = self.head; next && (next->deadline_us <= deadline_us); next = next->next) {
+		prev = next;
+	}
+
+	timer->deadline_us = deadline_us;
+	timer->prev = prev;
+	timer->next = next;
+	if (prev) {
+		prev->next = timer;
+	} else {
+		self.head = timer;
+	}
+	if (next) {
+		next->prev = timer;
+	}
+	timer->armed = true;
+
+	// An alarm set for a later deadline is moved up, an earlier one still
+	// fires and sets the alarm for what is left
+	if (deadline_us < self.alarm_us) {
+		self.alarm_us = deadline_us;
+		if (hardware_alarm_set_target(self.alarm_num, from_us_since_boot(deadline_us))) {
+			hardware_alarm_force_irq(self.alarm_num);
+		}
+	}
+}
+
+// Take a timer due by `due_us`, with interrupts disabled
+static struct timer *take_due(uint64_t due_us)
+{
+	struct timer *timer = self.head;
+
+	if (!timer || (timer->deadline_us > due_us)) {
+		return NULL;
+	}
+
+	unlink(timer);
+
+	return timer;
+}
+
+static void alarm_irq(uint alarm_num)
+{
+	struct timer *timer;
+	uint64_t next_us;
+	uint32_t irq;
+
+	(void)alarm_num;
+
+	do {
+		irq = save_and_disable_interrupts();
+
+		// Timers armed while callbacks run leave the hardware alarm alone,
+		// it is set for the head once they are done
+		self.alarm_us = 0;
+
+		// Timers due shortly after this one run now, saving a wakeup
+		while ((timer = take_due(time_us_64() + TIMER_COALESCE_US))) {
+			restore_interrupts(irq);
+			timer->func(timer);
+			irq = save_and_disable_interrupts();
+		}
+
+		next_us = (self.head) ? self.head->deadline_us : UINT64_MAX;
+		self.alarm_us = next_us;
+		restore_interrupts(irq);
+
+	// Setting a deadline that has passed reports it was missed
+	} while ((next_us != UINT64_MAX)
+		&& hardware_alarm_set_target(self.alarm_num, from_us_since_boot(next_us)));
+}
+
+void timer_init(void)
+{
+	self.alarm_num = hardware_alarm_claim_unused(true);
+	self.alarm_us = UINT64_MAX;
+	hardware_alarm_set_callback(self.alarm_num, alarm_irq);
+}
+
+void timer_arm_us(struct timer *timer, uint64_t delay_us)
+{
+	const uint32_t irq = save_and_disable_interrupts();
+
+	link(timer, time_us_64() + delay_us);
+
+	restore_interrupts(irq);
+}
+
+void timer_arm_ms(struct timer *timer, uint32_t delay_ms)
+{
+	timer_arm_us(timer, (uint64_t)delay_ms * 1000);
+}
+
+void timer_advance_us(struct timer *timer, uint64_t period_us)
+{
+	const uint32_t irq = save_and_disable_interrupts();
+	const uint64_t now_us = time_us_64();
+	uint64_t deadline_us = timer->deadline_us + period_us;
+
+	if (deadline_us <= now_us) {
+		deadline_us = now_us + period_us;
+	}
+
+	link(timer, deadline_us);
+
+	restore_interrupts(irq);
+}
+
+void timer_cancel(struct timer *timer)
+{
+	const uint32_t irq = save_and_disable_interrupts();
+
+	if (timer->armed) {
+		unlink(timer);
+	}
+
+	restore_interrupts(irq);
+}
+
+bool timer_is_armed(struct timer const *timer)
+{
+	return timer->armed;
+}
+
+uint64_t timer_remaining_us(struct timer const *timer)
+{
+	const uint32_t irq = save_and_disable_interrupts();
+	const uint64_t now_us = time_us_64();
+	uint64_t remaining_us = 0;
+
+	if (timer->armed && (timer->deadline_us > now_us)) {
+		remaining_us = timer->deadline_us - now_us;
+	}
+
+	restore_interrupts(irq);
+
+	return remaining_us;
+}
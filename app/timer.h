@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// One-shot software timer, embedded in its owner. Re-arming it from its
+// callback makes it periodic. All timers share one hardware alarm, and
+// callbacks run from its interrupt. A timer due within TIMER_COALESCE_US
+// (1 ms) of another that expires runs with it, so up to that much early.
+struct timer
+{
+	void (*func)(struct timer *timer);
+
+	// Owned by the timer service
+	uint64_t deadline_us;
+	struct timer *prev;
+	struct timer *next;
+	bool armed;
+};
+
+void timer_init(void);
+
+// Arming an armed timer replaces its deadline
+void timer_arm_us(struct timer *timer, uint64_t delay_us);
+void timer_arm_ms(struct timer *timer, uint32_t delay_ms);
+
+// Arm for one period after the last deadline, so a periodic timer does not
+// drift. If that has already passed, arm for one period from now.
+void timer_advance_us(struct timer *timer, uint64_t period_us);
+
+void timer_cancel(struct timer *timer);
+bool timer_is_armed(struct timer const *timer);
+
+// Time left until an armed timer expires, zero if it is due or not armed
+uint64_t timer_remaining_us(struct timer const *timer);
@@ -0,0 +1,129 @@
+#include "app_config.h"
+#include "touch_fifo.h"
+
+#include <pico/stdlib.h>
+
+static struct
+{
+	struct touch_fifo_item fifo[TOUCH_FIFO_SIZE];
+	uint8_t count;
+	uint8_t read_idx;
+	uint8_t write_idx;
+
+	// Motion that did not fit the newest sample of a full FIFO
+	int32_t overflow_dx;
+	int32_t overflow_dy;
+	uint8_t overflow_squal;
+	uint32_t overflow_time_ms;
+} self;
+
+// Take as much of `*rem` as fits a sample, leaving the rest
+static int8_t take_clamped(int32_t *rem)
+{
+	const int8_t taken = MAX(INT8_MIN, MIN(*rem, INT8_MAX));
+
+	*rem -= taken;
+
+	return taken;
+}
+
+static void push(const struct touch_fifo_item item)
+{
+	self.fifo[self.write_idx++] = item;
+
+	self.write_idx %= TOUCH_FIFO_SIZE;
+	++self.count;
+}
+
+uint8_t touch_fifo_count(void)
+{
+	return self.count;
+}
+
+void touch_fifo_flush(void)
+{
+	self.write_idx = 0;
+	self.read_idx = 0;
+	self.count = 0;
+
+	self.overflow_dx = 0;
+	self.overflow_dy = 0;
+}
+
+void touch_fifo_enqueue(const struct touch_fifo_item item)
+{
+	struct touch_fifo_item *last;
+	int32_t dx, dy;
+
+	if (self.count < TOUCH_FIFO_SIZE) {
+		push(item);
+		return;
+	}
+
+	// FIFO full, coalesce into the newest sample instead of dropping motion
+	last = &self.fifo[(self.write_idx + TOUCH_FIFO_SIZE - 1) % TOUCH_FIFO_SIZE];
+
+	dx = last->dx + self.overflow_dx + item.dx;
+	dy = last->dy + self.overflow_dy + item.dy;
+
+	// What the sample can't hold waits for the next free slot
+	last->dx = take_clamped(&dx);
+	last->dy = take_clamped(&dy);
+	last->squal = MIN(last->squal, item.squal);
+	last->time_ms = item.time_ms;
+
+	if ((dx != 0) || (dy != 0)) {
+		self.overflow_squal = ((self.overflow_dx != 0) || (self.overflow_dy != 0))
+			? MIN(self.overflow_squal, item.squal)
+			: item.squal;
+		self.overflow_time_ms = item.time_ms;
+	}
+	self.overflow_dx = dx;
+	self.overflow_dy = dy;
+}
+
+struct touch_fifo_item touch_fifo_dequeue(void)
+{
+	struct touch_fifo_item item = { 0 };
+	if (self.count == 0)
+		return item;
+
+	item = self.fifo[self.read_idx++];
+	self.read_idx %= TOUCH_FIFO_SIZE;
+	--self.count;
+
+	// Freed slot takes the motion held back while full
+	if ((self.overflow_dx != 0) || (self.overflow_dy != 0)) {
+		struct touch_fifo_item overflow = {
+			.dx = take_clamped(&self.overflow_dx),
+			.dy = take_clamped(&self.overflow_dy),
+			.squal = self.overflow_squal,
+			.time_ms = self.overflow_time_ms,
+		};
+		push(overflow);
+	}
+
+	return item;
+}
+
+uint8_t touch_fifo_pack(uint8_t *out_buffer, uint8_t max_items)
+{
+	uint8_t i;
+
+	for (i = 0; (i < max_items) && (self.count > 0); i++) {
+		struct touch_fifo_item item = touch_fifo_dequeue();
+
+		// dx, dy, squal, then little-endian timestamp
+		out_buffer[0] = (uint8_t)item.dx;
+		out_buffer[1] = (uint8_t)item.dy;
+		out_buffer[2] = item.squal;
+		out_buffer[3] = (uint8_t)(item.time_ms & 0xFF);
+		out_buffer[4] = (uint8_t)((item.time_ms >> 8) & 0xFF);
+		out_buffer[5] = (uint8_t)((item.time_ms >> 16) & 0xFF);
+		out_buffer[6] = (uint8_t)((item.time_ms >> 24) & 0xFF);
+
+		out_buffer += TOUCH_FIFO_ITEM_LEN;
+	}
+
+	return i;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct touch_fifo_item
+{
+	int8_t dx;
+	int8_t dy;
+	uint8_t squal;
+	uint32_t time_ms; // ms since boot of the newest motion in this sample
+};
+
+// Size of one sample as sent over the bus, see touch_fifo_pack
+#define TOUCH_FIFO_ITEM_LEN	7
+
+uint8_t touch_fifo_count(void);
+void touch_fifo_flush(void);
+void touch_fifo_enqueue(const struct touch_fifo_item item);
+struct touch_fifo_item touch_fifo_dequeue(void);
+
+// Dequeue up to `max_items` samples into `out_buffer`, return number dequeued
+uint8_t touch_fifo_pack(uint8_t *out_buffer, uint8_t max_items);
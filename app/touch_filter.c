@@ -0,0 +1,109 @@
+#include "touch_filter.h"
+
+#include <stdlib.h>
+
+// Integer adaptive low-pass in the style of the 1-euro filter:
+// slow motion is smoothed heavily to remove jitter, fast motion passes
+// through with little lag. A confidence weight derived from the sensor's
+// surface quality reading scales how far each sample moves the filter, so
+// poor readings add lag instead of being dropped outright, without changing
+// how far the pointer moves.
+
+static int32_t squal_weight(struct touch_filter_params const *params, uint8_t squal)
+{
+	if (squal < params->min_squal) {
+		return 0;
+	}
+
+	if (squal >= params->full_squal) {
+		return 256;
+	}
+
+	return ((int32_t)(squal - params->min_squal) << 8)
+		/ (params->full_squal - params->min_squal);
+}
+
+// bind to -128 to 127
+static int32_t clamp_count(int32_t count)
+{
+	if (count > INT8_MAX) {
+		return INT8_MAX;
+	} else if (count < INT8_MIN) {
+		return INT8_MIN;
+	}
+
+	return count;
+}
+
+static int8_t filter_axis(struct touch_filter_axis *axis, struct touch_filter_params const *params,
+	int8_t in, int32_t weight)
+{
+	const int32_t target = in * 256;
+	int32_t alpha, out;
+
+	// Smoothing factor grows with speed, and with confidence
+	alpha = params->alpha_min + 1 + params->beta * abs(in);
+	if (alpha > 256) {
+		alpha = 256;
+	}
+	alpha = (alpha * weight) / 256;
+
+	axis->vel_q8 += ((target - axis->vel_q8) * alpha) / 256;
+
+	// Emit whole counts, carry the remainder to the next sample
+	axis->carry_q8 += axis->vel_q8;
+	out = clamp_count(axis->carry_q8 / 256);
+	axis->carry_q8 -= out * 256;
+
+	// Samples with no weight are ignored
+	if (weight > 0) {
+		axis->pending_q8 += target;
+	}
+	axis->pending_q8 -= out * 256;
+
+	return (int8_t)out;
+}
+
+// Lag of the low-pass behind the input, rounded to whole counts
+static int8_t flush_axis(struct touch_filter_axis *axis)
+{
+	const int32_t pending = axis->pending_q8;
+	const int32_t out = (pending >= 0)
+		? (pending + 128) / 256
+		: -((-pending + 128) / 256);
+
+	axis->vel_q8 = 0;
+	axis->carry_q8 = 0;
+	axis->pending_q8 = 0;
+
+	return (int8_t)clamp_count(out);
+}
+
+void touch_filter_reset(struct touch_filter *filter)
+{
+	filter->x.vel_q8 = 0;
+	filter->x.carry_q8 = 0;
+	filter->x.pending_q8 = 0;
+	filter->y.vel_q8 = 0;
+	filter->y.carry_q8 = 0;
+	filter->y.pending_q8 = 0;
+}
+
+bool touch_filter_flush(struct touch_filter *filter, int8_t *x, int8_t *y)
+{
+	*x = flush_axis(&filter->x);
+	*y = flush_axis(&filter->y);
+
+	return (*x != 0) || (*y != 0);
+}
+
+bool touch_filter_apply(struct touch_filter *filter, struct touch_filter_params const *params,
+	uint8_t squal, int8_t *x, int8_t *y)
+{
+	const int32_t weight = squal_weight(params, squal);
+
+	*x = filter_axis(&filter->x, params, *x, weight);
+	*y = filter_axis(&filter->y, params, *y, weight);
+
+	return (*x != 0) || (*y != 0);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Filtered velocity, sub-count remainder and motion not yet emitted, all
+// in 1/256 counts
+struct touch_filter_axis
+{
+	int32_t vel_q8;
+	int32_t carry_q8;
+	int32_t pending_q8;
+};
+
+struct touch_filter
+{
+	struct touch_filter_axis x, y;
+};
+
+struct touch_filter_params
+{
+	uint8_t min_squal;  // Samples below this surface quality are ignored
+	uint8_t full_squal; // Samples at or above this surface quality are smoothed least
+	uint8_t alpha_min;  // Smoothing factor at rest, (alpha_min + 1) / 256
+	uint8_t beta;       // Smoothing factor increase per count of speed, in 1/256
+};
+
+void touch_filter_reset(struct touch_filter *filter);
+
+// Call when motion stops, returns the motion the filter still holds back
+// and resets it. Return true if there is motion to report
+bool touch_filter_flush(struct touch_filter *filter, int8_t *x, int8_t *y);
+
+// Filter one motion sample in place
+// Return true if there is motion to report
+bool touch_filter_apply(struct touch_filter *filter, struct touch_filter_params const *params,
+	uint8_t squal, int8_t *x, int8_t *y);
@@ -1,13 +1,19 @@
 #include "touchpad.h"
 
+#include "app_config.h"
 #include "keyboard.h"
 
 #include <hardware/i2c.h>
+#include <hardware/irq.h>
 #include <pico/binary_info.h>
 #include <pico/stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "reg.h"
+#include "timer.h"
+#include "touch_fifo.h"
+#include "touch_filter.h"
 
 #define DEV_ADDR			0x3B
 
@@ -38,6 +44,9 @@
 #define BIT_OBSERV_REST2	(2 << 6)
 #define BIT_OBSERV_REST3	(3 << 6)
 
+// Motion gap after which the finger is considered lifted
+#define FILTER_RESET_MS		100
+
 #define REG_ORIENTATION		0x77
 #define BIT_ORIENTATION_X_INV (1 << 5)
 #define BIT_ORIENTATION_Y_INV (1 << 6)
@@ -48,6 +57,22 @@ static struct
 {
 	struct touch_callback *callbacks;
 	i2c_inst_t *i2c;
+
+	struct touch_filter filter;
+	struct timer idle_timer;
+	uint8_t last_squal;
+
+	struct touchpad_xfer_callback *xfer_callbacks;
+	uint xfer_irq;
+	struct
+	{
+		volatile enum touchpad_xfer_status status;
+		bool is_write;
+		uint8_t reg;
+		uint8_t len;
+		uint8_t idx;
+		uint8_t data[TOUCHPAD_XFER_MAX];
+	} xfer;
 } self;
 
 uint8_t touchpad_read_i2c_u8(uint8_t reg)
@@ -77,10 +102,44 @@ int64_t release_key(alarm_id_t id, void *user_data)
 	return 0;
 }
 
+static void report_motion(int8_t x, int8_t y, uint8_t squal)
+{
+	// Queue timestamped sample for host-side gesture processing
+	struct touch_fifo_item item;
+	item.dx = x;
+	item.dy = y;
+	item.squal = squal;
+	item.time_ms = to_ms_since_boot(get_absolute_time());
+	touch_fifo_enqueue(item);
+
+	if (self.callbacks) {
+		struct touch_callback *cb = self.callbacks;
+
+		while (cb) {
+			cb->func(x, y);
+
+			cb = cb->next;
+		}
+	}
+}
+
+// Finger lifted, report what the filter still held back of the last motion
+static void idle_timer_callback(struct timer *timer)
+{
+	int8_t x, y;
+
+	(void)timer;
+
+	if (touch_filter_flush(&self.filter, &x, &y)) {
+		report_motion(x, y, self.last_squal);
+	}
+}
+
 void touchpad_gpio_irq(uint gpio, uint32_t events)
 {
-	uint8_t reg;
+	uint8_t reg, squal;
 	int8_t x, y;
+	struct touch_filter_params params;
 
 	if ((gpio != PIN_TP_MOTION) || !(events & GPIO_IRQ_EDGE_FALL)) {
 		return;
@@ -101,21 +160,23 @@ void touchpad_gpio_irq(uint gpio, uint32_t events)
 		x = touchpad_read_i2c_u8(REG_DELTA_X);
 		y = touchpad_read_i2c_u8(REG_DELTA_Y);
 
-		// Reject if surface quality is below threshold
-		if (touchpad_read_i2c_u8(REG_SQUAL)
-		  < reg_get_value(REG_ID_TOUCHPAD_MIN_SQUAL)) {
-			return;
-		}
+		squal = touchpad_read_i2c_u8(REG_SQUAL);
 
-		if (self.callbacks) {
-			struct touch_callback *cb = self.callbacks;
+		// Filter is flushed once motion stops, so velocity is not carried
+		// over to the next touch
+		self.last_squal = squal;
+		timer_arm_ms(&self.idle_timer, FILTER_RESET_MS);
 
-			while (cb) {
-				cb->func(x, y);
-
-				cb = cb->next;
-			}
+		// Smooth motion, weighted by surface quality
+		params.min_squal = reg_get_value(REG_ID_TOUCHPAD_MIN_SQUAL);
+		params.full_squal = reg_get_value(REG_ID_TOUCHPAD_FULL_SQUAL);
+		params.alpha_min = reg_get_value(REG_ID_TOUCHPAD_FILTER_MIN);
+		params.beta = reg_get_value(REG_ID_TOUCHPAD_FILTER_BETA);
+		if (!touch_filter_apply(&self.filter, &params, squal, &x, &y)) {
+			return;
 		}
+
+		report_motion(x, y, squal);
 	}
 }
 
@@ -135,10 +196,122 @@ void touchpad_add_touch_callback(struct touch_callback *callback)
 	cb->next = callback;
 }
 
+void touchpad_add_xfer_callback(struct touchpad_xfer_callback *callback)
+{
+	// first callback
+	if (!self.xfer_callbacks) {
+		self.xfer_callbacks = callback;
+		return;
+	}
+
+	// find last and insert after
+	struct touchpad_xfer_callback *cb = self.xfer_callbacks;
+	while (cb->next)
+		cb = cb->next;
+
+	cb->next = callback;
+}
+
+static void xfer_worker_irq(void)
+{
+	uint8_t i;
+
+	if (self.xfer.status != TOUCHPAD_XFER_BUSY) {
+		return;
+	}
+
+	for (i = 0; i < self.xfer.len; i++) {
+
+		// Keep the motion handler off the sensor bus for this register only,
+		// a motion edge arriving meanwhile stays pending in the NVIC
+		irq_set_enabled(IO_IRQ_BANK0, false);
+
+		if (self.xfer.is_write) {
+			touchpad_write_i2c_u8(self.xfer.reg + i, self.xfer.data[i]);
+		} else {
+			self.xfer.data[i] = touchpad_read_i2c_u8(self.xfer.reg + i);
+		}
+
+		irq_set_enabled(IO_IRQ_BANK0, true);
+	}
+
+	self.xfer.idx = 0;
+	self.xfer.status = TOUCHPAD_XFER_DONE;
+
+	struct touchpad_xfer_callback *cb = self.xfer_callbacks;
+	while (cb) {
+		cb->func();
+		cb = cb->next;
+	}
+}
+
+void touchpad_xfer_reset_data(void)
+{
+	self.xfer.idx = 0;
+}
+
+void touchpad_xfer_push_data(uint8_t val)
+{
+	if ((self.xfer.status == TOUCHPAD_XFER_BUSY) || (self.xfer.idx >= TOUCHPAD_XFER_MAX)) {
+		return;
+	}
+
+	self.xfer.data[self.xfer.idx++] = val;
+}
+
+uint8_t touchpad_xfer_get_data(uint8_t *out_buffer)
+{
+	// Fixed length response, unread registers are zero
+	if (self.xfer.status == TOUCHPAD_XFER_BUSY) {
+		memset(out_buffer, 0, TOUCHPAD_XFER_MAX);
+	} else {
+		memcpy(out_buffer, self.xfer.data, TOUCHPAD_XFER_MAX);
+	}
+
+	return TOUCHPAD_XFER_MAX;
+}
+
+void touchpad_xfer_start(uint8_t cmd, uint8_t reg, uint8_t len)
+{
+	if (self.xfer.status == TOUCHPAD_XFER_BUSY) {
+		return;
+	}
+
+	if (((cmd != TOUCHPAD_XFER_CMD_READ) && (cmd != TOUCHPAD_XFER_CMD_WRITE))
+	 || (len == 0) || (len > TOUCHPAD_XFER_MAX)) {
+		self.xfer.status = TOUCHPAD_XFER_FAILED;
+		return;
+	}
+
+	// Writes only send data pushed since the register was set
+	if ((cmd == TOUCHPAD_XFER_CMD_WRITE) && (self.xfer.idx < len)) {
+		self.xfer.status = TOUCHPAD_XFER_FAILED;
+		return;
+	}
+
+	if (cmd == TOUCHPAD_XFER_CMD_READ) {
+		memset(self.xfer.data, 0, sizeof(self.xfer.data));
+	}
+
+	self.xfer.is_write = (cmd == TOUCHPAD_XFER_CMD_WRITE);
+	self.xfer.reg = reg;
+	self.xfer.len = len;
+	self.xfer.status = TOUCHPAD_XFER_BUSY;
+
+	irq_set_pending(self.xfer_irq);
+}
+
+enum touchpad_xfer_status touchpad_xfer_get_status(void)
+{
+	return self.xfer.status;
+}
+
 void touchpad_init(void)
 {
 	uint8_t val;
 
+	self.idle_timer.func = idle_timer_callback;
+
 	// determine the instance based on SCL pin, hope you didn't screw up the SDA pin!
 	self.i2c = i2c_instances[(PIN_SCL / 2) % 2];
 
@@ -175,6 +348,13 @@ void touchpad_init(void)
 
 	// Set power to high
 	touchpad_set_led_power(LED_HIGH);
+
+	// Passthrough transfers run below every other interrupt so that
+	// puppet I2C and key scanning are not held up by sensor bus traffic
+	self.xfer_irq = user_irq_claim_unused(true);
+	irq_set_exclusive_handler(self.xfer_irq, xfer_worker_irq);
+	irq_set_priority(self.xfer_irq, PICO_LOWEST_IRQ_PRIORITY);
+	irq_set_enabled(self.xfer_irq, true);
 }
 
 void touchpad_set_led_power(uint8_t setting)
@@ -9,9 +9,27 @@ struct touch_callback
 	struct touch_callback *next;
 };
 
+struct touchpad_xfer_callback
+{
+	void (*func)(void);
+	struct touchpad_xfer_callback *next;
+};
+
+enum touchpad_xfer_status
+{
+	TOUCHPAD_XFER_IDLE = 0,
+	TOUCHPAD_XFER_BUSY = 1,
+	TOUCHPAD_XFER_DONE = 2,
+	TOUCHPAD_XFER_FAILED = 3, // Bad command or register count, or write data short
+};
+
+#define TOUCHPAD_XFER_CMD_READ	1
+#define TOUCHPAD_XFER_CMD_WRITE	2
+
 void touchpad_gpio_irq(uint gpio, uint32_t events);
 
 void touchpad_add_touch_callback(struct touch_callback *callback);
+void touchpad_add_xfer_callback(struct touchpad_xfer_callback *callback);
 
 void touchpad_init(void);
 
@@ -19,3 +37,11 @@ uint8_t touchpad_read_i2c_u8(uint8_t reg);
 void touchpad_write_i2c_u8(uint8_t reg, uint8_t val);
 
 void touchpad_set_led_power(uint8_t val);
+
+// Passthrough transfers run from a low priority interrupt,
+// completion is signaled through the xfer callbacks
+void touchpad_xfer_reset_data(void);
+void touchpad_xfer_push_data(uint8_t val);
+uint8_t touchpad_xfer_get_data(uint8_t *out_buffer);
+void touchpad_xfer_start(uint8_t cmd, uint8_t reg, uint8_t len);
+enum touchpad_xfer_status touchpad_xfer_get_status(void);
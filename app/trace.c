@@ -0,0 +1,107 @@
+#include "app_config.h"
+#include "trace.h"
+
+#include <hardware/sync.h>
+#include <pico/stdlib.h>
+
+struct trace_event
+{
+	uint32_t time_us;
+	uint8_t id;
+	uint8_t a;
+	uint16_t b;
+};
+
+static struct
+{
+	struct trace_event events[TRACE_SIZE];
+	uint32_t write_idx; // free running
+	uint32_t read_idx; // free running
+	uint16_t lost;
+} self;
+
+// Called from interrupts and hot paths, kept in RAM to avoid flash cache misses
+void __not_in_flash_func(trace_record)(enum trace_id id, uint8_t a, uint16_t b)
+{
+	const uint32_t irq = save_and_disable_interrupts();
+
+	struct trace_event *event = &self.events[self.write_idx++ % TRACE_SIZE];
+	event->time_us = time_us_32();
+	event->id = id;
+	event->a = a;
+	event->b = b;
+
+	// Full, the oldest event was overwritten
+	if (self.write_idx - self.read_idx > TRACE_SIZE) {
+		++self.read_idx;
+
+		if (self.lost < UINT16_MAX)
+			++self.lost;
+	}
+
+	restore_interrupts(irq);
+}
+
+uint8_t trace_count(void)
+{
+	const uint32_t count = self.write_idx - self.read_idx + (self.lost ? 1 : 0);
+
+	return MIN(count, UINT8_MAX);
+}
+
+void trace_clear(void)
+{
+	const uint32_t irq = save_and_disable_interrupts();
+
+	self.read_idx = self.write_idx;
+	self.lost = 0;
+
+	restore_interrupts(irq);
+}
+
+static void pack_event(uint8_t *out_buffer, const struct trace_event *event)
+{
+	// little-endian timestamp, id, a, then little-endian b
+	out_buffer[0] = (uint8_t)(event->time_us & 0xFF);
+	out_buffer[1] = (uint8_t)((event->time_us >> 8) & 0xFF);
+	out_buffer[2] = (uint8_t)((event->time_us >> 16) & 0xFF);
+	out_buffer[3] = (uint8_t)((event->time_us >> 24) & 0xFF);
+	out_buffer[4] = event->id;
+	out_buffer[5] = event->a;
+	out_buffer[6] = (uint8_t)(event->b & 0xFF);
+	out_buffer[7] = (uint8_t)((event->b >> 8) & 0xFF);
+}
+
+uint8_t trace_pack(uint8_t *out_buffer, uint8_t max_events)
+{
+	struct trace_event event;
+	uint8_t i = 0;
+
+	while (i < max_events) {
+		const uint32_t irq = save_and_disable_interrupts();
+
+		// Report the gap before the events that follow it, at the time of
+		// the oldest of them so the timeline stays in order. Overwrites
+		// only happen when the ring is full, so that event exists.
+		if (self.lost) {
+			event.time_us = self.events[self.read_idx % TRACE_SIZE].time_us;
+			event.id = TRACE_LOST;
+			event.a = 0;
+			event.b = self.lost;
+			self.lost = 0;
+		} else if (self.read_idx != self.write_idx) {
+			event = self.events[self.read_idx++ % TRACE_SIZE];
+		} else {
+			restore_interrupts(irq);
+			break;
+		}
+
+		restore_interrupts(irq);
+
+		pack_event(out_buffer, &event);
+		out_buffer += TRACE_EVENT_LEN;
+		++i;
+	}
+
+	return i;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+// Binary event trace, formatted on the host by etc/trace_decode.py
+enum trace_id
+{
+	TRACE_LOST = 0x00, // a: 0, b: events overwritten before they were read
+	TRACE_KEY = 0x01, // a: key, b: key_state
+	TRACE_FIFO_PUSH = 0x02, // a: key, b: FIFO count after
+	TRACE_FIFO_POP = 0x03, // a: key, b: FIFO count after
+	TRACE_I2C_PACKET = 0x04, // a: register with write mask if set, b: data of writes
+	TRACE_I2C_READ = 0x05, // a: 0, b: response length
+	TRACE_ALARM = 0x06, // a: trace_alarm, b: 0
+	TRACE_POWER = 0x07, // a: 1 on, 0 off, b: power_on_reason when on
+	TRACE_REG = 0x08, // a: register, b: new value, with DEBUG_REGS in reg.c
+	TRACE_USB = 0x09, // a: trace_usb, b: 0
+};
+
+enum trace_alarm
+{
+	TRACE_ALARM_POWER_ON = 0,
+	TRACE_ALARM_SHUTDOWN = 1,
+	TRACE_ALARM_POWER_OFF = 2,
+	TRACE_ALARM_LED_FLASH = 3,
+};
+
+enum trace_usb
+{
+	TRACE_USB_IRQ = 0, // USB controller interrupt
+	TRACE_USB_WORKER = 1, // tud_task ran
+	TRACE_USB_RETRY = 2, // mutex was busy, worker retried later
+};
+
+// Size of one event as sent over the bus, see trace_pack
+#define TRACE_EVENT_LEN	8
+
+#ifdef ENABLE_TRACE
+#define TRACE(id, a, b)	trace_record((id), (a), (b))
+#else
+#define TRACE(id, a, b)	do { } while (0)
+#endif
+
+void trace_record(enum trace_id id, uint8_t a, uint16_t b);
+
+uint8_t trace_count(void);
+void trace_clear(void);
+
+// Dequeue up to `max_events` oldest events into `out_buffer`, return number dequeued
+uint8_t trace_pack(uint8_t *out_buffer, uint8_t max_events);
@@ -4,7 +4,7 @@ enum
 {
 	USB_ITF_KEYBOARD = 0,
 	USB_ITF_MOUSE,
-//	USB_ITF_HID_GENERIC,
+	USB_ITF_CONTROL,
 	USB_ITF_CDC,
 	USB_ITF_CDC2,
 	USB_ITF_VENDOR,
@@ -21,13 +21,13 @@ enum
 
 #define CFG_TUD_ENDPOINT0_SIZE		64
 
-#define CFG_TUD_HID					2//3
+#define CFG_TUD_HID					3
 #define CFG_TUD_CDC					1
 #define CFG_TUD_MSC					0
 #define CFG_TUD_MIDI				0
 #define CFG_TUD_VENDOR				1
 
-#define CFG_TUD_HID_EP_BUFSIZE		8
+#define CFG_TUD_HID_EP_BUFSIZE		32
 
 #define CFG_TUD_CDC_RX_BUFSIZE		256
 #define CFG_TUD_CDC_TX_BUFSIZE		256
@@ -1,161 +1,578 @@
+#include <assert.h>
 #include <string.h>
-#include <ctype.h>
 
+#include <hardware/dma.h>
 #include <hardware/sync.h>
 #include <hardware/flash.h>
+#include <hardware/irq.h>
 #include <hardware/watchdog.h>
 #include <hardware/structs/watchdog.h>
+#include <pico/time.h>
 
 #include <flashloader.h>
 
+#include "timer.h"
 #include "update.h"
 
-// See https://github.com/rhulme/pico-flashloader/blob/master/app.c
-struct hex_record
-{
-	uint8_t count;
-	uint16_t addr;
-	uint8_t type;
-	uint8_t data[256];
+// Hex record types, an enum so they are constants for the case labels
+enum {
+	TYPE_DATA = 0x00,
+	TYPE_EOF = 0x01,
+	TYPE_EXTSEG = 0x02,
+	TYPE_STARTSEG = 0x03,
+	TYPE_EXTLIN = 0x04,
+	TYPE_STARTLIN = 0x05,
 };
 
-#define FLASH_IMAGE_MAX_SIZE 65536
+// Offset within flash of the new app image to be flashed by the flashloader
+#define FLASH_IMAGE_OFFSET (128 * 1024)
 
-// Hex record types
-static const uint8_t TYPE_DATA = 0x00;
-static const uint8_t TYPE_EOF = 0x01;
-static const uint8_t TYPE_EXTSEG = 0x02;
-static const uint8_t TYPE_STARTSEG = 0x03;
-static const uint8_t TYPE_EXTLIN = 0x04;
-static const uint8_t TYPE_STARTLIN = 0x05;
+// The image is copied over the app, which the linker script places after the
+// flashloader, and must end below the staging area
+#define FLASH_IMAGE_MAX_SIZE \
+	(FLASH_IMAGE_OFFSET - ((uintptr_t)&__flash_binary_start - XIP_BASE))
 
-// Offset within flash of the new app image to be flashed by the flashloader
-static const uint32_t FLASH_IMAGE_OFFSET = 128 * 1024;
+// Offset within flash of a copy of the previous firmware, restored by the
+// flashloader if an update does not confirm its first boot
+#define FLASH_BACKUP_OFFSET (2 * FLASH_IMAGE_OFFSET)
+
+// Sector after the backup, tracks whether the update it guards is confirmed
+#define FLASH_BACKUP_RECORD_OFFSET (FLASH_BACKUP_OFFSET + FLASH_IMAGE_OFFSET)
+#define BACKUP_RECORD_MAGIC 0x4b434142
+
+// Sectors of an update that cannot be programmed over what the staging area
+// holds, copied there at commit. Flash is erased at boot, at commit and after
+// an update that fails or is restarted, an erase takes longer than the Pi
+// waits on a stretched I2C clock.
+#define FLASH_SPARE_OFFSET (FLASH_BACKUP_RECORD_OFFSET + FLASH_SECTOR_SIZE)
 
-// Buffer to hold the incoming data before flashing
-static union
+static_assert(FLASH_SPARE_OFFSET + FLASH_IMAGE_OFFSET <= PICO_FLASH_SIZE_BYTES,
+	"no room for the firmware backup");
+static_assert(FLASH_IMAGE_OFFSET / FLASH_SECTOR_SIZE <= 32,
+	"spare sectors do not fit the bitmap");
+
+// A new firmware must stay up this long, or see the driver load, to be kept
+#define UPDATE_TRIAL_MS (60 * 1000)
+
+// Until then a hang or crash lets the watchdog restore the backup
+#define UPDATE_TRIAL_WATCHDOG_MS 2000
+#define UPDATE_TRIAL_FEED_MS 500
+
+// Bounds of the running image, the flashloader copies updates here
+extern char __flash_binary_start;
+extern char __flash_binary_end;
+
+// Image is programmed into the staging area a sector at a time as it arrives.
+// Sectors already holding the same data, normally because they are unchanged
+// since the running image was flashed from them, are not touched.
+// The first page holds the header, it is programmed last once the length
+// and CRC are known, so an interrupted update never looks valid.
+static struct
 {
-	tFlashHeader header;
-	uint8_t buf[sizeof(tFlashHeader) + FLASH_IMAGE_MAX_SIZE];
-} flashbuf;
+	uint8_t sector[FLASH_SECTOR_SIZE];
+	uint8_t first_page[FLASH_PAGE_SIZE];
+	uint32_t pos; // bytes of header and data in the staging area
+	uint32_t base_addr; // address of the first data byte
+	uint32_t crc;
+	uint32_t spare_sectors; // bit per staging sector held in the spare area
+	uint32_t written_sectors; // bit per staging sector programmed in place
+	uint8_t skipped_sectors;
+	bool have_data;
+} staging;
+
+#ifdef UPDATE_CRC_DMA
 
+// Same CRC-32 as the flashloader's verification, on the DMA sniffer
 static uint32_t crc32(const uint8_t *data, uint32_t len, uint32_t crc)
 {
-	int bit;
+	const uint channel = dma_claim_unused_channel(true);
+	dma_channel_config config = dma_channel_get_default_config(channel);
+	uint8_t sink;
+
+	channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+	channel_config_set_read_increment(&config, true);
+	channel_config_set_write_increment(&config, false);
+	channel_config_set_sniff_enable(&config, true);
 
+	// Mode 0 is CRC-32 with the IEEE 802.3 polynomial, data not bit-reversed
+	dma_sniffer_enable(channel, 0x0, true);
+	dma_hw->sniff_data = crc;
+
+	dma_channel_configure(channel, &config, &sink, data, len, true);
+	dma_channel_wait_for_finish_blocking(channel);
+
+	crc = dma_hw->sniff_data;
+
+	dma_sniffer_disable();
+	dma_channel_unclaim(channel);
+
+	return crc;
+}
+
+#else
+
+// CRC-32 of each 4-bit value shifted to the top, polynomial 0x04C11DB7
+static const uint32_t crc32_nibble_table[16] =
+{
+	0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9,
+	0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
+	0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
+	0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd,
+};
+
+// Same CRC-32 as the flashloader's verification, a nibble at a time
+static uint32_t crc32(const uint8_t *data, uint32_t len, uint32_t crc)
+{
 	while (len--) {
-		crc ^= (*data++ << 24);
+		crc = (crc << 4) ^ crc32_nibble_table[(crc >> 28) ^ (*data >> 4)];
+		crc = (crc << 4) ^ crc32_nibble_table[(crc >> 28) ^ (*data & 0x0f)];
+		data++;
+	}
 
-		for (bit = 0; bit < 8; bit++) {
-			if (crc & (1L << 31)) {
-				crc = (crc << 1) ^ 0x04C11DB7;
-			} else {
-				crc = (crc << 1);
-			}
+	return crc;
+}
+
+#endif
+
+static uint8_t const* staging_flash(uint32_t offset)
+{
+	return (uint8_t const*)(XIP_BASE + FLASH_IMAGE_OFFSET + offset);
+}
+
+static uint8_t const* spare_flash(uint32_t offset)
+{
+	return (uint8_t const*)(XIP_BASE + FLASH_SPARE_OFFSET + offset);
+}
+
+static bool flash_sector_is_blank(uint8_t const* flash)
+{
+	const uint32_t *word = (const uint32_t*)flash;
+	uint32_t i;
+
+	for (i = 0; i < FLASH_SECTOR_SIZE / sizeof(uint32_t); i++) {
+		if (word[i] != 0xffffffff) {
+			return false;
 		}
 	}
 
-	return crc;
+	return true;
 }
 
-static int hex2nibble(char c, uint8_t* value)
+// Programming can only clear bits, anything else needs an erase first
+static bool flash_can_program(uint8_t const* flash, uint8_t const* data, uint32_t len)
 {
-	if ((c >= '0') && (c <= '9')) {
-		*value <<= 4;
-		*value |= (uint8_t)(c - '0');
-		return 0;
+	uint32_t i;
 
-	} else {
-		c |= 32;
-		if ((c >= 'a') && (c <= 'z')) {
-			*value <<= 4;
-			*value |= (uint8_t)(c - 'a') + 10;
-			return 0;
+	for (i = 0; i < len; i++) {
+		if ((flash[i] & data[i]) != data[i]) {
+			return false;
 		}
 	}
 
+	return true;
+}
+
+static void flash_erase_sector(uint32_t flash_offset)
+{
+	uint32_t status;
+
+	status = save_and_disable_interrupts();
+	flash_range_erase(flash_offset, FLASH_SECTOR_SIZE);
+	restore_interrupts(status);
+}
+
+// Runs from the update worker, or at commit. Everything running from flash,
+// the I2C interrupt included, stalls for up to 3 ms while a page programs.
+static void flash_program_page(uint32_t flash_offset, uint8_t const* data)
+{
+	uint32_t status;
+
+	status = save_and_disable_interrupts();
+	flash_range_program(flash_offset, data, FLASH_PAGE_SIZE);
+	restore_interrupts(status);
+}
+
+static void staging_program_page(uint32_t offset, uint8_t const* data)
+{
+	flash_program_page(FLASH_IMAGE_OFFSET + offset, data);
+}
+
+// Called when the sector buffer holds `len` bytes, full or the final sector
+static int staging_sector_done(uint32_t len)
+{
+	const uint32_t offset = (staging.pos - 1) & ~(FLASH_SECTOR_SIZE - 1);
+	const uint32_t data_start = (offset == 0) ? sizeof(tFlashHeader) : 0;
+	const uint32_t program_start = (offset == 0) ? FLASH_PAGE_SIZE : 0;
+	const uint32_t program_len = (len + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1);
+	uint32_t flash_offset, page;
+
+	staging.crc = crc32(&staging.sector[data_start], len - data_start, staging.crc);
+
+	// Final page is padded as erased flash
+	memset(&staging.sector[len], 0xff, program_len - len);
+
+	// The header sector always changes
+	if (offset == 0) {
+		memcpy(staging.first_page, staging.sector, sizeof(staging.first_page));
+	} else if (memcmp(staging.sector, staging_flash(offset), program_len) == 0) {
+		staging.skipped_sectors++;
+		return 1;
+	}
+
+	// Normally erased at boot. One kept for matching the running image but
+	// changed by this update goes to the spare area.
+	if (flash_can_program(staging_flash(offset + program_start),
+			&staging.sector[program_start], program_len - program_start)) {
+		flash_offset = FLASH_IMAGE_OFFSET + offset;
+		staging.written_sectors |= 1u << (offset / FLASH_SECTOR_SIZE);
+	} else if (flash_can_program(spare_flash(offset + program_start),
+			&staging.sector[program_start], program_len - program_start)) {
+		flash_offset = FLASH_SPARE_OFFSET + offset;
+		staging.spare_sectors |= 1u << (offset / FLASH_SECTOR_SIZE);
+	} else {
+		// Left written by an earlier update that was not cleaned up
+		return -UPDATE_FAILED;
+	}
+
+	for (page = program_start; page < program_len; page += FLASH_PAGE_SIZE) {
+		flash_program_page(flash_offset + page, &staging.sector[page]);
+	}
+
 	return 1;
 }
 
-static int parse_2ch_hex(char const* str, uint8_t* value)
+static int staging_put(uint8_t b)
 {
-	*value = 0;
-	return hex2nibble(*str++, value) || hex2nibble(*str, value);
+	if (staging.pos >= sizeof(tFlashHeader) + FLASH_IMAGE_MAX_SIZE) {
+		return -UPDATE_FAILED_FLASH_OVERFLOW;
+	}
+
+	staging.sector[staging.pos % FLASH_SECTOR_SIZE] = b;
+	staging.pos++;
+
+	if ((staging.pos % FLASH_SECTOR_SIZE) == 0) {
+		return staging_sector_done(FLASH_SECTOR_SIZE);
+	}
+
+	return 1;
 }
 
-// See https://github.com/rhulme/pico-flashloader/blob/master/app.c
-static int process_hex_record(char const* line, struct hex_record* record)
+// Program what is left in the sector buffer once all data has arrived
+static int staging_finish(void)
 {
-	int rc = 0;
+	const uint32_t partial = staging.pos % FLASH_SECTOR_SIZE;
+
+	if (!staging.have_data) {
+		return -UPDATE_FAILED_FLASH_EMPTY;
+	}
 
-	uint8_t parsed_value = 0;
-	uint8_t data[256 + 5]; // Max payload 256 bytes plus 5 for fields
-	size_t data_offset = 0;
-	uint8_t checksum = 0;
+	return (partial) ? staging_sector_done(partial) : 1;
+}
 
-	while ((*line != '\0') && (*line != ':')) {
-		line++;
+// Byte at `pos` of the staging area, which must already have been put
+static uint8_t staging_get(uint32_t pos)
+{
+	if (pos >= (staging.pos & ~(FLASH_SECTOR_SIZE - 1))) {
+		return staging.sector[pos % FLASH_SECTOR_SIZE];
 	}
 
-	if (*line == '\0') {
-		return -UPDATE_FAILED_BAD_LINE;
+	if (pos < FLASH_PAGE_SIZE) {
+		return staging.first_page[pos];
 	}
 
-	// Advance past :
-	line++;
+	if (staging.spare_sectors & (1u << (pos / FLASH_SECTOR_SIZE))) {
+		return *spare_flash(pos);
+	}
 
-	while ((*line != '\0') && (data_offset < sizeof(data))) {
+	return *staging_flash(pos);
+}
 
-		if ((line[1] == '\0')
-		 || parse_2ch_hex(line, &parsed_value)) {
-			return -UPDATE_FAILED_BAD_LINE;
+// Copy sectors held in the spare area to the staging area. Only at commit,
+// the Pi is powered off and cannot be kept waiting by the erases.
+static void staging_copy_spare(void)
+{
+	uint32_t offset, page;
+
+	for (offset = 0; offset < FLASH_IMAGE_OFFSET; offset += FLASH_SECTOR_SIZE) {
+		if (!(staging.spare_sectors & (1u << (offset / FLASH_SECTOR_SIZE)))) {
+			continue;
 		}
 
-		data[data_offset] = parsed_value;
-		data_offset++;
-		checksum += parsed_value;
-		line += 2;
+		memcpy(staging.sector, spare_flash(offset), FLASH_SECTOR_SIZE);
+		flash_erase_sector(FLASH_IMAGE_OFFSET + offset);
+
+		// Header page stays erased until the rest is in place
+		for (page = (offset == 0) ? FLASH_PAGE_SIZE : 0; page < FLASH_SECTOR_SIZE; page += FLASH_PAGE_SIZE) {
+			staging_program_page(offset + page, &staging.sector[page]);
+		}
 	}
+}
 
-	// Checksum is two's-complement of the sum of the previous bytes so
-	// final checksum should be zero if everything was OK.
-	if (data_offset == 0) {
-		return -UPDATE_FAILED_BAD_LINE;
-	} else if (checksum != 0) {
-		return -UPDATE_FAILED_BAD_CHECKSUM;
+// Erase what an update that will not be committed programmed, so the next
+// one finds the staging and spare areas as they were at boot rather than
+// running into its sectors. Sectors it skipped still match the running image.
+static void staging_discard(void)
+{
+	uint32_t offset, bit;
+
+	for (offset = 0; offset < FLASH_IMAGE_OFFSET; offset += FLASH_SECTOR_SIZE) {
+		bit = 1u << (offset / FLASH_SECTOR_SIZE);
+
+		if (staging.written_sectors & bit) {
+			flash_erase_sector(FLASH_IMAGE_OFFSET + offset);
+		}
+		if (staging.spare_sectors & bit) {
+			flash_erase_sector(FLASH_SPARE_OFFSET + offset);
+		}
+	}
+
+	staging.written_sectors = 0;
+	staging.spare_sectors = 0;
+}
+
+// Move to `addr`, filling the gap from the previous data
+static int staging_seek(uint32_t addr)
+{
+	uint32_t data_len, i;
+	int rc;
+
+	if (!staging.have_data) {
+		staging.base_addr = addr;
+		staging.have_data = true;
 	}
 
-	record->count = data[0];
-	record->addr  = data[2] | (data[1] << 8);
-	record->type  = data[3];
-	memcpy(record->data, &data[4], data[0]);
+	// Records must be in address order
+	data_len = staging.pos - sizeof(tFlashHeader);
+	if ((addr < staging.base_addr) || ((addr - staging.base_addr) < data_len)) {
+		return -UPDATE_FAILED_BAD_ADDRESS;
+	}
 
-	return 0;
+	// Gaps between sections are filled as erased flash
+	for (i = data_len; i < (addr - staging.base_addr); i++) {
+		if ((rc = staging_put(0xff)) < 0) {
+			return rc;
+		}
+	}
+
+	return 1;
 }
 
-// See https://github.com/rhulme/pico-flashloader/blob/master/flashloader.c
-static void flash_image(tFlashHeader* header, uint32_t length)
+static int staging_write(uint32_t addr, uint8_t const* data, uint32_t len)
 {
-	uint32_t total_length, erase_length, status;
+	uint32_t i;
+	int rc;
 
-	// Calculate length of header plus length of data
-	total_length = sizeof(tFlashHeader) + length;
+	if ((rc = staging_seek(addr)) < 0) {
+		return rc;
+	}
 
-	// Round erase length up to next 4096 byte boundary
-	erase_length = (total_length + 4095) & 0xfffff000;
+	for (i = 0; i < len; i++) {
+		if ((rc = staging_put(data[i])) < 0) {
+			return rc;
+		}
+	}
 
-	header->magic1 = FLASH_MAGIC1;
-	header->magic2 = FLASH_MAGIC2;
-	header->length = length;
-	header->crc32  = crc32(header->data, length, 0xffffffff);
+	return 1;
+}
+
+static uint8_t const* backup_flash(uint32_t offset)
+{
+	return (uint8_t const*)(XIP_BASE + FLASH_BACKUP_OFFSET + offset);
+}
+
+static uint32_t running_image_len(void)
+{
+	return &__flash_binary_end - &__flash_binary_start;
+}
+
+// Written with the backup. Pending is cleared by programming it to zero,
+// which needs no erase, once the update is confirmed or rolled back.
+struct backup_record
+{
+	uint32_t magic;
+	uint32_t length; // of the backed up image
+	uint32_t pending;
+	uint32_t update_length; // of the image flashed over it
+	uint32_t update_crc32;
+};
+
+static struct backup_record const* backup_record(void)
+{
+	return (struct backup_record const*)(XIP_BASE + FLASH_BACKUP_RECORD_OFFSET);
+}
+
+static void backup_record_program(struct backup_record const* record)
+{
+	uint8_t page[FLASH_PAGE_SIZE];
+	uint32_t status;
+
+	memset(page, 0xff, sizeof(page));
+	memcpy(page, record, sizeof(*record));
 
 	status = save_and_disable_interrupts();
+	flash_range_program(FLASH_BACKUP_RECORD_OFFSET, page, sizeof(page));
+	restore_interrupts(status);
+}
 
-	flash_range_erase(FLASH_IMAGE_OFFSET, erase_length);
-	flash_range_program(FLASH_IMAGE_OFFSET, (uint8_t*)header, total_length);
+static void backup_record_resolve(void)
+{
+	const struct backup_record record = {
+		.magic = 0xffffffff,
+		.length = 0xffffffff,
+		.pending = 0,
+		.update_length = 0xffffffff,
+		.update_crc32 = 0xffffffff,
+	};
 
+	backup_record_program(&record);
+}
+
+// Copy the running firmware to the backup area as a flashloader image,
+// using the sector buffer once the update has been staged
+static void backup_running_image(tFlashHeader const* update)
+{
+	uint8_t const* running = (uint8_t const*)&__flash_binary_start;
+	const uint32_t length = running_image_len();
+	const struct backup_record record = {
+		.magic = BACKUP_RECORD_MAGIC,
+		.length = length,
+		.pending = 0xffffffff,
+		.update_length = update->length,
+		.update_crc32 = update->crc32,
+	};
+	tFlashHeader header;
+	uint32_t offset, pos, status;
+
+	status = save_and_disable_interrupts();
+	flash_range_erase(FLASH_BACKUP_RECORD_OFFSET, FLASH_SECTOR_SIZE);
 	restore_interrupts(status);
 
+	if (length > FLASH_IMAGE_MAX_SIZE) {
+		return;
+	}
+
+	header.magic1 = FLASH_MAGIC1;
+	header.magic2 = FLASH_MAGIC2;
+	header.length = length;
+	header.crc32  = crc32(running, length, 0xffffffff);
+
+	for (offset = 0; offset < sizeof(header) + length; offset += FLASH_SECTOR_SIZE) {
+		for (pos = 0; pos < FLASH_SECTOR_SIZE; pos++) {
+			const uint32_t image_pos = offset + pos - sizeof(header);
+
+			staging.sector[pos] = (offset + pos < sizeof(header))
+				? ((uint8_t const*)&header)[offset + pos]
+				: (image_pos < length) ? running[image_pos] : 0xff;
+		}
+
+		status = save_and_disable_interrupts();
+		flash_range_erase(FLASH_BACKUP_OFFSET + offset, FLASH_SECTOR_SIZE);
+		restore_interrupts(status);
+
+		for (pos = 0; pos < FLASH_SECTOR_SIZE; pos += FLASH_PAGE_SIZE) {
+			status = save_and_disable_interrupts();
+			flash_range_program(FLASH_BACKUP_OFFSET + offset + pos, &staging.sector[pos], FLASH_PAGE_SIZE);
+			restore_interrupts(status);
+		}
+	}
+
+	backup_record_program(&record);
+}
+
+static struct
+{
+	enum update_boot_state state;
+	uint32_t trial_start_ms;
+	struct timer trial_timer;
+} boot;
+
+static uint32_t now_ms(void);
+
+static void trial_timer_callback(struct timer *timer)
+{
+	watchdog_update();
+
+	if ((now_ms() - boot.trial_start_ms) >= UPDATE_TRIAL_MS) {
+		update_confirm_boot();
+		return;
+	}
+
+	timer_arm_ms(timer, UPDATE_TRIAL_FEED_MS);
+}
+
+void update_check_boot(void)
+{
+	struct backup_record const* record = backup_record();
+	tFlashHeader const* backup = (tFlashHeader const*)backup_flash(0);
+	const uint32_t length = running_image_len();
+
+	if ((record->magic != BACKUP_RECORD_MAGIC) || (record->pending == 0)) {
+		boot.state = UPDATE_BOOT_NORMAL;
+		return;
+	}
+
+	// The flashloader restored the backup, the update never confirmed.
+	// Reflashing the same firmware also leaves the backup running, but
+	// then the update has the backup's length and CRC and is booting.
+	if ((record->length == length)
+	 && ((record->update_length != backup->length) || (record->update_crc32 != backup->crc32))
+	 && (memcmp(backup_flash(sizeof(tFlashHeader)), &__flash_binary_start, length) == 0)) {
+		backup_record_resolve();
+		boot.state = UPDATE_BOOT_ROLLED_BACK;
+		return;
+	}
+
+	// First boots of an update, any reset before confirming restores the backup
+	boot.state = UPDATE_BOOT_TRIAL;
+	boot.trial_start_ms = now_ms();
+
+	watchdog_hw->scratch[0] = FLASH_MAGIC1;
+	watchdog_hw->scratch[1] = XIP_BASE + FLASH_BACKUP_OFFSET;
+	watchdog_enable(UPDATE_TRIAL_WATCHDOG_MS, true);
+
+	boot.trial_timer.func = trial_timer_callback;
+	timer_arm_ms(&boot.trial_timer, UPDATE_TRIAL_FEED_MS);
+}
+
+void update_confirm_boot(void)
+{
+	if (boot.state != UPDATE_BOOT_TRIAL) {
+		return;
+	}
+
+	hw_clear_bits(&watchdog_hw->ctrl, WATCHDOG_CTRL_ENABLE_BITS);
+	watchdog_hw->scratch[0] = 0;
+	timer_cancel(&boot.trial_timer);
+
+	backup_record_resolve();
+	boot.state = UPDATE_BOOT_CONFIRMED;
+}
+
+enum update_boot_state update_get_boot_state(void)
+{
+	return boot.state;
+}
+
+// See https://github.com/rhulme/pico-flashloader/blob/master/flashloader.c
+static void flash_image(void)
+{
+	tFlashHeader *header = (tFlashHeader*)staging.first_page;
+	const uint32_t length = staging.pos - sizeof(tFlashHeader);
+
+	header->magic1 = FLASH_MAGIC1;
+	header->magic2 = FLASH_MAGIC2;
+	header->length = length;
+	header->crc32  = staging.crc;
+
+	// Kept in case the update fails to confirm its first boot. Updating
+	// from an unconfirmed firmware makes it the one to go back to, and
+	// stops the watchdog that would restore a half written backup.
+	update_confirm_boot();
+	backup_running_image(header);
+
+	staging_copy_spare();
+	staging_program_page(0, staging.first_page);
+
 	// Set up watchdog scratch registers so that the flashloader knows
 	// what to do after the reset
 	watchdog_hw->scratch[0] = FLASH_MAGIC1;
@@ -168,99 +585,273 @@ static void flash_image(tFlashHeader* header, uint32_t length)
 	}
 }
 
-static char update_line[1024];
-static size_t update_line_idx = 0;
-static struct hex_record update_record;
-static size_t flashbuf_offset = 0;
-static uint8_t update_reading_header = 0;
+// Rate is averaged over windows of this length
+#define UPDATE_RATE_WINDOW_MS 1000
 
-void update_init()
+// Progress of the current or last update, see REG_ID_UPDATE_PROGRESS
+static struct
 {
-	update_line_idx = 0;
-	update_line[0] = '\0';
-	flashbuf_offset = 0;
-	update_reading_header = 0;
+	uint32_t bytes; // received over the bus, including HEX text and frame overhead
+	uint32_t records; // HEX records or frames applied
+	uint32_t start_ms;
+	uint32_t end_ms;
+	uint32_t window_start_ms;
+	uint32_t window_bytes;
+	uint32_t rate; // bytes per second over the last full window
+	bool active;
+} progress;
+
+static uint32_t now_ms(void)
+{
+	return to_ms_since_boot(get_absolute_time());
 }
 
-int update_recv(uint8_t b)
+static void progress_start(void)
 {
-	int rc;
+	memset(&progress, 0, sizeof(progress));
+	progress.start_ms = now_ms();
+	progress.window_start_ms = progress.start_ms;
+	progress.active = true;
+}
 
-	// Header resets update state
-	if (b == '+') {
-		update_init();
-		update_reading_header = 1;
-		return 1;
+// A stalled transfer reads as a falling rate once the window has passed
+static void progress_update_rate(uint32_t now)
+{
+	const uint32_t elapsed = now - progress.window_start_ms;
 
-	// Check for line terminator
-	} else if ((b == '\n') || (b == '\r')) {
-		b = '\0';
+	if (elapsed >= UPDATE_RATE_WINDOW_MS) {
+		progress.rate = progress.window_bytes * 1000 / elapsed;
+		progress.window_start_ms = now;
+		progress.window_bytes = 0;
 	}
+}
 
-	// Ignore header contents up to end of line
-	if (update_reading_header) {
-		if (b == '\0') {
-			update_reading_header = 0;
-		}
-		return 1;
+// Count received bytes, given the result of handling them
+static int progress_recv(uint32_t bytes, int rc)
+{
+	const uint32_t now = now_ms();
+
+	if (!progress.active) {
+		return rc;
 	}
 
-	// Check for line overflow
-	if (update_line_idx == sizeof(update_line)) {
-		return -UPDATE_FAILED_LINE_OVERFLOW;
+	progress.bytes += bytes;
+	progress.window_bytes += bytes;
+	progress_update_rate(now);
+
+	if (rc <= 0) {
+		progress.end_ms = now;
+		progress.active = false;
 	}
 
-	// Set next character
-	update_line[update_line_idx++] = b;
+	return rc;
+}
 
-	// If line wasn't done, read more
-	if (b) {
-		return 1;
+static void pack_u32(uint8_t *out_buffer, uint32_t value)
+{
+	out_buffer[0] = (uint8_t)(value & 0xFF);
+	out_buffer[1] = (uint8_t)((value >> 8) & 0xFF);
+	out_buffer[2] = (uint8_t)((value >> 16) & 0xFF);
+	out_buffer[3] = (uint8_t)((value >> 24) & 0xFF);
+}
+
+uint8_t update_pack_progress(uint8_t *out_buffer)
+{
+	const uint32_t irq = save_and_disable_interrupts();
+	const uint32_t now = now_ms();
+
+	if (progress.active) {
+		progress_update_rate(now);
 	}
 
-	// Ignore empty line
-	if (update_line[0] == '\0') {
+	pack_u32(&out_buffer[0], progress.bytes);
+	pack_u32(&out_buffer[4], progress.records);
+	pack_u32(&out_buffer[8], (staging.have_data)
+		? staging.base_addr + (staging.pos - sizeof(tFlashHeader))
+		: 0);
+	pack_u32(&out_buffer[12], ((progress.active) ? now : progress.end_ms) - progress.start_ms);
+	pack_u32(&out_buffer[16], progress.rate);
 
-		// Reset to beginning of line buffer
-		update_line_idx = 0;
+	restore_interrupts(irq);
 
-		return 1;
+	return UPDATE_PROGRESS_LEN;
+}
+
+// Intel HEX is parsed as it arrives, a character at a time. Data bytes are
+// held until their record's checksum has passed, then go to the staging area.
+enum hex_state {
+	HEX_LINE_START,
+	HEX_LINE_PREFIX,
+	HEX_HEADER,
+	HEX_COUNT,
+	HEX_ADDR,
+	HEX_TYPE,
+	HEX_DATA,
+	HEX_CHECKSUM,
+	HEX_LINE_END,
+	HEX_FAILED,
+};
+
+static struct
+{
+	enum hex_state state;
+	uint8_t value; // byte being decoded
+	bool low_nibble;
+	uint8_t checksum;
+	uint8_t count;
+	uint8_t type;
+	uint8_t field_len; // bytes of the current field received
+	uint16_t addr;
+	uint32_t data; // last bytes of a non-data record
+	uint8_t record[UINT8_MAX]; // bytes of a data record
+	uint32_t ext_addr;
+	int error;
+} hex;
+
+void update_init()
+{
+	hex.state = HEX_LINE_START;
+	hex.ext_addr = 0;
+
+	progress_start();
+
+	// Restarted before the last update finished or was committed
+	staging_discard();
+
+	staging.pos = sizeof(tFlashHeader);
+	staging.base_addr = 0;
+	staging.crc = 0xffffffff;
+	staging.skipped_sectors = 0;
+	staging.have_data = false;
+}
+
+void update_erase_staging(void)
+{
+	// Staging data starts after the header, the running image does not
+	uint8_t const* running = (uint8_t const*)&__flash_binary_start - sizeof(tFlashHeader);
+	uint32_t offset;
+
+	for (offset = 0; offset < FLASH_IMAGE_OFFSET; offset += FLASH_SECTOR_SIZE) {
+		if (!flash_sector_is_blank(spare_flash(offset))) {
+			flash_erase_sector(FLASH_SPARE_OFFSET + offset);
+		}
+
+		if (flash_sector_is_blank(staging_flash(offset))) {
+			continue;
+		}
+
+		// Likely to match the next update, which only has to reprogram
+		// the sectors it changes
+		if ((offset != 0)
+		 && (memcmp(staging_flash(offset), &running[offset], FLASH_SECTOR_SIZE) == 0)) {
+			continue;
+		}
+
+		flash_erase_sector(FLASH_IMAGE_OFFSET + offset);
 	}
+}
 
-	// Process incoming line
-	if ((rc = process_hex_record(update_line, &update_record)) < 0) {
-		return rc;
+uint8_t update_get_skipped_sectors(void)
+{
+	return staging.skipped_sectors;
+}
+
+static int hex2nibble(uint8_t c, uint8_t* value)
+{
+	if ((c >= '0') && (c <= '9')) {
+		*value = (*value << 4) | (c - '0');
+		return 0;
 	}
 
-	// Reset to beginning of line buffer
-	update_line_idx = 0;
-	update_line[0] = '\0';
+	c |= 32;
+	if ((c >= 'a') && (c <= 'f')) {
+		*value = (*value << 4) | (c - 'a' + 10);
+		return 0;
+	}
 
-	switch (update_record.type) {
+	return 1;
+}
 
-	// Copy parsed updated data into flash buffer
-	case TYPE_DATA:
-		memcpy(&flashbuf.header.data[flashbuf_offset],
-			update_record.data, update_record.count);
-		flashbuf_offset += update_record.count;
-		if (flashbuf_offset >= FLASH_IMAGE_MAX_SIZE) {
-			return -UPDATE_FAILED_FLASH_OVERFLOW;
+// Called with each decoded byte of a record
+static int hex_record_byte(uint8_t b)
+{
+	hex.checksum += b;
+
+	switch (hex.state) {
+	case HEX_COUNT:
+		hex.count = b;
+		hex.addr = 0;
+		hex.data = 0;
+		hex.field_len = 0;
+		hex.state = HEX_ADDR;
+		return 1;
+
+	case HEX_ADDR:
+		hex.addr = (hex.addr << 8) | b;
+		if (++hex.field_len == sizeof(hex.addr)) {
+			hex.state = HEX_TYPE;
+		}
+		return 1;
+
+	case HEX_TYPE:
+		hex.type = b;
+		hex.field_len = 0;
+		hex.state = (hex.count) ? HEX_DATA : HEX_CHECKSUM;
+		return 1;
+
+	case HEX_DATA:
+		if (hex.type == TYPE_DATA) {
+			hex.record[hex.field_len] = b;
+		} else {
+			hex.data = (hex.data << 8) | b;
 		}
+
+		if (++hex.field_len == hex.count) {
+			hex.state = HEX_CHECKSUM;
+		}
+		return 1;
+
+	case HEX_CHECKSUM:
+		hex.state = HEX_LINE_END;
 		return 1;
 
+	default:
+		return -UPDATE_FAILED_BAD_LINE;
+	}
+}
+
+// Called at the end of a record line
+static int hex_record_done(void)
+{
+	int rc;
+
+	// Checksum is two's-complement of the sum of the previous bytes so
+	// final checksum should be zero if everything was OK.
+	if (hex.checksum != 0) {
+		return -UPDATE_FAILED_BAD_CHECKSUM;
+	}
+
+	hex.state = HEX_LINE_START;
+	progress.records++;
+
+	switch (hex.type) {
+
 	// Complete firmware received
 	case TYPE_EOF:
-		if (flashbuf_offset == 0) {
-			return -UPDATE_FAILED_FLASH_EMPTY;
+		if ((rc = staging_finish()) < 0) {
+			return rc;
 		}
 
 		return 0;
 
-	// Reset flash buffer
+	// Upper 16 bits of following data addresses
 	case TYPE_EXTLIN:
-		flashbuf_offset = 0;
+		hex.ext_addr = (hex.data & 0xffff) << 16;
 		return 1;
 
+	case TYPE_DATA:
+		return staging_write(hex.ext_addr + hex.addr, hex.record, hex.count);
+
 	// Ignore
 	case TYPE_EXTSEG:
 	case TYPE_STARTSEG:
@@ -270,7 +861,415 @@ int update_recv(uint8_t b)
 	}
 }
 
+static int hex_recv(uint8_t b)
+{
+	const bool line_end = (b == '\n') || (b == '\r');
+
+	switch (hex.state) {
+
+	// Empty lines are ignored, anything before the start code is skipped
+	case HEX_LINE_START:
+	case HEX_LINE_PREFIX:
+		if (b == ':') {
+			hex.checksum = 0;
+			hex.low_nibble = false;
+			hex.state = HEX_COUNT;
+			return 1;
+		} else if (!line_end) {
+			hex.state = HEX_LINE_PREFIX;
+			return 1;
+		}
+		return (hex.state == HEX_LINE_START) ? 1 : -UPDATE_FAILED_BAD_LINE;
+
+	// Ignore header contents up to end of line
+	case HEX_HEADER:
+		if (line_end) {
+			hex.state = HEX_LINE_START;
+		}
+		return 1;
+
+	case HEX_LINE_END:
+		return (line_end) ? hex_record_done() : -UPDATE_FAILED_BAD_LINE;
+
+	case HEX_FAILED:
+		return -hex.error;
+
+	default:
+		if (hex2nibble(b, &hex.value)) {
+			return -UPDATE_FAILED_BAD_LINE;
+		}
+
+		hex.low_nibble = !hex.low_nibble;
+		return (hex.low_nibble) ? 1 : hex_record_byte(hex.value);
+	}
+}
+
+static int hex_process(uint8_t b)
+{
+	int rc;
+
+	// Header resets update state
+	if (b == '+') {
+		update_init();
+		hex.state = HEX_HEADER;
+		return progress_recv(1, 1);
+	}
+
+	// Failures stick until the update is restarted
+	if ((rc = hex_recv(b)) < 0) {
+		hex.error = -rc;
+		hex.state = HEX_FAILED;
+	}
+
+	return progress_recv(1, rc);
+}
+
+// LZ4 block format, decoded a byte at a time as frames arrive. Matches are
+// copied from the image already put, so the whole 64 KB window costs no RAM.
+enum lz_state {
+	LZ_TOKEN,
+	LZ_LITERAL_LEN,
+	LZ_LITERALS,
+	LZ_OFFSET_LOW,
+	LZ_OFFSET_HIGH,
+	LZ_MATCH_LEN,
+};
+
+static struct
+{
+	enum lz_state state;
+	uint32_t literal_len;
+	uint32_t match_len;
+	uint16_t offset;
+} lz;
+
+static void lz_init(void)
+{
+	lz.state = LZ_TOKEN;
+}
+
+static int lz_copy_match(void)
+{
+	const uint32_t data_len = staging.pos - sizeof(tFlashHeader);
+	int rc;
+
+	if ((lz.offset == 0) || (lz.offset > data_len)) {
+		return -UPDATE_FAILED_BAD_STREAM;
+	}
+
+	while (lz.match_len--) {
+		if ((rc = staging_put(staging_get(staging.pos - lz.offset))) < 0) {
+			return rc;
+		}
+	}
+
+	lz.state = LZ_TOKEN;
+
+	return 1;
+}
+
+static int lz_recv(uint8_t b)
+{
+	switch (lz.state) {
+	case LZ_TOKEN:
+		lz.literal_len = b >> 4;
+		lz.match_len = (b & 0x0f) + 4;
+		lz.state = (lz.literal_len == 15) ? LZ_LITERAL_LEN
+			: (lz.literal_len) ? LZ_LITERALS
+			: LZ_OFFSET_LOW;
+		return 1;
+
+	case LZ_LITERAL_LEN:
+		lz.literal_len += b;
+		if (b != 255) {
+			lz.state = LZ_LITERALS;
+		}
+		return 1;
+
+	case LZ_LITERALS:
+		staging.have_data = true;
+		if (--lz.literal_len == 0) {
+			lz.state = LZ_OFFSET_LOW;
+		}
+		return staging_put(b);
+
+	case LZ_OFFSET_LOW:
+		lz.offset = b;
+		lz.state = LZ_OFFSET_HIGH;
+		return 1;
+
+	case LZ_OFFSET_HIGH:
+		lz.offset |= (uint16_t)b << 8;
+		if (lz.match_len == 15 + 4) {
+			lz.state = LZ_MATCH_LEN;
+			return 1;
+		}
+		return lz_copy_match();
+
+	case LZ_MATCH_LEN:
+		lz.match_len += b;
+		if (b != 255) {
+			return lz_copy_match();
+		}
+		return 1;
+	}
+
+	return -UPDATE_FAILED_BAD_STREAM;
+}
+
+// The last sequence of a block is literals only
+static bool lz_complete(void)
+{
+	return (lz.state == LZ_OFFSET_LOW) || (lz.state == LZ_TOKEN);
+}
+
+// Binary frames carry the raw image, a fraction of the bus traffic of HEX.
+// Each frame is written in one I2C write: type, sequence number, payload
+// length, payload, then CRC-32 of the rest, least significant byte first.
+static struct
+{
+	uint8_t buf[UPDATE_FRAME_HEADER_LEN + UPDATE_FRAME_PAYLOAD_MAX + UPDATE_FRAME_CRC_LEN];
+	uint16_t len;
+	uint32_t offset; // of the next payload within the image
+	uint8_t next_seq;
+	bool started;
+	bool compressed;
+	volatile enum update_frame_status status; // busy while the worker owns buf
+} frame;
+
+void update_frame_begin(void)
+{
+	// Sent before the last one was acknowledged
+	if (frame.status == UPDATE_FRAME_BUSY) {
+		return;
+	}
+
+	frame.len = 0;
+	frame.status = UPDATE_FRAME_PENDING;
+}
+
+static int frame_process(void)
+{
+	const uint8_t type = frame.buf[0];
+	const uint8_t seq = frame.buf[1];
+	const uint8_t payload_len = frame.buf[2];
+	uint8_t const* payload = &frame.buf[UPDATE_FRAME_HEADER_LEN];
+	uint8_t const* crc_bytes = &payload[payload_len];
+	int rc = 1;
+	uint32_t i;
+
+	const uint32_t crc = (uint32_t)crc_bytes[0]
+		| ((uint32_t)crc_bytes[1] << 8)
+		| ((uint32_t)crc_bytes[2] << 16)
+		| ((uint32_t)crc_bytes[3] << 24);
+	if (crc32(frame.buf, UPDATE_FRAME_HEADER_LEN + payload_len, 0xffffffff) != crc) {
+		frame.status = UPDATE_FRAME_BAD_CRC;
+		return 1;
+	}
+
+	// Starts over whatever was received before
+	if (type == UPDATE_FRAME_START) {
+		update_init();
+		lz_init();
+		frame.offset = 0;
+		frame.compressed = (payload_len > 0) && (payload[0] & UPDATE_FRAME_FLAG_LZ4);
+		frame.next_seq = seq + 1;
+		frame.started = true;
+		frame.status = UPDATE_FRAME_OK;
+		progress.records++;
+		return 1;
+	}
+
+	if (!frame.started) {
+		frame.status = UPDATE_FRAME_BAD_SEQ;
+		return 1;
+	}
+
+	// Resent because the acknowledgement was lost, already applied
+	if (seq == (uint8_t)(frame.next_seq - 1)) {
+		frame.status = UPDATE_FRAME_OK;
+		return 1;
+	}
+
+	if (seq != frame.next_seq) {
+		frame.status = UPDATE_FRAME_BAD_SEQ;
+		return 1;
+	}
+
+	switch (type) {
+	case UPDATE_FRAME_DATA:
+		if (frame.compressed) {
+			for (i = 0; i < payload_len; i++) {
+				if ((rc = lz_recv(payload[i])) < 0) {
+					break;
+				}
+			}
+		} else {
+			rc = staging_write(frame.offset, payload, payload_len);
+		}
+
+		if (rc < 0) {
+			frame.started = false;
+			frame.status = UPDATE_FRAME_FAILED;
+			return rc;
+		}
+		frame.offset += payload_len;
+		break;
+
+	case UPDATE_FRAME_END:
+		frame.started = false;
+		if (frame.compressed && !lz_complete()) {
+			frame.status = UPDATE_FRAME_FAILED;
+			return -UPDATE_FAILED_BAD_STREAM;
+		}
+		if ((rc = staging_finish()) < 0) {
+			frame.status = UPDATE_FRAME_FAILED;
+			return rc;
+		}
+		frame.next_seq++;
+		frame.status = UPDATE_FRAME_OK;
+		progress.records++;
+		return 0;
+
+	default:
+		frame.status = UPDATE_FRAME_BAD_TYPE;
+		return 1;
+	}
+
+	frame.next_seq++;
+	frame.status = UPDATE_FRAME_OK;
+	progress.records++;
+
+	return 1;
+}
+
+// Data written by the Pi is only queued by the I2C interrupt. This worker,
+// below every other interrupt, parses it and programs the staging area, so
+// the I2C interrupt never waits on flash and clock stretching stays short.
+static struct
+{
+	uint irq;
+	struct update_callback *callbacks;
+} worker;
+
+// HEX text waiting for the worker. A byte takes the Pi one I2C write, about
+// 0.3 ms at 100 kHz, so this outlasts a page program many times over.
+#define UPDATE_HEX_QUEUE_SIZE 256
+
+static struct
+{
+	uint8_t buf[UPDATE_HEX_QUEUE_SIZE];
+	volatile uint16_t head; // written by the I2C interrupt
+	volatile uint16_t tail; // written by the worker
+	volatile bool overflow; // bytes were dropped, nothing more is queued
+} hex_queue;
+
+static void worker_notify(int rc)
+{
+	struct update_callback *cb;
+
+	// A failed update is never committed, clean up now rather than at boot
+	if (rc < 0) {
+		staging_discard();
+	}
+
+	for (cb = worker.callbacks; cb; cb = cb->next) {
+		cb->func(rc);
+	}
+}
+
+static void worker_irq(void)
+{
+	uint16_t tail;
+
+	if (frame.status == UPDATE_FRAME_BUSY) {
+		const uint16_t len = frame.len;
+
+		worker_notify(progress_recv(len, frame_process()));
+	}
+
+	for (tail = hex_queue.tail; tail != hex_queue.head; tail++) {
+		worker_notify(hex_process(hex_queue.buf[tail % UPDATE_HEX_QUEUE_SIZE]));
+		hex_queue.tail = tail + 1;
+	}
+
+	// Only after what was queued before the lost bytes
+	if (hex_queue.overflow) {
+		hex.error = UPDATE_FAILED_LINE_OVERFLOW;
+		hex.state = HEX_FAILED;
+		hex_queue.overflow = false;
+		worker_notify(progress_recv(0, -UPDATE_FAILED_LINE_OVERFLOW));
+	}
+}
+
+void update_worker_init(void)
+{
+	worker.irq = user_irq_claim_unused(true);
+	irq_set_exclusive_handler(worker.irq, worker_irq);
+	irq_set_priority(worker.irq, PICO_LOWEST_IRQ_PRIORITY);
+	irq_set_enabled(worker.irq, true);
+}
+
+void update_add_recv_callback(struct update_callback *callback)
+{
+	// first callback
+	if (!worker.callbacks) {
+		worker.callbacks = callback;
+		return;
+	}
+
+	// find last and insert after
+	struct update_callback *cb = worker.callbacks;
+	while (cb->next)
+		cb = cb->next;
+
+	cb->next = callback;
+}
+
+void update_recv(uint8_t b)
+{
+	const uint16_t head = hex_queue.head;
+
+	if (hex_queue.overflow || ((uint16_t)(head - hex_queue.tail) == UPDATE_HEX_QUEUE_SIZE)) {
+		hex_queue.overflow = true;
+	} else {
+		hex_queue.buf[head % UPDATE_HEX_QUEUE_SIZE] = b;
+		__dmb();
+		hex_queue.head = head + 1;
+	}
+
+	irq_set_pending(worker.irq);
+}
+
+void update_frame_recv(uint8_t b)
+{
+	// Bytes past the end of the frame are ignored
+	if ((frame.len == sizeof(frame.buf)) || (frame.status != UPDATE_FRAME_PENDING)) {
+		return;
+	}
+
+	frame.buf[frame.len++] = b;
+
+	if ((frame.len < UPDATE_FRAME_HEADER_LEN)
+	 || (frame.len < UPDATE_FRAME_HEADER_LEN + frame.buf[2] + UPDATE_FRAME_CRC_LEN)) {
+		return;
+	}
+
+	frame.status = UPDATE_FRAME_BUSY;
+	irq_set_pending(worker.irq);
+}
+
+enum update_frame_status update_frame_get_status(void)
+{
+	return frame.status;
+}
+
+uint8_t update_frame_get_next_seq(void)
+{
+	return frame.next_seq;
+}
+
 void update_commit_and_reboot(void)
 {
-	flash_image(&flashbuf.header, flashbuf_offset);
+	flash_image();
 }
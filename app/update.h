@@ -9,14 +9,97 @@ enum update_mode {
 	UPDATE_FAILED_FLASH_OVERFLOW = 5,
 	UPDATE_FAILED_BAD_LINE = 6,
 	UPDATE_FAILED_BAD_CHECKSUM = 7,
+	UPDATE_FAILED_BAD_ADDRESS = 8,
+	UPDATE_FAILED_BAD_STREAM = 9,
 };
 
 // Reset update state
 void update_init();
 
-// Return 1 when there is more to read
-// Return 0 when complete firmware received
-int update_recv(uint8_t b);
+// Erase what is left of an earlier update, except for sectors that match
+// the running image, so that receiving a new one never has to erase and
+// only programs the sectors it changes. Call before the Pi can start an
+// update.
+void update_erase_staging(void);
+
+// Sectors of the last update that were already in the staging area
+uint8_t update_get_skipped_sectors(void);
+
+// Status of the last binary update frame, see REG_ID_UPDATE_FRAME
+enum update_frame_status {
+	UPDATE_FRAME_OK = 0,
+	UPDATE_FRAME_PENDING = 1,
+	UPDATE_FRAME_BAD_CRC = 2,
+	UPDATE_FRAME_BAD_SEQ = 3,
+	UPDATE_FRAME_BAD_TYPE = 4,
+	UPDATE_FRAME_FAILED = 5,
+	UPDATE_FRAME_BUSY = 6,
+};
+
+enum update_frame_type {
+	UPDATE_FRAME_START = 1,
+	UPDATE_FRAME_DATA = 2,
+	UPDATE_FRAME_END = 3,
+};
+
+// Start frame payload flags
+#define UPDATE_FRAME_FLAG_LZ4		(1 << 0) // Data frames carry an LZ4 block stream
+
+#define UPDATE_FRAME_HEADER_LEN		3 // Type, sequence number, payload length
+#define UPDATE_FRAME_CRC_LEN		4
+#define UPDATE_FRAME_PAYLOAD_MAX	255
+
+// Result of each HEX byte and binary frame, called from the worker interrupt
+// that applies them. 1 when there is more to read, 0 when the complete
+// firmware was received, or a negative enum update_mode on failure.
+struct update_callback
+{
+	void (*func)(int rc);
+	struct update_callback *next;
+};
+
+void update_add_recv_callback(struct update_callback *callback);
+
+// Claim the interrupt that applies received data at the lowest priority
+void update_worker_init(void);
+
+// Queue a byte of the HEX update
+void update_recv(uint8_t b);
+
+// Start of a new binary frame, any partial frame is dropped
+void update_frame_begin(void);
+
+// Queue a byte of a binary frame, the complete frame is applied by the
+// worker, UPDATE_FRAME_BUSY until then
+void update_frame_recv(uint8_t b);
+
+enum update_frame_status update_frame_get_status(void);
+
+// Sequence number the next DATA or END frame must carry
+uint8_t update_frame_get_next_seq(void);
+
+// Bytes received, records applied, target address, elapsed ms and bytes
+// per second, each 32-bit little-endian
+#define UPDATE_PROGRESS_LEN	20
+
+// Returns UPDATE_PROGRESS_LEN
+uint8_t update_pack_progress(uint8_t *out_buffer);
+
+enum update_boot_state {
+	UPDATE_BOOT_NORMAL = 0,
+	UPDATE_BOOT_TRIAL = 1, // First boot of an update, not yet confirmed
+	UPDATE_BOOT_CONFIRMED = 2,
+	UPDATE_BOOT_ROLLED_BACK = 3, // Update did not confirm, previous firmware restored
+};
+
+// Check whether this is the first boot of an update. Call first thing,
+// so that a crash anywhere in startup leads back to the previous firmware.
+void update_check_boot(void);
+
+// Keep the updated firmware, called once it is known to work
+void update_confirm_boot(void);
+
+enum update_boot_state update_get_boot_state(void);
 
 // Flash received firmware
 void update_commit_and_reboot(void);
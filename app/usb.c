@@ -1,16 +1,51 @@
 #include "usb.h"
 
 #include "backlight.h"
+#include "debug.h"
 #include "keyboard.h"
 #include "touchpad.h"
 #include "reg.h"
+#include "timer.h"
+#include "trace.h"
 
 #include <hardware/irq.h>
 #include <pico/mutex.h>
 #include <tusb.h>
 
 #define USB_LOW_PRIORITY_IRQ	31
-#define USB_TASK_INTERVAL_US	1000
+#define USB_TASK_RETRY_US		1000
+
+#define BOOT_ERR_ROLLOVER		0x01
+
+#define VENDOR_PACKET_SIZE		64
+#define VENDOR_BATCH_MAGIC		0x00 // Not a valid register, so never a single command
+
+#define REPORT_QUEUE_SIZE		8
+#define MOUSE_REPORT_LEN		5 // buttons, x, y, wheel, pan
+#define MOUSE_MOTION_MAX		1024 // Bound on unreported touch motion, in counts
+#define MOUSE_SCROLL_DIV		8 // Touch counts per wheel step in scroll mode
+
+struct report_queue
+{
+	struct
+	{
+		uint8_t report_id;
+		uint8_t len;
+		uint8_t data[CFG_TUD_HID_EP_BUFSIZE];
+	} items[REPORT_QUEUE_SIZE];
+	uint8_t count;
+	uint8_t read_idx;
+	uint8_t write_idx;
+};
+
+// Consumer or system control usage, only one is reported at a time
+struct control_state
+{
+	uint16_t usage; // 0 when released
+	bool queued; // usage was sent at least once
+	bool release; // released before it was queued
+	bool dirty;
+};
 
 static struct
 {
@@ -18,60 +53,411 @@ static struct
 	bool mouse_moved;
 	uint8_t mouse_btn;
 
-	uint8_t write_buffer[2];
+	// Touch motion not yet reported, in counts
+	int16_t mouse_dx;
+	int16_t mouse_dy;
+
+	// Reports waiting for each HID interface's IN endpoint
+	struct report_queue queues[CFG_TUD_HID];
+
+	// Keyboard state from key events, queued once per scan
+	struct usb_nkro_report keys;
+	struct usb_nkro_report keys_queued;
+	struct usb_nkro_report keys_release; // Released before the press was queued
+	bool keys_dirty;
+
+	struct control_state consumer;
+	struct control_state system;
+
+	uint8_t write_buffer[PACKET_MAX_OUT_LEN];
 	uint8_t write_len;
+
+	bool remote_wakeup_en;
+	bool wakeup_pending;
+
+	struct timer retry_timer;
 } self;
 
-// TODO: What about Ctrl?
 // TODO: What should L1, L2, R1, R2 do
 // TODO: Should touch send arrow keys as an option?
 
+static bool report_enqueue(uint8_t itf, uint8_t report_id, void const *data, uint8_t len)
+{
+	struct report_queue *queue = &self.queues[itf];
+
+	if (queue->count >= REPORT_QUEUE_SIZE)
+		return false;
+
+	queue->items[queue->write_idx].report_id = report_id;
+	queue->items[queue->write_idx].len = len;
+	memcpy(queue->items[queue->write_idx].data, data, len);
+
+	queue->write_idx = (queue->write_idx + 1) % REPORT_QUEUE_SIZE;
+	++queue->count;
+
+	return true;
+}
+
+// Start sending the oldest queued report if the endpoint is free,
+// the rest follow from the transfer complete callback
+static void report_queue_drain(uint8_t itf)
+{
+	struct report_queue *queue = &self.queues[itf];
+
+	if ((queue->count == 0) || !tud_hid_n_ready(itf))
+		return;
+
+	if (!tud_hid_n_report(itf, queue->items[queue->read_idx].report_id,
+		queue->items[queue->read_idx].data, queue->items[queue->read_idx].len))
+		return;
+
+	queue->read_idx = (queue->read_idx + 1) % REPORT_QUEUE_SIZE;
+	--queue->count;
+}
+
+// Keycodes are already keyboard usages, these are the exceptions
+static const uint8_t key_remap[][2] =
+{
+	{ KEY_OPEN, KEY_LEFTCTRL }, // Call key is Control
+};
+
+static uint8_t key_to_usage(uint8_t key)
+{
+	uint i;
+
+	for (i = 0; i < sizeof(key_remap) / sizeof(key_remap[0]); i++) {
+		if (key_remap[i][0] == key) {
+			return key_remap[i][1];
+		}
+	}
+
+	return key;
+}
+
+// Keys that hosts only act on from the consumer or system control reports
+static const struct
+{
+	uint8_t key;
+	uint8_t report_id;
+	uint16_t usage; // value sent in the report
+} key_controls[] =
+{
+	{ KEY_MUTE,       USB_REPORT_ID_CONSUMER, HID_USAGE_CONSUMER_MUTE },
+	{ KEY_VOLUMEUP,   USB_REPORT_ID_CONSUMER, HID_USAGE_CONSUMER_VOLUME_INCREMENT },
+	{ KEY_VOLUMEDOWN, USB_REPORT_ID_CONSUMER, HID_USAGE_CONSUMER_VOLUME_DECREMENT },
+	{ KEY_STOP,       USB_REPORT_ID_CONSUMER, HID_USAGE_CONSUMER_STOP },
+
+	// System control report is an index from Power Down
+	{ KEY_POWER,      USB_REPORT_ID_SYSTEM,   HID_USAGE_DESKTOP_SYSTEM_POWER_DOWN - HID_USAGE_DESKTOP_SYSTEM_CONTROL },
+};
+
+// Return true if the key was routed to a control report
+static bool controls_update(uint8_t key, bool pressed)
+{
+	struct control_state *ctl;
+	uint i;
+
+	for (i = 0; i < sizeof(key_controls) / sizeof(key_controls[0]); i++) {
+		if (key_controls[i].key == key) {
+			break;
+		}
+	}
+
+	if (i == sizeof(key_controls) / sizeof(key_controls[0])) {
+		return false;
+	}
+
+	ctl = (key_controls[i].report_id == USB_REPORT_ID_CONSUMER) ? &self.consumer : &self.system;
+
+	if (pressed) {
+		ctl->usage = key_controls[i].usage;
+		ctl->queued = false;
+		ctl->release = false;
+
+	// Another control was pressed since, it replaced this one
+	} else if (ctl->usage != key_controls[i].usage) {
+		return true;
+
+	// Hold the control down for one report so a quick tap isn't lost
+	} else if (!ctl->queued) {
+		ctl->release = true;
+
+	} else {
+		ctl->usage = 0;
+	}
+
+	ctl->dirty = true;
+
+	return true;
+}
+
+// Return true if a report was queued
+static bool control_queue(struct control_state *ctl, uint8_t report_id, uint8_t len)
+{
+	if (!ctl->dirty) {
+		return false;
+	}
+
+	// Usage is sent little-endian, system control only uses the low byte
+	if (!report_enqueue(USB_ITF_CONTROL, report_id, &ctl->usage, len)) {
+		return false;
+	}
+
+	ctl->queued = true;
+
+	if (ctl->release) {
+		ctl->usage = 0;
+		ctl->release = false;
+	} else {
+		ctl->dirty = false;
+	}
+
+	return true;
+}
+
+// Return bit mask of usage within report byte, or 0 if usage isn't reportable
+static uint8_t usage_bit(struct usb_nkro_report *report, uint8_t usage, uint8_t **byte)
+{
+	if ((usage >= KEY_LEFTCTRL) && (usage <= KEY_RIGHTMETA)) {
+		*byte = &report->modifiers;
+		return 1 << (usage - KEY_LEFTCTRL);
+	}
+
+	if ((usage > KEY_NONE) && (usage < USB_NKRO_KEY_COUNT)) {
+		*byte = &report->keys[usage / 8];
+		return 1 << (usage % 8);
+	}
+
+	return 0;
+}
+
+static void keys_update(uint8_t usage, bool pressed)
+{
+	uint8_t *byte, *queued, *release;
+	const uint8_t bit = usage_bit(&self.keys, usage, &byte);
+
+	if (!bit) {
+		return;
+	}
+
+	(void)usage_bit(&self.keys_queued, usage, &queued);
+	(void)usage_bit(&self.keys_release, usage, &release);
+
+	if (pressed) {
+		*byte |= bit;
+		*release &= ~bit;
+
+	// Hold the key down for one report so a quick tap isn't lost
+	} else if (!(*queued & bit)) {
+		*release |= bit;
+
+	} else {
+		*byte &= ~bit;
+	}
+
+	self.keys_dirty = true;
+}
+
+static void keys_boot_report(uint8_t keycode[6])
+{
+	uint usage, count = 0;
+
+	memset(keycode, 0, 6);
+
+	for (usage = 1; usage < USB_NKRO_KEY_COUNT; usage++) {
+		if (!(self.keys.keys[usage / 8] & (1 << (usage % 8)))) {
+			continue;
+		}
+
+		if (count == 6) {
+			memset(keycode, BOOT_ERR_ROLLOVER, 6);
+			return;
+		}
+
+		keycode[count++] = usage;
+	}
+}
+
+// Return true if a report was queued
+static bool keys_queue(void)
+{
+	uint i;
+	uint8_t boot_report[8];
+	bool pending_release = false;
+
+	if (!self.keys_dirty) {
+		return false;
+	}
+
+	if (tud_hid_n_get_protocol(USB_ITF_KEYBOARD) == HID_PROTOCOL_BOOT) {
+		boot_report[0] = self.keys.modifiers;
+		boot_report[1] = 0;
+		keys_boot_report(&boot_report[2]);
+		if (!report_enqueue(USB_ITF_KEYBOARD, 0, boot_report, sizeof(boot_report))) {
+			return false;
+		}
+	} else if (!report_enqueue(USB_ITF_KEYBOARD, 0, &self.keys, sizeof(self.keys))) {
+		return false;
+	}
+
+	self.keys_queued = self.keys;
+
+	// Apply releases held back for this report, send them next
+	self.keys.modifiers &= ~self.keys_release.modifiers;
+	pending_release |= (self.keys_release.modifiers != 0);
+	for (i = 0; i < sizeof(self.keys.keys); i++) {
+		self.keys.keys[i] &= ~self.keys_release.keys[i];
+		pending_release |= (self.keys_release.keys[i] != 0);
+	}
+	memset(&self.keys_release, 0, sizeof(self.keys_release));
+
+	self.keys_dirty = pending_release;
+
+	return true;
+}
+
+static int8_t take_clamped(int16_t *value, int16_t div)
+{
+	// bind to -128 to 127, remainder stays for the next report
+	const int16_t out = MAX(INT8_MIN, MIN(*value / div, INT8_MAX));
+
+	*value -= out * div;
+
+	return (int8_t)out;
+}
+
+// Move pending touch motion into a mouse report
+// Return true if there was motion to report
+static bool mouse_take_motion(uint8_t report[MOUSE_REPORT_LEN])
+{
+	int16_t neg_dy;
+
+	if (reg_is_bit_set(REG_ID_CF2, CF2_USB_MOUSE_SCROLL)) {
+
+		// Finger moving up scrolls up
+		neg_dy = -self.mouse_dy;
+		report[3] = (uint8_t)take_clamped(&neg_dy, MOUSE_SCROLL_DIV);
+		self.mouse_dy = -neg_dy;
+		report[4] = (uint8_t)take_clamped(&self.mouse_dx, MOUSE_SCROLL_DIV);
+
+	} else {
+		report[1] = (uint8_t)take_clamped(&self.mouse_dx, 1);
+		report[2] = (uint8_t)take_clamped(&self.mouse_dy, 1);
+	}
+
+	return report[1] || report[2] || report[3] || report[4];
+}
+
+// Button changes carry any pending motion so ordering is kept
+static void mouse_queue(uint8_t buttons)
+{
+	uint8_t report[MOUSE_REPORT_LEN] = { buttons, 0, 0, 0, 0 };
+
+	(void)mouse_take_motion(report);
+	(void)report_enqueue(USB_ITF_MOUSE, 0, report, sizeof(report));
+
+	irq_set_pending(USB_LOW_PRIORITY_IRQ);
+}
+
+// Motion is only turned into a report once the endpoint is free,
+// so every report carries all motion since the last one
+static void mouse_flush_motion(void)
+{
+	uint8_t report[MOUSE_REPORT_LEN] = { self.mouse_btn, 0, 0, 0, 0 };
+
+	if ((self.queues[USB_ITF_MOUSE].count > 0) || !tud_hid_n_ready(USB_ITF_MOUSE))
+		return;
+
+	if (mouse_take_motion(report)) {
+		(void)report_enqueue(USB_ITF_MOUSE, 0, report, sizeof(report));
+		report_queue_drain(USB_ITF_MOUSE);
+	}
+}
+
+static void retry_timer_callback(struct timer *timer)
+{
+	(void)timer;
+
+	irq_set_pending(USB_LOW_PRIORITY_IRQ);
+}
+
 static void low_priority_worker_irq(void)
 {
 	if (mutex_try_enter(&self.mutex, NULL)) {
+		TRACE(TRACE_USB, TRACE_USB_WORKER, 0);
+
 		tud_task();
 
+		// Reports queued while suspended are sent once the host resumes
+		if (self.wakeup_pending) {
+			self.wakeup_pending = false;
+			if (tud_suspended())
+				tud_remote_wakeup();
+		}
+
+		// Held back releases are queued right behind their press
+		while (keys_queue())
+			;
+		while (control_queue(&self.consumer, USB_REPORT_ID_CONSUMER, sizeof(uint16_t)))
+			;
+		while (control_queue(&self.system, USB_REPORT_ID_SYSTEM, sizeof(uint8_t)))
+			;
+
+		report_queue_drain(USB_ITF_KEYBOARD);
+		report_queue_drain(USB_ITF_MOUSE);
+		report_queue_drain(USB_ITF_CONTROL);
+		mouse_flush_motion();
+
+		debug_usb_drain();
+
 		mutex_exit(&self.mutex);
+
+	// Mutex owner may not run tud_task, don't lose the event
+	} else {
+		TRACE(TRACE_USB, TRACE_USB_RETRY, 0);
+
+		timer_arm_us(&self.retry_timer, USB_TASK_RETRY_US);
 	}
 }
 
-static int64_t timer_task(alarm_id_t id, void *user_data)
+// Runs after the TinyUSB handler, which has queued the events for tud_task.
+// No bus activity means no interrupts, so nothing runs while suspended or
+// disconnected.
+static void usb_irq(void)
 {
-	(void)id;
-	(void)user_data;
+	TRACE(TRACE_USB, TRACE_USB_IRQ, 0);
 
 	irq_set_pending(USB_LOW_PRIORITY_IRQ);
-
-	return USB_TASK_INTERVAL_US;
 }
 
 static void key_cb(uint8_t key, enum key_state state)
 {
-	if (tud_hid_n_ready(USB_ITF_KEYBOARD) && reg_is_bit_set(REG_ID_CF2, CF2_USB_KEYB_ON)) {
-		uint8_t keycode[6] = { 0 };
-		uint8_t modifiers = 0;
-
-		if (state == KEY_STATE_PRESSED) {
-			keycode[0] = key;
+	if (reg_is_bit_set(REG_ID_CF2, CF2_USB_KEYB_ON)
+	 && ((state == KEY_STATE_PRESSED) || (state == KEY_STATE_RELEASED))) {
+		if ((state == KEY_STATE_PRESSED) && self.remote_wakeup_en && tud_suspended()) {
+			self.wakeup_pending = true;
 		}
 
-		if (state != KEY_STATE_HOLD) {
-			tud_hid_n_keyboard_report(USB_ITF_KEYBOARD, 0, modifiers, keycode);
+		if (!controls_update(key, (state == KEY_STATE_PRESSED))) {
+			keys_update(key_to_usage(key), (state == KEY_STATE_PRESSED));
 		}
+
+		// Worker runs after the scan completes, all changes go in one report
+		irq_set_pending(USB_LOW_PRIORITY_IRQ);
 	}
 
-	if (tud_hid_n_ready(USB_ITF_MOUSE) && reg_is_bit_set(REG_ID_CF2, CF2_USB_MOUSE_ON)) {
+	if (reg_is_bit_set(REG_ID_CF2, CF2_USB_MOUSE_ON)) {
 		if (key == KEY_COMPOSE) {
 			if (state == KEY_STATE_PRESSED) {
 				self.mouse_btn = MOUSE_BUTTON_LEFT;
 				self.mouse_moved = false;
-				tud_hid_n_mouse_report(USB_ITF_MOUSE, 0, MOUSE_BUTTON_LEFT, 0, 0, 0, 0);
+				mouse_queue(MOUSE_BUTTON_LEFT);
 			} else if ((state == KEY_STATE_HOLD) && !self.mouse_moved) {
 				self.mouse_btn = MOUSE_BUTTON_RIGHT;
-				tud_hid_n_mouse_report(USB_ITF_MOUSE, 0, MOUSE_BUTTON_RIGHT, 0, 0, 0, 0);
+				mouse_queue(MOUSE_BUTTON_RIGHT);
 			} else if (state == KEY_STATE_RELEASED) {
 				self.mouse_btn = 0x00;
-				tud_hid_n_mouse_report(USB_ITF_MOUSE, 0, 0x00, 0, 0, 0, 0);
+				mouse_queue(0x00);
 			}
 		}
 	}
@@ -80,15 +466,30 @@ static struct key_callback key_callback = { .func = key_cb };
 
 static void touch_cb(int8_t x, int8_t y)
 {
-	if (!tud_hid_n_ready(USB_ITF_MOUSE) || !reg_is_bit_set(REG_ID_CF2, CF2_USB_MOUSE_ON))
+	if (!reg_is_bit_set(REG_ID_CF2, CF2_USB_MOUSE_ON) || !tud_ready())
 		return;
 
 	self.mouse_moved = true;
 
-	tud_hid_n_mouse_report(USB_ITF_MOUSE, 0, self.mouse_btn, x, y, 0, 0);
+	self.mouse_dx = MAX(-MOUSE_MOTION_MAX, MIN(self.mouse_dx + x, MOUSE_MOTION_MAX));
+	self.mouse_dy = MAX(-MOUSE_MOTION_MAX, MIN(self.mouse_dy + y, MOUSE_MOTION_MAX));
+
+	irq_set_pending(USB_LOW_PRIORITY_IRQ);
 }
 static struct touch_callback touch_callback = { .func = touch_cb };
 
+void tud_hid_report_complete_cb(uint8_t itf, uint8_t const *report, uint16_t len)
+{
+	(void)report;
+	(void)len;
+
+	report_queue_drain(itf);
+
+	if (itf == USB_ITF_MOUSE) {
+		mouse_flush_motion();
+	}
+}
+
 uint16_t tud_hid_get_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t report_type, uint8_t *buffer, uint16_t reqlen)
 {
 	// TODO not Implemented
@@ -103,22 +504,74 @@ uint16_t tud_hid_get_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t
 
 void tud_hid_set_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t report_type, uint8_t const *buffer, uint16_t len)
 {
-	// TODO set LED based on CAPLOCK, NUMLOCK etc...
-	(void)itf;
 	(void)report_id;
-	(void)report_type;
-	(void)buffer;
-	(void)len;
+
+	// Keyboard LED output report, the host owns the lock state
+	if ((itf != USB_ITF_KEYBOARD) || (report_type != HID_REPORT_TYPE_OUTPUT) || (len < 1))
+		return;
+
+	keyboard_set_lock_state((buffer[0] & KEYBOARD_LED_CAPSLOCK), (buffer[0] & KEYBOARD_LED_NUMLOCK));
+}
+
+// Batch request:  MAGIC, then commands until the end of the packet or a 0x00
+//                 read: reg, write: reg | PACKET_WRITE_MASK, value
+// Batch response: MAGIC, number of commands processed, then for each
+//                 command its result length followed by the result.
+// Processing stops before a command whose result would not fit, the host
+// resends the remaining commands in the next batch.
+static uint32_t vendor_process_batch(uint8_t const *in, uint32_t in_len, uint8_t *out)
+{
+	uint32_t in_idx = 1, out_len = 2;
+	uint8_t reg, data, count = 0;
+
+	while (in_idx < in_len) {
+		reg = in[in_idx];
+		if (reg == VENDOR_BATCH_MAGIC) {
+			break;
+		}
+
+		// Write without a value
+		if ((reg & PACKET_WRITE_MASK) && ((in_idx + 1) >= in_len)) {
+			break;
+		}
+
+		if ((out_len + 1 + reg_get_read_len(reg)) > VENDOR_PACKET_SIZE) {
+			break;
+		}
+
+		data = (reg & PACKET_WRITE_MASK) ? in[in_idx + 1] : 0;
+		in_idx += (reg & PACKET_WRITE_MASK) ? 2 : 1;
+
+		reg_process_packet(reg, data, self.write_buffer, &self.write_len);
+
+		out[out_len++] = self.write_len;
+		memcpy(&out[out_len], self.write_buffer, self.write_len);
+		out_len += self.write_len;
+		count++;
+	}
+
+	out[0] = VENDOR_BATCH_MAGIC;
+	out[1] = count;
+
+	return out_len;
 }
 
 void tud_vendor_rx_cb(uint8_t itf)
 {
 //	printf("%s: itf: %d, avail: %d\r\n", __func__, itf, tud_vendor_n_available(itf));
 
-	uint8_t buff[64] = { 0 };
-	tud_vendor_n_read(itf, buff, 64);
+	uint8_t buff[VENDOR_PACKET_SIZE] = { 0 };
+	uint8_t resp[VENDOR_PACKET_SIZE];
+	uint32_t len;
+
+	len = tud_vendor_n_read(itf, buff, sizeof(buff));
 //	printf("%s: %02X %02X %02X\r\n", __func__, buff[0], buff[1], buff[2]);
 
+	if ((len > 0) && (buff[0] == VENDOR_BATCH_MAGIC)) {
+		tud_vendor_n_write(itf, resp, vendor_process_batch(buff, len, resp));
+		return;
+	}
+
 	reg_process_packet(buff[0], buff[1], self.write_buffer, &self.write_len);
 
 	tud_vendor_n_write(itf, self.write_buffer, self.write_len);
@@ -130,23 +583,53 @@ void tud_mount_cb(void)
 	reg_set_value(REG_ID_CFG, reg_get_value(REG_ID_CFG) | CFG_REPORT_MODS);
 }
 
-mutex_t *usb_get_mutex(void)
+void tud_suspend_cb(bool remote_wakeup_en)
 {
-	return &self.mutex;
+	self.remote_wakeup_en = remote_wakeup_en;
+
+	// Only slow down when the keys are for the host, the Pi may still be typing
+	if (reg_is_bit_set(REG_ID_CF2, CF2_USB_KEYB_ON)) {
+		keyboard_set_low_power(true);
+	}
+}
+
+void tud_resume_cb(void)
+{
+	self.remote_wakeup_en = false;
+
+	keyboard_set_low_power(false);
+}
+
+void tud_umount_cb(void)
+{
+	keyboard_set_low_power(false);
+}
+
+void usb_schedule_task(void)
+{
+	irq_set_pending(USB_LOW_PRIORITY_IRQ);
 }
 
 void usb_init(void)
 {
+	mutex_init(&self.mutex);
+	self.retry_timer.func = retry_timer_callback;
+
 	tusb_init();
 
 	keyboard_add_key_callback(&key_callback);
 
 	touchpad_add_touch_callback(&touch_callback);
 
-	// create a new interrupt that calls tud_task, and trigger that interrupt from a timer
+	// create a new interrupt that calls tud_task, and trigger that interrupt
+	// from the USB controller interrupt (requires the shared USBCTRL_IRQ
+	// handler registration from SDK 1.5 / TinyUSB 0.14)
+	user_irq_claim(USB_LOW_PRIORITY_IRQ);
 	irq_set_exclusive_handler(USB_LOW_PRIORITY_IRQ, low_priority_worker_irq);
 	irq_set_enabled(USB_LOW_PRIORITY_IRQ, true);
 
-	mutex_init(&self.mutex);
-	add_alarm_in_us(USB_TASK_INTERVAL_US, timer_task, NULL, true);
+	irq_add_shared_handler(USBCTRL_IRQ, usb_irq, PICO_SHARED_IRQ_HANDLER_LOWEST_ORDER_PRIORITY);
+
+	// Process anything queued during init
+	irq_set_pending(USB_LOW_PRIORITY_IRQ);
 }
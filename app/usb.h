@@ -1,7 +1,21 @@
 #pragma once
 
-typedef struct mutex mutex_t;
+#include <stdint.h>
 
-mutex_t *usb_get_mutex(void);
+// Keyboard usages 0x00 to 0x9F are reported as a bitmap, modifiers separately
+#define USB_NKRO_KEY_COUNT	160
+
+struct usb_nkro_report
+{
+	uint8_t modifiers;
+	uint8_t keys[USB_NKRO_KEY_COUNT / 8];
+};
+
+// Report IDs on the control interface
+#define USB_REPORT_ID_CONSUMER	1
+#define USB_REPORT_ID_SYSTEM	2
+
+// Runs the USB task soon, safe from any context
+void usb_schedule_task(void);
 
 void usb_init(void);
@@ -1,10 +1,12 @@
+#include "usb.h"
+
 #include <tusb.h>
 
-#define CONFIG_TOTAL_LEN		(TUD_CONFIG_DESC_LEN + TUD_HID_DESC_LEN + TUD_HID_DESC_LEN + TUD_VENDOR_DESC_LEN + TUD_CDC_DESC_LEN)
+#define CONFIG_TOTAL_LEN		(TUD_CONFIG_DESC_LEN + TUD_HID_DESC_LEN + TUD_HID_DESC_LEN + TUD_HID_DESC_LEN + TUD_VENDOR_DESC_LEN + TUD_CDC_DESC_LEN)
 
 #define EPNUM_HID_KEYBOARD		0x81
 #define EPNUM_HID_MOUSE			0x82
-#define EPNUM_HID_GENERIC		0x83
+#define EPNUM_HID_CONTROL		0x83
 
 #define EPNUM_VENDOR_IN			0x84
 #define EPNUM_VENDOR_OUT		0x02
@@ -26,7 +28,7 @@ char const *string_descriptors[] =
 	"123456",						// 3: Serials, should use chip ID
 	"Keyboard Interface",			// 4: Interface 1 String
 	"Mouse Interface",				// 5: Interface 2 String
-	"HID Interface",				// 6: Interface 3 String
+	"Control Interface",			// 6: Interface 3 String
 	"CDC Interface",				// 7: Interface 4 String
 };
 
@@ -51,9 +53,43 @@ tusb_desc_device_t const device_descriptor =
 	.bNumConfigurations	= 0x01
 };
 
+// N-key rollover keyboard: modifier byte, then one bit per key usage.
+// The interface is boot capable, in boot protocol the standard 6-key
+// report is sent instead.
 uint8_t const hid_keyboard_descriptor[] =
 {
-	TUD_HID_REPORT_DESC_KEYBOARD()
+	HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP ),
+	HID_USAGE      ( HID_USAGE_DESKTOP_KEYBOARD ),
+	HID_COLLECTION ( HID_COLLECTION_APPLICATION ),
+		// Modifier keys
+		HID_USAGE_PAGE   ( HID_USAGE_PAGE_KEYBOARD ),
+		HID_USAGE_MIN    ( 224 ),
+		HID_USAGE_MAX    ( 231 ),
+		HID_LOGICAL_MIN  ( 0 ),
+		HID_LOGICAL_MAX  ( 1 ),
+		HID_REPORT_COUNT ( 8 ),
+		HID_REPORT_SIZE  ( 1 ),
+		HID_INPUT        ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+		// Key bitmap
+		HID_USAGE_MIN    ( 0 ),
+		HID_USAGE_MAX    ( USB_NKRO_KEY_COUNT - 1 ),
+		HID_LOGICAL_MIN  ( 0 ),
+		HID_LOGICAL_MAX  ( 1 ),
+		HID_REPORT_COUNT ( USB_NKRO_KEY_COUNT ),
+		HID_REPORT_SIZE  ( 1 ),
+		HID_INPUT        ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+		// 5-bit LED output report (Kana, Compose, ScrollLock, CapsLock, NumLock)
+		HID_USAGE_PAGE   ( HID_USAGE_PAGE_LED ),
+		HID_USAGE_MIN    ( 1 ),
+		HID_USAGE_MAX    ( 5 ),
+		HID_REPORT_COUNT ( 5 ),
+		HID_REPORT_SIZE  ( 1 ),
+		HID_OUTPUT       ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+		// LED padding
+		HID_REPORT_COUNT ( 1 ),
+		HID_REPORT_SIZE  ( 3 ),
+		HID_OUTPUT       ( HID_CONSTANT ),
+	HID_COLLECTION_END
 };
 
 uint8_t const hid_mouse_descriptor[] =
@@ -61,12 +97,20 @@ uint8_t const hid_mouse_descriptor[] =
 	TUD_HID_REPORT_DESC_MOUSE()
 };
 
+// Media keys and power, which hosts ignore in the keyboard report
+uint8_t const hid_control_descriptor[] =
+{
+	TUD_HID_REPORT_DESC_CONSUMER( HID_REPORT_ID(USB_REPORT_ID_CONSUMER) ),
+	TUD_HID_REPORT_DESC_SYSTEM_CONTROL( HID_REPORT_ID(USB_REPORT_ID_SYSTEM) ),
+};
+
 uint8_t const config_descriptor[] =
 {
 	TUD_CONFIG_DESCRIPTOR(1, USB_ITF_MAX, 0, CONFIG_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
 
-	TUD_HID_DESCRIPTOR(USB_ITF_KEYBOARD,    4, HID_ITF_PROTOCOL_NONE, sizeof(hid_keyboard_descriptor), EPNUM_HID_KEYBOARD, CFG_TUD_HID_EP_BUFSIZE, 10),
-	TUD_HID_DESCRIPTOR(USB_ITF_MOUSE,       5, HID_ITF_PROTOCOL_NONE, sizeof(hid_mouse_descriptor),    EPNUM_HID_MOUSE,    CFG_TUD_HID_EP_BUFSIZE, 10),
+	TUD_HID_DESCRIPTOR(USB_ITF_KEYBOARD,    4, HID_ITF_PROTOCOL_KEYBOARD, sizeof(hid_keyboard_descriptor), EPNUM_HID_KEYBOARD, CFG_TUD_HID_EP_BUFSIZE, 1),
+	TUD_HID_DESCRIPTOR(USB_ITF_MOUSE,       5, HID_ITF_PROTOCOL_NONE, sizeof(hid_mouse_descriptor),    EPNUM_HID_MOUSE,    CFG_TUD_HID_EP_BUFSIZE, 1),
+	TUD_HID_DESCRIPTOR(USB_ITF_CONTROL,     6, HID_ITF_PROTOCOL_NONE, sizeof(hid_control_descriptor),  EPNUM_HID_CONTROL,  CFG_TUD_HID_EP_BUFSIZE, 1),
 
 	TUD_VENDOR_DESCRIPTOR(USB_ITF_VENDOR,   7, EPNUM_VENDOR_OUT, EPNUM_VENDOR_IN, CFG_TUD_VENDOR_EPSIZE),
 
@@ -86,6 +130,9 @@ uint8_t const *tud_hid_descriptor_report_cb(uint8_t itf)
 	if (itf == USB_ITF_MOUSE)
 		return hid_mouse_descriptor;
 
+	if (itf == USB_ITF_CONTROL)
+		return hid_control_descriptor;
+
 	return NULL;
 }
 
@@ -24,6 +24,7 @@
 #define PIN_LED_G 19
 #define PIN_LED_B 17
 #define PIN_BAT_ADC 26
+#define PIN_POWER_KEY 4 // low while pressed
 
 #define NUM_OF_ROWS			7
 #define PINS_ROWS \
@@ -46,7 +47,7 @@
 
 #define NUM_OF_BTNS			1
 #define PINS_BTNS \
-	4,
+	PIN_POWER_KEY,
 #define BTN_KEYS \
 	{ KEY_POWER },
 
@@ -23,8 +23,13 @@ _REG_IND = 0x13  # interrupt pin assert duration
 _REG_CF2 = 0x14  # config 2
 _REG_TOX = 0x15  # touch delta x since last read, at most (-128 to 127)
 _REG_TOY = 0x16  # touch delta y since last read, at most (-128 to 127)
+_REG_TRACE_COUNT = 0x4D  # number of trace events, write to clear
+_REG_TRACE = 0x4E  # burst read of oldest trace events
 
 _WRITE_MASK      = 1 << 7
+_BATCH_MAGIC     = 0x00
+_PACKET_SIZE     = 64
+_TRACE_EVENT_LEN = 8
 
 CFG_OVERFLOW_ON  = 1 << 0
 CFG_OVERFLOW_INT = 1 << 1
@@ -111,6 +116,56 @@ class I2CPuppet:
         self._buffer[1] = value
         self._dev.write(self._ep_out, self._buffer)
 
+    def batch(self, commands):
+        """Run many register accesses in as few USB round trips as possible.
+
+        `commands` is a list of `reg` for reads or `(reg, value)` for writes.
+        Returns a list with the result bytes of each command, in order.
+        """
+        results = []
+
+        while commands:
+            packet = bytearray([_BATCH_MAGIC])
+            for cmd in commands:
+                encoded = bytes([cmd[0] | _WRITE_MASK, cmd[1]]) if isinstance(cmd, tuple) else bytes([cmd])
+                if len(packet) + len(encoded) > _PACKET_SIZE:
+                    break
+                packet += encoded
+
+            self._dev.write(self._ep_out, packet)
+            resp = self._dev.read(self._ep_in, _PACKET_SIZE)
+
+            if resp[0] != _BATCH_MAGIC or resp[1] == 0:
+                raise Exception('Batch request failed')
+
+            idx = 2
+            for _ in range(resp[1]):
+                length = resp[idx]
+                results.append(bytes(resp[idx + 1:idx + 1 + length]))
+                idx += 1 + length
+
+            commands = commands[resp[1]:]
+
+        return results
+
+    def read_trace(self):
+        """Dequeue all trace events, as raw 8 byte records for trace_decode.py"""
+        events = []
+
+        while True:
+            count = self._read_register(_REG_TRACE_COUNT)
+            if count == 0:
+                return events
+
+            # One event burst per command, keeps each response within a packet
+            for burst in self.batch([_REG_TRACE] * min(count, 8)):
+                for i in range(burst[0]):
+                    start = 1 + i * _TRACE_EVENT_LEN
+                    events.append(burst[start:start + _TRACE_EVENT_LEN])
+
+    def clear_trace(self):
+        self._write_register(_REG_TRACE_COUNT, 0)
+
     def _update_register_bit(self, reg, bit, value):
 
         reg_val = self._read_register(reg)
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+"""Compress a firmware image for a compressed binary frame update.
+
+    pack_fw.py beepy.hex [beepy.lz4]
+
+The image is compressed to an LZ4 block, which the firmware decodes into
+flash as the frames arrive, and checked by decoding it again. The block
+and its split into frame payloads are used by update_fw.py --compress.
+"""
+
+import sys
+import time
+
+import update_fw
+
+MIN_MATCH = 4
+MAX_OFFSET = 0xFFFF
+
+# Output of one frame is flashed before its status reads OK, so bound it to
+# keep each frame busy for a few page programs at most
+FRAME_OUTPUT_MAX = 1024
+MAX_MATCH = FRAME_OUTPUT_MAX
+
+# LZ4 decoders may expect the end of a block to be literals
+_LAST_LITERALS = 5
+
+
+def _length_bytes(n):
+    out = bytearray()
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+    return out
+
+
+def _sequence(literals, offset=None, match_len=0):
+    """Encode one sequence, returning its bytes and the output each byte produces."""
+    lit_len = len(literals)
+    ml = match_len - MIN_MATCH if offset is not None else 0
+    out = bytearray([(min(lit_len, 15) << 4) | min(ml, 15)])
+    if lit_len >= 15:
+        out += _length_bytes(lit_len - 15)
+    produced = [0] * len(out) + [1] * lit_len
+    out += literals
+    if offset is not None:
+        out += bytes([offset & 0xFF, offset >> 8])
+        produced += [0, 0]
+        if ml >= 15:
+            ext = _length_bytes(ml - 15)
+            out += ext
+            produced += [0] * len(ext)
+        produced[-1] += match_len
+    return out, produced
+
+
+def compress(data):
+    """Greedy LZ4 block compression, returning the block and the output of each byte."""
+    block = bytearray()
+    produced = []
+    table = {}
+    anchor = 0
+    i = 0
+    limit = len(data) - _LAST_LITERALS
+    while i + MIN_MATCH <= limit:
+        key = data[i:i + MIN_MATCH]
+        candidate = table.get(key)
+        table[key] = i
+        if candidate is None or i - candidate > MAX_OFFSET:
+            i += 1
+            continue
+        length = MIN_MATCH
+        while (i + length < limit and length < MAX_MATCH
+               and data[candidate + length] == data[i + length]):
+            length += 1
+        seq, out = _sequence(data[anchor:i], i - candidate, length)
+        block += seq
+        produced += out
+        for j in range(i + 1, min(i + length, limit - MIN_MATCH)):
+            table[data[j:j + MIN_MATCH]] = j
+        i += length
+        anchor = i
+    seq, out = _sequence(data[anchor:])
+    block += seq
+    produced += out
+    return bytes(block), produced
+
+
+def decompress(block):
+    out = bytearray()
+    i = 0
+    while i < len(block):
+        token = block[i]
+        i += 1
+        lit_len = token >> 4
+        if lit_len == 15:
+            while True:
+                lit_len += block[i]
+                i += 1
+                if block[i - 1] != 255:
+                    break
+        out += block[i:i + lit_len]
+        i += lit_len
+        if i == len(block):
+            break
+        offset = block[i] | (block[i + 1] << 8)
+        i += 2
+        match_len = (token & 0x0F) + MIN_MATCH
+        if match_len == 15 + MIN_MATCH:
+            while True:
+                match_len += block[i]
+                i += 1
+                if block[i - 1] != 255:
+                    break
+        if offset == 0 or offset > len(out):
+            raise ValueError('bad match offset %d at %d' % (offset, i))
+        for _ in range(match_len):
+            out.append(out[-offset])
+    return bytes(out)
+
+
+def split(block, produced, payload_max=update_fw.PAYLOAD_MAX):
+    """Cut the block into frame payloads that each decode to a bounded output."""
+    payloads = []
+    start = 0
+    output = 0
+    for i, n in enumerate(produced):
+        if i - start == payload_max or output + n > FRAME_OUTPUT_MAX:
+            payloads.append(block[start:i])
+            start = i
+            output = 0
+        output += n
+    payloads.append(block[start:])
+    return payloads
+
+
+def pack(image):
+    block, produced = compress(image)
+    if decompress(block) != image:
+        raise RuntimeError('compressed image does not decode to the original')
+    return block, split(block, produced)
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        print(__doc__.strip(), file=sys.stderr)
+        return 1
+
+    with open(sys.argv[1]) as f:
+        image = update_fw.hex_to_image(f.read())
+
+    start = time.perf_counter()
+    block, payloads = pack(image)
+    packed = time.perf_counter() - start
+
+    print('%d -> %d bytes (%.1f%%) in %d frames, packed in %.2f s'
+          % (len(image), len(block), 100.0 * len(block) / len(image),
+             len(payloads), packed))
+
+    if len(sys.argv) == 3:
+        with open(sys.argv[2], 'wb') as f:
+            f.write(block)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""Render the firmware event trace as a timeline.
+
+Reads events over USB with i2c_puppet.py, or decodes the output of
+`i2ctransfer -y 1 w1@0x1f 0x4e r25` (one read per line) from stdin.
+The firmware has to be built with -DENABLE_TRACE=ON to record events.
+With --count, prints how often each event occurred and its rate instead,
+for example USB wakeups per second over an idle or typing period.
+"""
+
+import struct
+import sys
+
+_EVENT = struct.Struct('<IBBH')
+
+_KEY_STATES = {0: 'idle', 1: 'pressed', 2: 'hold', 3: 'released', 4: 'long hold'}
+_ALARMS = {0: 'power on', 1: 'shutdown', 2: 'power off', 3: 'led flash'}
+_USB = {0: 'controller irq', 1: 'worker', 2: 'worker retry'}
+
+
+def _describe(event_id, a, b):
+    if event_id == 0x00:
+        return 'LOST       %d events overwritten' % b
+    if event_id == 0x01:
+        return 'KEY        0x%02X %s' % (a, _KEY_STATES.get(b, b))
+    if event_id == 0x02:
+        return 'FIFO_PUSH  0x%02X count %d' % (a, b)
+    if event_id == 0x03:
+        return 'FIFO_POP   0x%02X count %d' % (a, b)
+    if event_id == 0x04:
+        if a & 0x80:
+            return 'I2C        write 0x%02X <- 0x%02X' % (a & 0x7F, b & 0xFF)
+        return 'I2C        read 0x%02X' % a
+    if event_id == 0x05:
+        return 'I2C_READ   %d bytes' % b
+    if event_id == 0x06:
+        return 'ALARM      %s' % _ALARMS.get(a, a)
+    if event_id == 0x07:
+        return 'POWER      on, reason %d' % b if a else 'POWER      off'
+    if event_id == 0x08:
+        return 'REG        0x%02X = 0x%02X' % (a, b)
+    if event_id == 0x09:
+        return 'USB        %s' % _USB.get(a, a)
+
+    return 'UNKNOWN    id 0x%02X a 0x%02X b 0x%04X' % (event_id, a, b)
+
+
+def decode(records):
+    """Yield timeline lines for raw 8 byte event records, oldest first"""
+    start = None
+    last = None
+    elapsed = 0
+
+    for record in records:
+        time_us, event_id, a, b = _EVENT.unpack(bytes(record))
+
+        if start is None:
+            start = last = time_us
+
+        # 32-bit microsecond timestamps wrap every 71 minutes
+        delta = (time_us - last) & 0xFFFFFFFF
+        elapsed += delta
+        last = time_us
+
+        yield '%12.3f ms  +%9.3f ms  %s' % (elapsed / 1000, delta / 1000, _describe(event_id, a, b))
+
+
+def count(records):
+    """Yield one line per event kind with its count and rate over the trace"""
+    counts = {}
+    first = None
+    last = None
+    elapsed = 0
+
+    for record in records:
+        time_us, event_id, a, b = _EVENT.unpack(bytes(record))
+
+        if first is None:
+            first = last = time_us
+
+        elapsed += (time_us - last) & 0xFFFFFFFF
+        last = time_us
+
+        # Alarm and USB events are told apart by argument A, the rest by ID
+        words = _describe(event_id, a, 0).split()
+        name = ' '.join(words) if event_id in (0x06, 0x09) else words[0]
+        counts[name] = counts.get(name, 0) + 1
+
+    seconds = elapsed / 1000000
+    yield 'over %.3f s' % seconds
+
+    for name, n in sorted(counts.items()):
+        rate = n / seconds if seconds else 0
+        yield '%8d  %10.1f/s  %s' % (n, rate, name)
+
+
+def _parse_i2ctransfer(lines):
+    for line in lines:
+        data = bytes(int(tok, 16) for tok in line.split())
+        if not data:
+            continue
+
+        for i in range(data[0]):
+            yield data[1 + i * _EVENT.size:1 + (i + 1) * _EVENT.size]
+
+
+def main():
+    args = sys.argv[1:]
+    output = decode
+
+    if '--count' in args:
+        args.remove('--count')
+        output = count
+
+    if args and args[0] == '-':
+        records = _parse_i2ctransfer(sys.stdin)
+    else:
+        from i2c_puppet import I2CPuppet
+        records = I2CPuppet().read_trace()
+
+    for line in output(records):
+        print(line)
+
+
+if __name__ == '__main__':
+    main()
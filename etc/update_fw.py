@@ -0,0 +1,244 @@
+#!/usr/bin/env python3
+"""Flash a firmware update with binary frames over I2C.
+
+    update_fw.py beepy.hex [--bus 1] [--addr 0x1f] [--compress]
+    update_fw.py beepy.hex --benchmark [--clock 100000]
+
+Frames are written to REG_ID_UPDATE_FRAME, one I2C write each, and every
+frame is acknowledged by reading the frame status back. --benchmark runs the
+same exchange against a simulated slave, counting the bits on the bus, and
+compares it with writing the HEX file byte by byte to REG_ID_UPDATE_DATA.
+With --compress the image is sent as an LZ4 block made by pack_fw.py.
+Talking to the device needs the smbus2 package.
+"""
+
+import argparse
+import struct
+import sys
+
+_REG_UPDATE_DATA = 0x30
+_REG_UPDATE_FRAME = 0x31
+_WRITE_MASK = 1 << 7
+
+FRAME_START = 1
+FRAME_DATA = 2
+FRAME_END = 3
+
+FLAG_LZ4 = 1 << 0
+
+FRAME_OK = 0
+FRAME_PENDING = 1
+FRAME_BAD_CRC = 2
+FRAME_BAD_SEQ = 3
+FRAME_BAD_TYPE = 4
+FRAME_FAILED = 5
+FRAME_BUSY = 6
+
+PAYLOAD_MAX = 255
+_RETRIES = 5
+
+# Start, address and ack, stop: bits on the bus around each transfer's data
+_TRANSFER_OVERHEAD_BITS = 1 + 9 + 1
+_BYTE_BITS = 9
+
+
+def crc32(data, crc=0xFFFFFFFF):
+    """CRC-32 as computed by the firmware, MSB first and not inverted."""
+    for b in data:
+        crc ^= b << 24
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x04C11DB7) if crc & 0x80000000 else (crc << 1)
+            crc &= 0xFFFFFFFF
+    return crc
+
+
+def hex_to_image(text):
+    """Flatten Intel HEX data records to an image, gaps filled with 0xFF."""
+    image = bytearray()
+    base = None
+    ext = 0
+    for line in text.splitlines():
+        line = line.strip()
+        if not line.startswith(':'):
+            continue
+        record = bytes.fromhex(line[1:])
+        count, addr, rtype = record[0], (record[1] << 8) | record[2], record[3]
+        data = record[4:4 + count]
+        if rtype == 0x00:
+            addr += ext
+            if base is None:
+                base = addr
+            offset = addr - base
+            if offset < len(image):
+                raise ValueError('records not in address order at 0x%08X' % addr)
+            image += b'\xff' * (offset - len(image)) + data
+        elif rtype == 0x04:
+            ext = ((data[0] << 8) | data[1]) << 16
+        elif rtype == 0x01:
+            break
+    return bytes(image)
+
+
+def make_frame(ftype, seq, payload=b''):
+    frame = bytes([ftype, seq & 0xFF, len(payload)]) + payload
+    return frame + struct.pack('<I', crc32(frame))
+
+
+def chunks(image, chunk=PAYLOAD_MAX):
+    return [image[i:i + chunk] for i in range(0, len(image), chunk)]
+
+
+def frames(payloads, flags=0):
+    yield make_frame(FRAME_START, 0, bytes([flags]) if flags else b'')
+    seq = 1
+    for payload in payloads:
+        yield make_frame(FRAME_DATA, seq, payload)
+        seq += 1
+    yield make_frame(FRAME_END, seq)
+
+
+class Device:
+    def __init__(self, bus, addr):
+        from smbus2 import SMBus, i2c_msg
+        self._bus = SMBus(bus)
+        self._msg = i2c_msg
+        self._addr = addr
+
+    def write(self, reg, data):
+        self._bus.i2c_rdwr(self._msg.write(self._addr, bytes([reg | _WRITE_MASK]) + data))
+
+    def read(self, reg, length):
+        read = self._msg.read(self._addr, length)
+        self._bus.i2c_rdwr(self._msg.write(self._addr, [reg]), read)
+        return bytes(read)
+
+
+class SimulatedDevice:
+    """Frame handling of the firmware, counting the bits each transfer puts on the bus."""
+
+    def __init__(self):
+        self.bits = 0
+        self.image = None
+        self._status = FRAME_OK
+        self._next_seq = 0
+        self._started = False
+        self._compressed = False
+        self._data = bytearray()
+
+    def write(self, reg, data):
+        self.bits += _TRANSFER_OVERHEAD_BITS + _BYTE_BITS * (1 + len(data))
+        if reg == _REG_UPDATE_FRAME:
+            self._frame(data)
+
+    def read(self, reg, length):
+        self.bits += 2 * _TRANSFER_OVERHEAD_BITS + _BYTE_BITS * (1 + length)
+        if reg == _REG_UPDATE_FRAME:
+            return bytes([self._status, self._next_seq])
+        return bytes(length)
+
+    def _frame(self, frame):
+        if len(frame) < 3 or len(frame) < 3 + frame[2] + 4:
+            self._status = FRAME_PENDING
+            return
+        ftype, seq, length = frame[0], frame[1], frame[2]
+        if crc32(frame[:3 + length]) != struct.unpack_from('<I', frame, 3 + length)[0]:
+            self._status = FRAME_BAD_CRC
+            return
+        if ftype == FRAME_START:
+            self._data = bytearray()
+            self._compressed = length > 0 and bool(frame[3] & FLAG_LZ4)
+            self._next_seq = (seq + 1) & 0xFF
+            self._started = True
+            self._status = FRAME_OK
+            return
+        if not self._started or seq not in (self._next_seq, (self._next_seq - 1) & 0xFF):
+            self._status = FRAME_BAD_SEQ
+            return
+        self._status = FRAME_OK
+        if seq != self._next_seq:
+            return
+        if ftype == FRAME_DATA:
+            self._data += frame[3:3 + length]
+        elif ftype == FRAME_END:
+            self.image = bytes(self._data)
+            if self._compressed:
+                import pack_fw
+                self.image = pack_fw.decompress(self.image)
+            self._started = False
+        else:
+            self._status = FRAME_BAD_TYPE
+            return
+        self._next_seq = (self._next_seq + 1) & 0xFF
+
+
+def send_frames(dev, payloads, flags=0):
+    for frame in frames(payloads, flags):
+        for _ in range(_RETRIES):
+            dev.write(_REG_UPDATE_FRAME, frame)
+            status, next_seq = dev.read(_REG_UPDATE_FRAME, 2)
+            # Applied after the write, programming flash as it goes
+            while status == FRAME_BUSY:
+                status, next_seq = dev.read(_REG_UPDATE_FRAME, 2)
+            if status == FRAME_OK:
+                break
+            if status == FRAME_FAILED:
+                update_status = dev.read(_REG_UPDATE_DATA, 1)[0]
+                raise RuntimeError('update failed, status %d' % update_status)
+        else:
+            raise RuntimeError('frame %d not acknowledged, status %d, next %d'
+                               % (frame[1], status, next_seq))
+
+
+def _compressed_payloads(image):
+    import pack_fw
+    return pack_fw.pack(image)[1]
+
+
+def benchmark(hex_text, image, clock):
+    # Register byte and one data byte per write, as update_fw in the driver does
+    results = [('HEX', len(hex_text) * (_TRANSFER_OVERHEAD_BITS + 2 * _BYTE_BITS))]
+
+    for name, payloads, flags in (('frames', chunks(image), 0),
+                                  ('LZ4', _compressed_payloads(image), FLAG_LZ4)):
+        dev = SimulatedDevice()
+        send_frames(dev, payloads, flags)
+        if dev.image != image:
+            raise RuntimeError('simulated device received a different image')
+        results.append((name, dev.bits))
+
+    for name, bits in results:
+        seconds = bits / clock
+        print('%-7s %9d bits %8.2f s %8.0f image B/s %5.1fx'
+              % (name, bits, seconds, len(image) / seconds, results[0][1] / bits))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('hex', help='firmware image in Intel HEX format')
+    parser.add_argument('--bus', type=int, default=1)
+    parser.add_argument('--addr', type=lambda s: int(s, 0), default=0x1F)
+    parser.add_argument('--benchmark', action='store_true',
+                        help='compare bus time against a simulated device')
+    parser.add_argument('--compress', action='store_true',
+                        help='send the image LZ4 compressed')
+    parser.add_argument('--clock', type=int, default=100000, help='I2C clock in Hz')
+    args = parser.parse_args()
+
+    with open(args.hex) as f:
+        hex_text = f.read()
+    image = hex_to_image(hex_text)
+
+    if args.benchmark:
+        benchmark(hex_text, image, args.clock)
+        return 0
+
+    if args.compress:
+        send_frames(Device(args.bus, args.addr), _compressed_payloads(image), FLAG_LZ4)
+    else:
+        send_frames(Device(args.bus, args.addr), chunks(image))
+    print('Update sent, the device will flash it after the Pi shuts down')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
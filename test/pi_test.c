@@ -0,0 +1,312 @@
+#include "test.h"
+
+#include "pi.c"
+
+#define HOUR_MS		(60 * 60 * 1000)
+
+//--------------------------------------------------------------------+
+// Virtual clocks, power key and registers
+//--------------------------------------------------------------------+
+
+// The microsecond timer stops while asleep, the RTC keeps counting
+static uint64_t now_us;
+static uint32_t rtc_s;
+static bool rtc_started;
+static uint32_t rtc_alarm_s;
+
+// The power key goes down at this RTC second, if set
+static uint32_t key_press_s;
+static bool key_down;
+static bool key_scan_idle;
+
+static uint8_t regs[0x100];
+static uint32_t sleeps;
+static uint32_t power_keys_injected;
+
+static clocks_hw_t clocks;
+static rosc_hw_t rosc;
+static scb_hw_t scb;
+clocks_hw_t *clocks_hw = &clocks;
+rosc_hw_t *rosc_hw = &rosc;
+scb_hw_t *scb_hw = &scb;
+
+bool gpio_get(uint gpio)
+{
+	return (gpio == PIN_POWER_KEY) ? !key_down : false;
+}
+
+void gpio_put(uint gpio, bool value)
+{
+	(void)gpio;
+	(void)value;
+}
+
+bool rtc_set_datetime(datetime_t *t)
+{
+	rtc_s = rtc_datetime_to_seconds(t);
+	rtc_started = true;
+
+	return true;
+}
+
+bool rtc_get_datetime(datetime_t *t)
+{
+	rtc_seconds_to_datetime(rtc_s, t);
+
+	return true;
+}
+
+bool rtc_running(void)
+{
+	return rtc_started;
+}
+
+void rtc_set_alarm(datetime_t *t, void (*user_callback)(void))
+{
+	(void)user_callback;
+
+	rtc_alarm_s = rtc_datetime_to_seconds(t);
+}
+
+void rtc_disable_alarm(void)
+{
+}
+
+// Asleep until the RTC alarm, or the power key if it is pressed first
+void __wfi(void)
+{
+	sleeps++;
+
+	if (key_press_s && (key_press_s < rtc_alarm_s)) {
+		rtc_s = key_press_s;
+		key_press_s = 0;
+		key_down = true;
+	} else {
+		rtc_s = rtc_alarm_s;
+	}
+}
+
+void sleep_goto_dormant_until_pin(uint gpio_pin, bool edge, bool high)
+{
+	(void)gpio_pin;
+	(void)edge;
+	(void)high;
+}
+
+uint8_t reg_get_value(enum reg_id reg)
+{
+	return regs[reg];
+}
+
+void reg_set_value(enum reg_id reg, uint8_t value)
+{
+	regs[reg] = value;
+}
+
+bool reg_is_bit_set(enum reg_id reg, uint8_t bit)
+{
+	return (regs[reg] & bit) != 0;
+}
+
+uint32_t reg_get_shutdown_grace_ms()
+{
+	return MINIMUM_SHUTDOWN_GRACE_MS;
+}
+
+bool keyboard_power_key_idle(void)
+{
+	return key_scan_idle;
+}
+
+void keyboard_inject_power_key()
+{
+	power_keys_injected++;
+}
+
+void keyboard_add_key_callback(struct key_callback *callback) { (void)callback; }
+void keyboard_remove_key_callback(void *func) { (void)func; }
+void keyboard_add_lock_callback(struct key_lock_callback *callback) { (void)callback; }
+bool keyboard_get_capslock(void) { return false; }
+
+void battery_add_level_callback(struct battery_callback *callback) { (void)callback; }
+enum battery_level battery_get_level(void) { return BATTERY_LEVEL_OK; }
+void battery_resample(void) { }
+
+void fifo_flush(void) { }
+void touch_fifo_flush(void) { }
+
+//--------------------------------------------------------------------+
+// Timers, run in deadline order against the microsecond clock
+//--------------------------------------------------------------------+
+
+static struct timer *const timers[] = {
+	&g_power_on_timer, &g_shutdown_timer, &g_power_off_timer, &g_led_flash_timer
+};
+
+void timer_arm_us(struct timer *timer, uint64_t delay_us)
+{
+	timer->deadline_us = now_us + delay_us;
+	timer->armed = true;
+}
+
+void timer_arm_ms(struct timer *timer, uint32_t delay_ms)
+{
+	timer_arm_us(timer, (uint64_t)delay_ms * 1000);
+}
+
+void timer_cancel(struct timer *timer)
+{
+	timer->armed = false;
+}
+
+bool timer_is_armed(struct timer const *timer)
+{
+	return timer->armed;
+}
+
+uint64_t timer_remaining_us(struct timer const *timer)
+{
+	return (timer->armed && (timer->deadline_us > now_us)) ? (timer->deadline_us - now_us) : 0;
+}
+
+static void run_timers_until(uint64_t end_us)
+{
+	struct timer *next;
+	uint32_t i;
+
+	for (;;) {
+		next = NULL;
+		for (i = 0; i < sizeof(timers) / sizeof(timers[0]); i++)
+			if (timers[i]->armed && (timers[i]->deadline_us <= end_us)
+				&& (!next || (timers[i]->deadline_us < next->deadline_us)))
+				next = timers[i];
+		if (!next)
+			break;
+
+		now_us = next->deadline_us;
+		next->armed = false;
+		next->func(next);
+	}
+
+	now_us = end_us;
+}
+
+//--------------------------------------------------------------------+
+// Tests
+//--------------------------------------------------------------------+
+
+// The Pi is running, then shut down with a rewake as REG_ID_REWAKE_MINS does
+static void power_off_with_rewake(uint32_t rewake_ms)
+{
+	uint32_t i;
+
+	for (i = 0; i < sizeof(timers) / sizeof(timers[0]); i++)
+		timers[i]->armed = false;
+	memset(regs, 0, sizeof(regs));
+	g_rewake_sleep_pending = false;
+	now_us = 1000000;
+	rtc_started = false;
+	key_press_s = 0;
+	key_down = false;
+	key_scan_idle = true;
+	sleeps = 0;
+	power_keys_injected = 0;
+
+	pi_power_init();
+	pi_power_on(POWER_ON_FW_INIT);
+
+	keyboard_inject_power_key();
+	pi_schedule_power_off(0, MINIMUM_SHUTDOWN_GRACE_MS, false);
+	pi_schedule_power_on(rewake_ms);
+	run_timers_until(now_us + (10 + MINIMUM_SHUTDOWN_GRACE_MS) * 1000);
+}
+
+static void test_sleep_until_rewake(void)
+{
+	power_off_with_rewake(HOUR_MS);
+	CHECK_EQ(power_keys_injected, 2);
+	CHECK_EQ(g_pi_state, PI_STATE_OFF);
+	CHECK(g_rewake_sleep_pending);
+
+	pi_sleep_task();
+	CHECK_EQ(sleeps, 1);
+	CHECK_EQ(rtc_s, (HOUR_MS - MINIMUM_SHUTDOWN_GRACE_MS - 10) / 1000);
+	CHECK_EQ(g_pi_state, PI_STATE_ON);
+	CHECK_EQ(regs[REG_ID_STARTUP_REASON], POWER_ON_REWAKE);
+	CHECK(!timer_is_armed(&g_power_on_timer));
+}
+
+// A tap wakes the core early, which goes back to sleep once the key scan has
+// seen the release
+static void test_early_wake_sleeps_again(void)
+{
+	power_off_with_rewake(HOUR_MS);
+	key_press_s = 100;
+
+	pi_sleep_task();
+	CHECK_EQ(sleeps, 1);
+	CHECK_EQ(g_pi_state, PI_STATE_OFF);
+	CHECK(g_rewake_sleep_pending);
+	CHECK_EQ(timer_remaining_us(&g_power_on_timer), (uint64_t)(3594 - 100) * 1000000);
+
+	// Not while the key is down or its release is still being handled
+	key_scan_idle = false;
+	pi_sleep_task();
+	key_down = false;
+	pi_sleep_task();
+	CHECK_EQ(sleeps, 1);
+	CHECK(g_rewake_sleep_pending);
+
+	key_scan_idle = true;
+	pi_sleep_task();
+	CHECK_EQ(sleeps, 2);
+	CHECK_EQ(rtc_s, 3594);
+	CHECK_EQ(g_pi_state, PI_STATE_ON);
+	CHECK_EQ(regs[REG_ID_STARTUP_REASON], POWER_ON_REWAKE);
+}
+
+// Holding the key boots the Pi without waiting for the rewake
+static void test_early_wake_hold(void)
+{
+	power_off_with_rewake(HOUR_MS);
+	key_press_s = 100;
+	pi_sleep_task();
+
+	key_scan_idle = false;
+	pi_reboot(POWER_ON_BUTTON);
+	key_down = false;
+	key_scan_idle = true;
+	pi_sleep_task();
+	CHECK_EQ(sleeps, 1);
+	CHECK(!g_rewake_sleep_pending);
+
+	run_timers_until(now_us + 500000);
+	CHECK_EQ(g_pi_state, PI_STATE_ON);
+	CHECK_EQ(regs[REG_ID_STARTUP_REASON], POWER_ON_BUTTON);
+}
+
+// Short waits are left to the microsecond timer
+static void test_short_rewake(void)
+{
+	power_off_with_rewake(MINIMUM_SHUTDOWN_GRACE_MS + (REWAKE_SLEEP_MIN_S - 1) * 1000);
+	CHECK(g_rewake_sleep_pending);
+
+	pi_sleep_task();
+	CHECK_EQ(sleeps, 0);
+	CHECK(!g_rewake_sleep_pending);
+	CHECK_EQ(g_pi_state, PI_STATE_OFF);
+
+	run_timers_until(now_us + REWAKE_SLEEP_MIN_S * 1000000);
+	CHECK_EQ(g_pi_state, PI_STATE_ON);
+	CHECK_EQ(regs[REG_ID_STARTUP_REASON], POWER_ON_REWAKE);
+}
+
+int main(void)
+{
+	RUN(test_sleep_until_rewake);
+	RUN(test_early_wake_sleeps_again);
+	RUN(test_early_wake_hold);
+	RUN(test_short_rewake);
+
+	return TEST_RESULT();
+}
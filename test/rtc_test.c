@@ -0,0 +1,210 @@
+#define _DEFAULT_SOURCE // timegm
+
+#include "test.h"
+
+#include <time.h>
+
+#include "rtc.c"
+
+static datetime_t clock_datetime;
+
+bool rtc_set_datetime(datetime_t *t)
+{
+	clock_datetime = *t;
+
+	return true;
+}
+
+bool rtc_get_datetime(datetime_t *t)
+{
+	*t = clock_datetime;
+
+	return true;
+}
+
+// The C library does the same conversions, with 64-bit time_t
+static void reference_datetime(uint32_t seconds, datetime_t *t)
+{
+	const time_t time = seconds;
+	struct tm tm;
+
+	gmtime_r(&time, &tm);
+
+	t->year = tm.tm_year + 1900;
+	t->month = tm.tm_mon + 1;
+	t->day = tm.tm_mday;
+	t->dotw = tm.tm_wday;
+	t->hour = tm.tm_hour;
+	t->min = tm.tm_min;
+	t->sec = tm.tm_sec;
+}
+
+static uint32_t reference_seconds(int year, int month, int day, int hour, int min, int sec)
+{
+	struct tm tm = {
+		.tm_year = year - 1900,
+		.tm_mon = month - 1,
+		.tm_mday = day,
+		.tm_hour = hour,
+		.tm_min = min,
+		.tm_sec = sec,
+	};
+
+	return (uint32_t)timegm(&tm);
+}
+
+static bool datetime_equal(datetime_t const *a, datetime_t const *b)
+{
+	return (a->year == b->year) && (a->month == b->month) && (a->day == b->day)
+		&& (a->dotw == b->dotw) && (a->hour == b->hour) && (a->min == b->min)
+		&& (a->sec == b->sec);
+}
+
+// Both ways, against the reference
+static bool check_seconds(uint32_t seconds)
+{
+	datetime_t t, expected;
+
+	rtc_seconds_to_datetime(seconds, &t);
+	reference_datetime(seconds, &expected);
+
+	return datetime_equal(&t, &expected) && (rtc_datetime_to_seconds(&t) == seconds);
+}
+
+static void test_epoch(void)
+{
+	datetime_t t;
+
+	rtc_seconds_to_datetime(0, &t);
+	CHECK_EQ(t.year, RTC_EPOCH_YEAR);
+	CHECK(t.month == 1 && t.day == 1 && t.hour == 0 && t.min == 0 && t.sec == 0);
+	CHECK_EQ(t.dotw, 4);
+	CHECK_EQ(rtc_datetime_to_seconds(&t), 0);
+}
+
+// The last second of every month and the first of the next, up to 2105
+static void test_month_boundaries(void)
+{
+	uint32_t seconds;
+	int year, month;
+
+	for (year = RTC_EPOCH_YEAR; year < 2106; year++) {
+		for (month = 1; month <= 12; month++) {
+			if ((year == RTC_EPOCH_YEAR) && (month == 1))
+				continue;
+
+			seconds = reference_seconds(year, month, 1, 0, 0, 0);
+			CHECK(check_seconds(seconds - 1));
+			CHECK(check_seconds(seconds));
+		}
+	}
+}
+
+// Century years are only leap years every 400
+static void test_leap_days(void)
+{
+	datetime_t t;
+
+	rtc_seconds_to_datetime(reference_seconds(2000, 2, 29, 12, 0, 0), &t);
+	CHECK(t.month == 2 && t.day == 29);
+
+	rtc_seconds_to_datetime(reference_seconds(2024, 2, 28, 23, 59, 59) + 1, &t);
+	CHECK(t.month == 2 && t.day == 29);
+
+	rtc_seconds_to_datetime(reference_seconds(2100, 2, 28, 23, 59, 59) + 1, &t);
+	CHECK(t.month == 3 && t.day == 1);
+
+	CHECK_EQ(days_in_year(1900), 365);
+	CHECK_EQ(days_in_year(2000), 366);
+	CHECK_EQ(days_in_month(2023, 2), 28);
+	CHECK_EQ(days_in_month(2024, 2), 29);
+}
+
+// Past the signed 32-bit limit, the counter is unsigned
+static void test_2038(void)
+{
+	CHECK(check_seconds(0x7fffffff));
+	CHECK(check_seconds(0x80000000));
+	CHECK(check_seconds(reference_seconds(2105, 12, 31, 23, 59, 59)));
+}
+
+static void test_random(void)
+{
+	const uint32_t max = reference_seconds(2106, 1, 1, 0, 0, 0);
+	uint32_t seed = 1, seconds, i;
+
+	for (i = 0; i < 100000; i++) {
+		seed = seed * 1103515245 + 12345;
+		seconds = ((seed >> 8) * 257u + i) % max;
+		CHECK(check_seconds(seconds));
+	}
+}
+
+// A rewake wait of up to 255 minutes from the clock, as pi_sleep_task does it
+static void test_rewake_rollover(void)
+{
+	static const struct {
+		datetime_t now;
+		uint32_t wait_s;
+		datetime_t wake;
+	} cases[] = {
+		// Midnight
+		{ { 2024, 5, 14, 2, 23, 30, 0 }, 60 * 60, { 2024, 5, 15, 3, 0, 30, 0 } },
+		// End of a 30 day month
+		{ { 2024, 4, 30, 2, 22, 0, 0 }, 255 * 60, { 2024, 5, 1, 3, 2, 15, 0 } },
+		// Leap day
+		{ { 2024, 2, 28, 3, 23, 59, 59 }, 1, { 2024, 2, 29, 4, 0, 0, 0 } },
+		// New year
+		{ { 2023, 12, 31, 0, 23, 59, 0 }, 255 * 60, { 2024, 1, 1, 1, 4, 14, 0 } },
+	};
+	datetime_t t;
+	uint32_t i;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		rtc_seconds_to_datetime(rtc_datetime_to_seconds(&cases[i].now) + cases[i].wait_s, &t);
+		CHECK(datetime_equal(&t, &cases[i].wake));
+	}
+}
+
+// REG_ID_RTC_* set the clock with the weekday worked out
+static void test_registers(void)
+{
+	datetime_t expected;
+
+	rtc_set(124, 2, 29, 13, 14, 15);
+	reference_datetime(reference_seconds(2024, 2, 29, 13, 14, 15), &expected);
+	CHECK(datetime_equal(&clock_datetime, &expected));
+
+	CHECK_EQ(rtc_get(REG_ID_RTC_YEAR), 124);
+	CHECK_EQ(rtc_get(REG_ID_RTC_MON), 2);
+	CHECK_EQ(rtc_get(REG_ID_RTC_MDAY), 29);
+	CHECK_EQ(rtc_get(REG_ID_RTC_HOUR), 13);
+	CHECK_EQ(rtc_get(REG_ID_RTC_MIN), 14);
+	CHECK_EQ(rtc_get(REG_ID_RTC_SEC), 15);
+}
+
+// The weekday rtc_set uses agrees with the seconds count
+static void test_weekday(void)
+{
+	datetime_t t;
+	uint32_t days;
+
+	for (days = 0; days < 50000; days += 13) {
+		rtc_seconds_to_datetime(days * 24 * 60 * 60, &t);
+		CHECK_EQ(dow(t.year, t.month, t.day), t.dotw);
+	}
+}
+
+int main(void)
+{
+	RUN(test_epoch);
+	RUN(test_month_boundaries);
+	RUN(test_leap_days);
+	RUN(test_2038);
+	RUN(test_random);
+	RUN(test_rewake_rollover);
+	RUN(test_registers);
+	RUN(test_weekday);
+
+	return TEST_RESULT();
+}
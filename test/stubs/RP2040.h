@@ -0,0 +1,3 @@
+#pragma once
+
+// CMSIS device header, nothing from it is used on the host
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+// Image header of pico-flashloader, which checks the magic numbers, then
+// the CRC-32 of `length` bytes of data after the header
+
+#define FLASH_MAGIC1	0x8ecd5efb
+#define FLASH_MAGIC2	0xc5ae52a8
+
+typedef struct __attribute__((packed, aligned(4)))
+{
+	uint32_t magic1;
+	uint32_t magic2;
+	uint32_t length;
+	uint32_t crc32;
+	uint8_t data[];
+} tFlashHeader;
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "pico.h"
+
+#define CLOCKS_SLEEP_EN0_CLK_RTC_RTC_BITS	0x00800000u
+#define CLOCKS_SLEEP_EN0_CLK_SYS_IO_BITS	0x00004000u
+
+typedef struct
+{
+	uint32_t sleep_en0;
+	uint32_t sleep_en1;
+} clocks_hw_t;
+
+extern clocks_hw_t *clocks_hw;
+
+static inline void clocks_init(void) { }
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "pico.h"
+
+// Only used with UPDATE_CRC_DMA, which the host tests don't build
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "pico.h"
+
+#define FLASH_PAGE_SIZE		(1u << 8)
+#define FLASH_SECTOR_SIZE	(1u << 12)
+
+// Flash is an array defined by the test, programmed and erased like NOR
+// flash by its flash_range_* functions
+extern uint8_t fake_flash[];
+#define XIP_BASE	((uintptr_t)fake_flash)
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "pico.h"
+
+#define GPIO_IN			0
+#define GPIO_OUT		1
+#define GPIO_FUNC_PWM		4
+#define GPIO_IRQ_EDGE_FALL	0x4u
+#define GPIO_IRQ_EDGE_RISE	0x8u
+
+// Defined by the test, which drives the pins
+bool gpio_get(uint gpio);
+void gpio_put(uint gpio, bool value);
+
+static inline void gpio_init(uint gpio) { (void)gpio; }
+static inline void gpio_set_dir(uint gpio, bool out) { (void)gpio; (void)out; }
+static inline void gpio_set_function(uint gpio, uint fn) { (void)gpio; (void)fn; }
+static inline void gpio_set_irq_enabled(uint gpio, uint32_t events, bool enabled) { (void)gpio; (void)events; (void)enabled; }
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "pico.h"
+
+#define USBCTRL_IRQ	5
+#define PICO_SHARED_IRQ_HANDLER_LOWEST_ORDER_PRIORITY	0x00
+#define PICO_LOWEST_IRQ_PRIORITY	0xff
+#define PICO_FIRST_USER_IRQ	26
+
+typedef void (*irq_handler_t)(void);
+
+static inline void irq_set_exclusive_handler(uint num, irq_handler_t handler) { (void)num; (void)handler; }
+static inline void irq_add_shared_handler(uint num, irq_handler_t handler, uint8_t order) { (void)num; (void)handler; (void)order; }
+static inline void irq_set_enabled(uint num, bool enabled) { (void)num; (void)enabled; }
+static inline void irq_set_pending(uint num) { (void)num; }
+static inline void irq_set_priority(uint num, uint8_t priority) { (void)num; (void)priority; }
+static inline void user_irq_claim(uint num) { (void)num; }
+static inline int user_irq_claim_unused(bool required) { (void)required; return PICO_FIRST_USER_IRQ; }
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "pico.h"
+
+static inline uint pwm_gpio_to_slice_num(uint gpio) { return (gpio >> 1) & 7; }
+static inline void pwm_set_gpio_level(uint gpio, uint16_t level) { (void)gpio; (void)level; }
+static inline void pwm_set_enabled(uint slice, bool enabled) { (void)slice; (void)enabled; }
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "pico.h"
+
+#define ROSC_CTRL_ENABLE_BITS	0x00fff000u
+
+typedef struct
+{
+	uint32_t ctrl;
+} rosc_hw_t;
+
+extern rosc_hw_t *rosc_hw;
+
+static inline void rosc_write(uint32_t *addr, uint32_t value) { *addr = value; }
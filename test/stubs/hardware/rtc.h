@@ -0,0 +1,10 @@
+#pragma once
+
+#include "pico/util/datetime.h"
+
+// Defined by the test, which keeps the clock
+bool rtc_set_datetime(datetime_t *t);
+bool rtc_get_datetime(datetime_t *t);
+bool rtc_running(void);
+void rtc_set_alarm(datetime_t *t, void (*user_callback)(void));
+void rtc_disable_alarm(void);
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "pico.h"
+
+#define M0PLUS_SCR_SLEEPDEEP_BITS	0x00000004u
+
+typedef struct
+{
+	uint32_t scr;
+} scb_hw_t;
+
+extern scb_hw_t *scb_hw;
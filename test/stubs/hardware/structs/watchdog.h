@@ -0,0 +1,18 @@
+#pragma once
+
+#include "pico.h"
+
+#define WATCHDOG_CTRL_ENABLE_BITS	0x40000000
+
+typedef struct
+{
+	uint32_t ctrl;
+	uint32_t load;
+	uint32_t reason;
+	uint32_t scratch[8];
+	uint32_t tick;
+} watchdog_hw_t;
+
+extern watchdog_hw_t *watchdog_hw;
+
+#define hw_clear_bits(addr, mask)	(*(addr) &= ~(mask))
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "pico.h"
+
+// Host tests have no interrupts to mask
+static inline uint32_t save_and_disable_interrupts(void) { return 0; }
+static inline void restore_interrupts(uint32_t status) { (void)status; }
+static inline void __dmb(void) { }
+
+// Defined by the test that sleeps
+void __wfi(void);
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "pico.h"
+
+void watchdog_reboot(uint32_t pc, uint32_t sp, uint32_t delay_ms);
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug);
+void watchdog_update(void);
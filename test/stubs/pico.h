@@ -0,0 +1,23 @@
+#pragma once
+
+// Host stand-ins for the parts of the Pico SDK that firmware modules use.
+// Only what the host tests need is declared. Hardware calls either do
+// nothing or are defined by the test that wants to observe them.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifndef MIN
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+#endif
+
+#define __not_in_flash_func(f)	f
+#define __time_critical_func(f)	f
+
+typedef uint64_t absolute_time_t;
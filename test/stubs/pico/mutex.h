@@ -0,0 +1,10 @@
+#pragma once
+
+#include "pico.h"
+
+// Host tests are single threaded, the mutex is only taken by the code under test
+typedef struct { bool owned; } mutex_t;
+
+static inline void mutex_init(mutex_t *mtx) { mtx->owned = false; }
+static inline bool mutex_try_enter(mutex_t *mtx, uint32_t *owner) { (void)owner; if (mtx->owned) return false; mtx->owned = true; return true; }
+static inline void mutex_exit(mutex_t *mtx) { mtx->owned = false; }
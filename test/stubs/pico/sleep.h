@@ -0,0 +1,8 @@
+#pragma once
+
+#include "pico.h"
+
+static inline void sleep_run_from_xosc(void) { }
+
+// Defined by the test that sleeps
+void sleep_goto_dormant_until_pin(uint gpio_pin, bool edge, bool high);
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "pico.h"
+
+// Defined by the test, which controls the clock
+absolute_time_t get_absolute_time(void);
+
+static inline absolute_time_t from_us_since_boot(uint64_t us) { return us; }
+static inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+static inline uint32_t to_ms_since_boot(absolute_time_t t) { return (uint32_t)(t / 1000); }
+
+static inline void tight_loop_contents(void) { }
+static inline void sleep_us(uint64_t us) { (void)us; }
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "pico.h"
+
+typedef struct
+{
+	int16_t year;
+	int8_t month;
+	int8_t day;
+	int8_t dotw; // 0 is Sunday
+	int8_t hour;
+	int8_t min;
+	int8_t sec;
+} datetime_t;
@@ -0,0 +1,268 @@
+#pragma once
+
+// Host stand-in for TinyUSB. The descriptor macros produce the same bytes
+// as TinyUSB's, laid out by the USB 2.0 and HID 1.11 specifications, so the
+// tests can parse the firmware's descriptors. Device stack calls are
+// declared here and defined by the test.
+
+#include "pico.h"
+#include "tusb_config.h"
+
+#define TU_U16_LE(x)	(uint8_t)((x) & 0xFF), (uint8_t)(((x) >> 8) & 0xFF)
+
+//--------------------------------------------------------------------+
+// USB descriptors
+//--------------------------------------------------------------------+
+
+#define TUSB_DESC_DEVICE		0x01
+#define TUSB_DESC_CONFIGURATION	0x02
+#define TUSB_DESC_STRING		0x03
+#define TUSB_DESC_INTERFACE		0x04
+#define TUSB_DESC_ENDPOINT		0x05
+#define TUSB_DESC_INTERFACE_ASSOCIATION	0x0B
+#define TUSB_DESC_CS_INTERFACE	0x24
+
+#define TUSB_CLASS_CDC			0x02
+#define TUSB_CLASS_HID			0x03
+#define TUSB_CLASS_CDC_DATA		0x0A
+#define TUSB_CLASS_VENDOR_SPECIFIC	0xFF
+
+#define TUSB_XFER_BULK			0x02
+#define TUSB_XFER_INTERRUPT		0x03
+
+#define TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP	0x20
+
+#ifndef CFG_TUD_VENDOR_EPSIZE
+#define CFG_TUD_VENDOR_EPSIZE	64
+#endif
+
+#define HID_DESC_TYPE_HID		0x21
+#define HID_DESC_TYPE_REPORT	0x22
+
+typedef struct __attribute__((packed))
+{
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t bcdUSB;
+	uint8_t bDeviceClass;
+	uint8_t bDeviceSubClass;
+	uint8_t bDeviceProtocol;
+	uint8_t bMaxPacketSize0;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	uint8_t iManufacturer;
+	uint8_t iProduct;
+	uint8_t iSerialNumber;
+	uint8_t bNumConfigurations;
+} tusb_desc_device_t;
+
+#define TUD_CONFIG_DESC_LEN		9
+#define TUD_HID_DESC_LEN		(9 + 9 + 7)
+#define TUD_VENDOR_DESC_LEN		(9 + 7 + 7)
+#define TUD_CDC_DESC_LEN		(8 + 9 + 5 + 5 + 4 + 5 + 7 + 9 + 7 + 7)
+
+#define TUD_CONFIG_DESCRIPTOR(_config_num, _itfcount, _stridx, _total_len, _attribute, _power_ma) \
+	9, TUSB_DESC_CONFIGURATION, TU_U16_LE(_total_len), _itfcount, _config_num, _stridx, \
+	(1 << 7) | (_attribute), (_power_ma) / 2
+
+#define TUD_HID_DESCRIPTOR(_itfnum, _stridx, _boot_protocol, _report_desc_len, _epin, _epsize, _ep_interval) \
+	9, TUSB_DESC_INTERFACE, _itfnum, 0, 1, TUSB_CLASS_HID, (uint8_t)((_boot_protocol) ? 1 : 0), _boot_protocol, _stridx, \
+	9, HID_DESC_TYPE_HID, TU_U16_LE(0x0111), 0, 1, HID_DESC_TYPE_REPORT, TU_U16_LE(_report_desc_len), \
+	7, TUSB_DESC_ENDPOINT, _epin, TUSB_XFER_INTERRUPT, TU_U16_LE(_epsize), _ep_interval
+
+#define TUD_VENDOR_DESCRIPTOR(_itfnum, _stridx, _epout, _epin, _epsize) \
+	9, TUSB_DESC_INTERFACE, _itfnum, 0, 2, TUSB_CLASS_VENDOR_SPECIFIC, 0x00, 0x00, _stridx, \
+	7, TUSB_DESC_ENDPOINT, _epout, TUSB_XFER_BULK, TU_U16_LE(_epsize), 0, \
+	7, TUSB_DESC_ENDPOINT, _epin, TUSB_XFER_BULK, TU_U16_LE(_epsize), 0
+
+#define TUD_CDC_DESCRIPTOR(_itfnum, _stridx, _ep_notif, _ep_notif_size, _epout, _epin, _epsize) \
+	8, TUSB_DESC_INTERFACE_ASSOCIATION, _itfnum, 2, TUSB_CLASS_CDC, 2, 0, 0, \
+	9, TUSB_DESC_INTERFACE, _itfnum, 0, 1, TUSB_CLASS_CDC, 2, 0, _stridx, \
+	5, TUSB_DESC_CS_INTERFACE, 0x00, TU_U16_LE(0x0120), \
+	5, TUSB_DESC_CS_INTERFACE, 0x01, 0, (uint8_t)((_itfnum) + 1), \
+	4, TUSB_DESC_CS_INTERFACE, 0x02, 2, \
+	5, TUSB_DESC_CS_INTERFACE, 0x06, _itfnum, (uint8_t)((_itfnum) + 1), \
+	7, TUSB_DESC_ENDPOINT, _ep_notif, TUSB_XFER_INTERRUPT, TU_U16_LE(_ep_notif_size), 16, \
+	9, TUSB_DESC_INTERFACE, (uint8_t)((_itfnum) + 1), 0, 2, TUSB_CLASS_CDC_DATA, 0, 0, 0, \
+	7, TUSB_DESC_ENDPOINT, _epout, TUSB_XFER_BULK, TU_U16_LE(_epsize), 0, \
+	7, TUSB_DESC_ENDPOINT, _epin, TUSB_XFER_BULK, TU_U16_LE(_epsize), 0
+
+//--------------------------------------------------------------------+
+// HID report descriptor items, prefix is tag << 4 | type << 2 | size
+//--------------------------------------------------------------------+
+
+#define HID_ITEM_1(x, prefix)	(prefix) | 1, (uint8_t)(x)
+#define HID_ITEM_2(x, prefix)	(prefix) | 2, TU_U16_LE(x)
+#define HID_ITEM_N(x, prefix, n)	HID_ITEM_##n(x, prefix)
+
+#define HID_INPUT(x)			HID_ITEM_1(x, 0x80)
+#define HID_OUTPUT(x)			HID_ITEM_1(x, 0x90)
+#define HID_COLLECTION(x)		HID_ITEM_1(x, 0xA0)
+#define HID_COLLECTION_END		0xC0
+
+#define HID_USAGE_PAGE(x)		HID_ITEM_1(x, 0x04)
+#define HID_USAGE_PAGE_N(x, n)	HID_ITEM_N(x, 0x04, n)
+#define HID_LOGICAL_MIN(x)		HID_ITEM_1(x, 0x14)
+#define HID_LOGICAL_MIN_N(x, n)	HID_ITEM_N(x, 0x14, n)
+#define HID_LOGICAL_MAX(x)		HID_ITEM_1(x, 0x24)
+#define HID_LOGICAL_MAX_N(x, n)	HID_ITEM_N(x, 0x24, n)
+#define HID_REPORT_SIZE(x)		HID_ITEM_1(x, 0x74)
+#define HID_REPORT_ID(x)		HID_ITEM_1(x, 0x84),
+#define HID_REPORT_COUNT(x)		HID_ITEM_1(x, 0x94)
+
+#define HID_USAGE(x)			HID_ITEM_1(x, 0x08)
+#define HID_USAGE_N(x, n)		HID_ITEM_N(x, 0x08, n)
+#define HID_USAGE_MIN(x)		HID_ITEM_1(x, 0x18)
+#define HID_USAGE_MIN_N(x, n)	HID_ITEM_N(x, 0x18, n)
+#define HID_USAGE_MAX(x)		HID_ITEM_1(x, 0x28)
+#define HID_USAGE_MAX_N(x, n)	HID_ITEM_N(x, 0x28, n)
+
+#define HID_DATA				(0 << 0)
+#define HID_CONSTANT			(1 << 0)
+#define HID_ARRAY				(0 << 1)
+#define HID_VARIABLE			(1 << 1)
+#define HID_ABSOLUTE			(0 << 2)
+#define HID_RELATIVE			(1 << 2)
+
+#define HID_COLLECTION_PHYSICAL		0x00
+#define HID_COLLECTION_APPLICATION	0x01
+
+#define HID_USAGE_PAGE_DESKTOP	0x01
+#define HID_USAGE_PAGE_KEYBOARD	0x07
+#define HID_USAGE_PAGE_LED		0x08
+#define HID_USAGE_PAGE_BUTTON	0x09
+#define HID_USAGE_PAGE_CONSUMER	0x0C
+
+#define HID_USAGE_DESKTOP_POINTER	0x01
+#define HID_USAGE_DESKTOP_MOUSE		0x02
+#define HID_USAGE_DESKTOP_KEYBOARD	0x06
+#define HID_USAGE_DESKTOP_X			0x30
+#define HID_USAGE_DESKTOP_Y			0x31
+#define HID_USAGE_DESKTOP_WHEEL		0x38
+#define HID_USAGE_DESKTOP_SYSTEM_CONTROL	0x80
+#define HID_USAGE_DESKTOP_SYSTEM_POWER_DOWN	0x81
+#define HID_USAGE_DESKTOP_SYSTEM_SLEEP		0x82
+#define HID_USAGE_DESKTOP_SYSTEM_WAKE_UP	0x83
+
+#define HID_USAGE_CONSUMER_CONTROL			0x0001
+#define HID_USAGE_CONSUMER_STOP				0x00B7
+#define HID_USAGE_CONSUMER_MUTE				0x00E2
+#define HID_USAGE_CONSUMER_VOLUME_INCREMENT	0x00E9
+#define HID_USAGE_CONSUMER_VOLUME_DECREMENT	0x00EA
+#define HID_USAGE_CONSUMER_AC_PAN			0x0238
+
+#define TUD_HID_REPORT_DESC_MOUSE(...) \
+	HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP ), \
+	HID_USAGE ( HID_USAGE_DESKTOP_MOUSE ), \
+	HID_COLLECTION ( HID_COLLECTION_APPLICATION ), \
+		__VA_ARGS__ \
+		HID_USAGE ( HID_USAGE_DESKTOP_POINTER ), \
+		HID_COLLECTION ( HID_COLLECTION_PHYSICAL ), \
+			HID_USAGE_PAGE ( HID_USAGE_PAGE_BUTTON ), \
+			HID_USAGE_MIN ( 1 ), \
+			HID_USAGE_MAX ( 5 ), \
+			HID_LOGICAL_MIN ( 0 ), \
+			HID_LOGICAL_MAX ( 1 ), \
+			HID_REPORT_COUNT ( 5 ), \
+			HID_REPORT_SIZE ( 1 ), \
+			HID_INPUT ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ), \
+			HID_REPORT_COUNT ( 1 ), \
+			HID_REPORT_SIZE ( 3 ), \
+			HID_INPUT ( HID_CONSTANT ), \
+			HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP ), \
+			HID_USAGE ( HID_USAGE_DESKTOP_X ), \
+			HID_USAGE ( HID_USAGE_DESKTOP_Y ), \
+			HID_LOGICAL_MIN ( 0x81 ), \
+			HID_LOGICAL_MAX ( 0x7f ), \
+			HID_REPORT_COUNT ( 2 ), \
+			HID_REPORT_SIZE ( 8 ), \
+			HID_INPUT ( HID_DATA | HID_VARIABLE | HID_RELATIVE ), \
+			HID_USAGE ( HID_USAGE_DESKTOP_WHEEL ), \
+			HID_LOGICAL_MIN ( 0x81 ), \
+			HID_LOGICAL_MAX ( 0x7f ), \
+			HID_REPORT_COUNT ( 1 ), \
+			HID_REPORT_SIZE ( 8 ), \
+			HID_INPUT ( HID_DATA | HID_VARIABLE | HID_RELATIVE ), \
+			HID_USAGE_PAGE ( HID_USAGE_PAGE_CONSUMER ), \
+			HID_USAGE_N ( HID_USAGE_CONSUMER_AC_PAN, 2 ), \
+			HID_LOGICAL_MIN ( 0x81 ), \
+			HID_LOGICAL_MAX ( 0x7f ), \
+			HID_REPORT_COUNT ( 1 ), \
+			HID_REPORT_SIZE ( 8 ), \
+			HID_INPUT ( HID_DATA | HID_VARIABLE | HID_RELATIVE ), \
+		HID_COLLECTION_END, \
+	HID_COLLECTION_END
+
+#define TUD_HID_REPORT_DESC_CONSUMER(...) \
+	HID_USAGE_PAGE ( HID_USAGE_PAGE_CONSUMER ), \
+	HID_USAGE ( HID_USAGE_CONSUMER_CONTROL ), \
+	HID_COLLECTION ( HID_COLLECTION_APPLICATION ), \
+		__VA_ARGS__ \
+		HID_LOGICAL_MIN ( 0x00 ), \
+		HID_LOGICAL_MAX_N( 0x03FF, 2 ), \
+		HID_USAGE_MIN ( 0x00 ), \
+		HID_USAGE_MAX_N ( 0x03FF, 2 ), \
+		HID_REPORT_COUNT ( 1 ), \
+		HID_REPORT_SIZE ( 16 ), \
+		HID_INPUT ( HID_DATA | HID_ARRAY | HID_ABSOLUTE ), \
+	HID_COLLECTION_END
+
+#define TUD_HID_REPORT_DESC_SYSTEM_CONTROL(...) \
+	HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP ), \
+	HID_USAGE ( HID_USAGE_DESKTOP_SYSTEM_CONTROL ), \
+	HID_COLLECTION ( HID_COLLECTION_APPLICATION ), \
+		__VA_ARGS__ \
+		HID_LOGICAL_MIN ( 0x01 ), \
+		HID_LOGICAL_MAX ( 0x03 ), \
+		HID_REPORT_COUNT ( 1 ), \
+		HID_REPORT_SIZE ( 2 ), \
+		HID_USAGE_MIN ( HID_USAGE_DESKTOP_SYSTEM_POWER_DOWN ), \
+		HID_USAGE_MAX ( HID_USAGE_DESKTOP_SYSTEM_WAKE_UP ), \
+		HID_INPUT ( HID_DATA | HID_ARRAY | HID_ABSOLUTE ), \
+		HID_REPORT_COUNT ( 1 ), \
+		HID_REPORT_SIZE ( 6 ), \
+		HID_INPUT ( HID_CONSTANT ), \
+	HID_COLLECTION_END
+
+//--------------------------------------------------------------------+
+// HID class
+//--------------------------------------------------------------------+
+
+#define HID_ITF_PROTOCOL_NONE		0
+#define HID_ITF_PROTOCOL_KEYBOARD	1
+
+#define HID_PROTOCOL_BOOT		0
+#define HID_PROTOCOL_REPORT		1
+
+typedef enum
+{
+	HID_REPORT_TYPE_INVALID = 0,
+	HID_REPORT_TYPE_INPUT,
+	HID_REPORT_TYPE_OUTPUT,
+	HID_REPORT_TYPE_FEATURE,
+} hid_report_type_t;
+
+#define KEYBOARD_LED_NUMLOCK	(1 << 0)
+#define KEYBOARD_LED_CAPSLOCK	(1 << 1)
+
+#define MOUSE_BUTTON_LEFT		(1 << 0)
+#define MOUSE_BUTTON_RIGHT		(1 << 1)
+
+//--------------------------------------------------------------------+
+// Device stack, defined by the test
+//--------------------------------------------------------------------+
+
+bool tusb_init(void);
+void tud_task(void);
+bool tud_ready(void);
+bool tud_suspended(void);
+bool tud_remote_wakeup(void);
+
+bool tud_hid_n_ready(uint8_t instance);
+bool tud_hid_n_report(uint8_t instance, uint8_t report_id, void const *report, uint16_t len);
+uint8_t tud_hid_n_get_protocol(uint8_t instance);
+
+uint32_t tud_vendor_n_available(uint8_t itf);
+uint32_t tud_vendor_n_read(uint8_t itf, void *buffer, uint32_t bufsize);
+uint32_t tud_vendor_n_write(uint8_t itf, void const *buffer, uint32_t bufsize);
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Minimal checks for the host tests, each test binary returns the number of
+// failed checks
+
+static int test_failures;
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			test_failures++; \
+		} \
+	} while (0)
+
+#define CHECK_EQ(a, b) do { \
+		const long long _a = (a), _b = (b); \
+		if (_a != _b) { \
+			fprintf(stderr, "%s:%d: %s == %s failed: %lld != %lld\n", \
+				__FILE__, __LINE__, #a, #b, _a, _b); \
+			test_failures++; \
+		} \
+	} while (0)
+
+#define RUN(test) do { \
+		const int _before = test_failures; \
+		test(); \
+		printf("%s %s\n", (test_failures == _before) ? "ok  " : "FAIL", #test); \
+	} while (0)
+
+#define TEST_RESULT() ((test_failures > 0) ? EXIT_FAILURE : EXIT_SUCCESS)
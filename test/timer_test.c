@@ -0,0 +1,373 @@
+#include "test.h"
+
+#include <hardware/timer.h>
+
+#include "timer.c"
+
+#define TIMERS	8
+
+//--------------------------------------------------------------------+
+// Virtual clock and hardware alarm
+//--------------------------------------------------------------------+
+
+static uint64_t now_us;
+static uint64_t alarm_target_us;
+static bool alarm_set;
+static uint32_t alarm_forced;
+static hardware_alarm_callback_t alarm_callback;
+static uint32_t wakeups;
+
+uint64_t time_us_64(void)
+{
+	return now_us;
+}
+
+int hardware_alarm_claim_unused(bool required)
+{
+	(void)required;
+
+	return 3;
+}
+
+void hardware_alarm_set_callback(uint alarm_num, hardware_alarm_callback_t callback)
+{
+	(void)alarm_num;
+
+	alarm_callback = callback;
+}
+
+// Like the SDK, a target that has passed is not set and reports it was missed
+bool hardware_alarm_set_target(uint alarm_num, absolute_time_t t)
+{
+	(void)alarm_num;
+
+	if (t <= now_us)
+		return true;
+
+	alarm_target_us = t;
+	alarm_set = true;
+
+	return false;
+}
+
+void hardware_alarm_force_irq(uint alarm_num)
+{
+	(void)alarm_num;
+
+	alarm_forced++;
+}
+
+// Run the alarm interrupt whenever it is due, up to `end_us`
+static void run_until(uint64_t end_us)
+{
+	for (;;) {
+		if (alarm_forced) {
+			alarm_forced--;
+		} else if (alarm_set && (alarm_target_us <= end_us)) {
+			now_us = alarm_target_us;
+			alarm_set = false;
+		} else {
+			break;
+		}
+
+		wakeups++;
+		alarm_callback(3);
+	}
+
+	now_us = end_us;
+}
+
+//--------------------------------------------------------------------+
+// Test timers
+//--------------------------------------------------------------------+
+
+static struct timer timers[TIMERS];
+static void (*on_fire)(int id);
+
+static int fired[64];
+static uint64_t fired_at[64];
+static uint32_t fire_count;
+
+static void timer_fired(struct timer *timer)
+{
+	const int id = timer - timers;
+
+	if (fire_count < 64) {
+		fired[fire_count] = id;
+		fired_at[fire_count] = now_us;
+	}
+	fire_count++;
+
+	if (on_fire)
+		on_fire(id);
+}
+
+static void reset(void)
+{
+	int i;
+
+	memset(&self, 0, sizeof(self));
+	memset(timers, 0, sizeof(timers));
+	for (i = 0; i < TIMERS; i++)
+		timers[i].func = timer_fired;
+
+	now_us = 1000000;
+	alarm_set = false;
+	alarm_forced = 0;
+	wakeups = 0;
+	fire_count = 0;
+	on_fire = NULL;
+
+	timer_init();
+}
+
+// Armed timers are in deadline order and the alarm is set for the head
+static bool queue_is_sorted(void)
+{
+	struct timer const* timer;
+
+	for (timer = self.head; timer && timer->next; timer = timer->next)
+		if ((timer->deadline_us > timer->next->deadline_us) || (timer->next->prev != timer))
+			return false;
+
+	return !self.head || (self.alarm_us <= self.head->deadline_us);
+}
+
+//--------------------------------------------------------------------+
+// Tests
+//--------------------------------------------------------------------+
+
+static void test_order(void)
+{
+	static const uint32_t delays_ms[TIMERS] = { 40, 5, 70, 20, 10, 80, 30, 60 };
+	uint32_t i;
+
+	reset();
+
+	for (i = 0; i < TIMERS; i++) {
+		timer_arm_ms(&timers[i], delays_ms[i]);
+		CHECK(queue_is_sorted());
+	}
+	CHECK(self.head == &timers[1]);
+	CHECK_EQ(alarm_target_us, now_us + 5000);
+
+	run_until(now_us + 100000);
+
+	CHECK_EQ(fire_count, TIMERS);
+	CHECK_EQ(wakeups, TIMERS);
+	for (i = 1; i < TIMERS; i++)
+		CHECK(fired_at[i] > fired_at[i - 1]);
+	CHECK_EQ(fired[0], 1);
+	CHECK_EQ(fired[TIMERS - 1], 5);
+	CHECK(self.head == NULL);
+}
+
+// Equal deadlines run in the order armed, in one wakeup
+static void test_same_deadline(void)
+{
+	reset();
+
+	timer_arm_ms(&timers[2], 10);
+	timer_arm_ms(&timers[0], 10);
+	timer_arm_ms(&timers[1], 10);
+	run_until(now_us + 10000);
+
+	CHECK_EQ(fire_count, 3);
+	CHECK_EQ(wakeups, 1);
+	CHECK(fired[0] == 2 && fired[1] == 0 && fired[2] == 1);
+}
+
+static void test_coalesce(void)
+{
+	reset();
+
+	timer_arm_us(&timers[0], 10000);
+	timer_arm_us(&timers[1], 10000 + TIMER_COALESCE_US / 2);
+	timer_arm_us(&timers[2], 10000 + 2 * TIMER_COALESCE_US);
+	run_until(now_us + 20000);
+
+	CHECK_EQ(fire_count, 3);
+	CHECK_EQ(wakeups, 2);
+	CHECK_EQ(fired_at[0], fired_at[1]);
+	CHECK_EQ(fired_at[2] - fired_at[0], 2 * TIMER_COALESCE_US);
+}
+
+static void test_cancel_and_rearm(void)
+{
+	const uint64_t start_us = 1000000;
+
+	reset();
+
+	timer_arm_ms(&timers[0], 5);
+	timer_arm_ms(&timers[1], 8);
+	timer_arm_ms(&timers[2], 9);
+	timer_cancel(&timers[0]);
+	timer_cancel(&timers[2]);
+	CHECK(!timer_is_armed(&timers[0]));
+	CHECK(queue_is_sorted());
+
+	// Earlier moves the alarm up, later leaves it to fire early and re-target
+	timer_arm_ms(&timers[1], 2);
+	CHECK_EQ(alarm_target_us, start_us + 2000);
+	timer_arm_ms(&timers[1], 12);
+	CHECK(queue_is_sorted());
+
+	run_until(start_us + 20000);
+
+	CHECK_EQ(fire_count, 1);
+	CHECK_EQ(fired[0], 1);
+	CHECK_EQ(fired_at[0], start_us + 12000);
+}
+
+static void advance_periodic(int id)
+{
+	// The third run is slow, and two periods pass before it returns
+	if (fire_count == 3)
+		now_us += 25000;
+
+	if (fire_count < 5)
+		timer_advance_us(&timers[id], 10000);
+}
+
+// Periods follow the deadlines, not when the callback ran, unless missed
+static void test_periodic(void)
+{
+	const uint64_t start_us = 1000000;
+
+	reset();
+
+	on_fire = advance_periodic;
+	timer_arm_us(&timers[0], 10000);
+	run_until(start_us + 200000);
+
+	CHECK_EQ(fire_count, 5);
+	CHECK_EQ(fired_at[0], start_us + 10000);
+	CHECK_EQ(fired_at[1], start_us + 20000);
+	CHECK_EQ(fired_at[2], start_us + 30000);
+	CHECK_EQ(fired_at[3], start_us + 30000 + 25000 + 10000);
+	CHECK_EQ(fired_at[4], start_us + 75000);
+}
+
+// A deadline already passed forces the interrupt
+static void test_missed_deadline(void)
+{
+	reset();
+
+	timer_arm_us(&timers[0], 0);
+	CHECK_EQ(alarm_forced, 1);
+	run_until(now_us);
+
+	CHECK_EQ(fire_count, 1);
+	CHECK_EQ(wakeups, 1);
+	CHECK(!timer_is_armed(&timers[0]));
+}
+
+static void arm_and_cancel(int id)
+{
+	if (id == 0) {
+		timer_arm_us(&timers[3], 0);
+		timer_cancel(&timers[1]);
+	}
+}
+
+// Callbacks may arm and cancel other timers due in the same wakeup
+static void test_callback_changes_queue(void)
+{
+	reset();
+
+	on_fire = arm_and_cancel;
+	timer_arm_us(&timers[0], 5000);
+	timer_arm_us(&timers[1], 5000 + TIMER_COALESCE_US / 2);
+	timer_arm_us(&timers[2], 5000 + TIMER_COALESCE_US / 2);
+	run_until(now_us + 10000);
+
+	CHECK_EQ(fire_count, 3);
+	CHECK(fired[0] == 0 && fired[1] == 3 && fired[2] == 2);
+	CHECK_EQ(wakeups, 1);
+}
+
+static void test_remaining(void)
+{
+	reset();
+
+	timer_arm_ms(&timers[0], 5);
+	run_until(now_us + 2000);
+	CHECK_EQ(timer_remaining_us(&timers[0]), 3000);
+
+	timer_cancel(&timers[0]);
+	CHECK_EQ(timer_remaining_us(&timers[0]), 0);
+}
+
+static uint32_t seed = 1;
+
+static uint32_t next_random(void)
+{
+	seed = seed * 1103515245 + 12345;
+
+	return seed >> 8;
+}
+
+// Random arms, cancels and runs against a model of which timers are armed
+static void test_random(void)
+{
+	uint64_t deadline_us[TIMERS];
+	bool armed[TIMERS] = { false };
+	uint32_t round, i;
+	int id;
+
+	reset();
+
+	for (round = 0; round < 5000; round++) {
+		id = next_random() % TIMERS;
+
+		switch (next_random() % 4) {
+		case 0:
+		case 1:
+			timer_arm_us(&timers[id], next_random() % 50000);
+			deadline_us[id] = timers[id].deadline_us;
+			armed[id] = true;
+			break;
+
+		case 2:
+			timer_cancel(&timers[id]);
+			armed[id] = false;
+			break;
+
+		default:
+			fire_count = 0;
+			run_until(now_us + next_random() % 20000);
+
+			for (i = 0; (i < fire_count) && (i < 64); i++) {
+				CHECK(armed[fired[i]]);
+				CHECK(fired_at[i] <= deadline_us[fired[i]]);
+				CHECK(fired_at[i] + TIMER_COALESCE_US >= deadline_us[fired[i]]);
+				armed[fired[i]] = false;
+			}
+
+			// Nothing due is left behind
+			for (i = 0; i < TIMERS; i++) {
+				CHECK_EQ(timer_is_armed(&timers[i]), armed[i]);
+				if (armed[i])
+					CHECK(deadline_us[i] > now_us);
+			}
+			break;
+		}
+
+		CHECK(queue_is_sorted());
+	}
+}
+
+int main(void)
+{
+	RUN(test_order);
+	RUN(test_same_deadline);
+	RUN(test_coalesce);
+	RUN(test_cancel_and_rearm);
+	RUN(test_periodic);
+	RUN(test_missed_deadline);
+	RUN(test_callback_changes_queue);
+	RUN(test_remaining);
+	RUN(test_random);
+
+	return TEST_RESULT();
+}
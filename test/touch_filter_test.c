@@ -0,0 +1,201 @@
+#include "test.h"
+#include "touch_filter.h"
+
+// Motion traces in the touch FIFO sample format, see touch_fifo_pack
+struct sample
+{
+	int8_t dx, dy;
+	uint8_t squal;
+	uint32_t time_ms;
+};
+
+// Register defaults, see reg_init
+static const struct touch_filter_params params = {
+	.min_squal = 16,
+	.full_squal = 48,
+	.alpha_min = 95,
+	.beta = 16,
+};
+
+// Slow, precise positioning: single counts well apart
+static const struct sample slow_trace[] = {
+	{ 1, 0, 60, 0 }, { 1, 0, 60, 24 }, { 0, 1, 60, 47 }, { 1, 0, 60, 71 },
+	{ 1, 1, 60, 96 }, { 1, 0, 60, 120 }, { 0, -1, 60, 143 }, { 1, 0, 60, 170 },
+};
+
+// Flick across the pad, accelerating then stopping
+static const struct sample swipe_trace[] = {
+	{ 2, 1, 70, 0 }, { 6, 2, 70, 8 }, { 14, 4, 72, 16 }, { 27, 7, 72, 24 },
+	{ 40, 10, 71, 32 }, { 46, 12, 70, 40 }, { 38, 9, 70, 48 }, { 22, 5, 68, 56 },
+	{ 9, 2, 66, 64 }, { 3, 1, 64, 72 },
+};
+
+// Finger resting, sensor reporting back and forth counts
+static const struct sample jitter_trace[] = {
+	{ 1, 0, 55, 0 }, { -1, 1, 55, 8 }, { 1, -1, 55, 16 }, { -1, 0, 55, 24 },
+	{ 1, 1, 55, 32 }, { -1, -1, 55, 40 }, { 0, 1, 55, 48 }, { 0, -1, 55, 56 },
+};
+
+// Finger near the edge, surface quality too low to be trusted
+static const struct sample lifted_trace[] = {
+	{ 5, -3, 10, 0 }, { -7, 2, 12, 8 }, { 4, 6, 8, 16 }, { 9, -9, 15, 24 },
+};
+
+// Surface quality halfway between the min and full weight thresholds
+static const struct sample half_quality_trace[] = {
+	{ 4, 2, 32, 0 }, { 4, 2, 32, 8 }, { 4, 2, 32, 16 }, { 4, 2, 32, 24 },
+	{ 4, 2, 32, 32 }, { 4, 2, 32, 40 }, { 4, 2, 32, 48 }, { 4, 2, 32, 56 },
+};
+
+struct totals
+{
+	int in_x, in_y;
+	int out_x, out_y; // before the flush
+	int flush_x, flush_y;
+	int max_step; // largest output of a sample
+};
+
+static struct totals play(struct sample const *trace, size_t len)
+{
+	struct touch_filter filter;
+	struct totals t = { 0 };
+	int8_t x, y;
+	size_t i;
+
+	touch_filter_reset(&filter);
+
+	for (i = 0; i < len; i++) {
+		x = trace[i].dx;
+		y = trace[i].dy;
+		t.in_x += x;
+		t.in_y += y;
+
+		touch_filter_apply(&filter, &params, trace[i].squal, &x, &y);
+		t.out_x += x;
+		t.out_y += y;
+		t.max_step = (abs(x) > t.max_step) ? abs(x) : t.max_step;
+		t.max_step = (abs(y) > t.max_step) ? abs(y) : t.max_step;
+	}
+
+	touch_filter_flush(&filter, &x, &y);
+	t.flush_x = x;
+	t.flush_y = y;
+
+	return t;
+}
+
+#define PLAY(trace) play(trace, sizeof(trace) / sizeof(trace[0]))
+
+static void test_slow_motion_is_not_swallowed(void)
+{
+	const struct totals t = PLAY(slow_trace);
+
+	CHECK_EQ(t.out_x + t.flush_x, t.in_x);
+	CHECK_EQ(t.out_y + t.flush_y, t.in_y);
+}
+
+static void test_single_count_flushed(void)
+{
+	struct touch_filter filter;
+	int8_t x = 1, y = 0;
+
+	touch_filter_reset(&filter);
+
+	// Below the smoothing threshold nothing comes out at once...
+	CHECK(!touch_filter_apply(&filter, &params, 60, &x, &y));
+
+	// ...but it is not lost when motion stops
+	CHECK(touch_filter_flush(&filter, &x, &y));
+	CHECK_EQ(x, 1);
+	CHECK_EQ(y, 0);
+
+	// Flushing resets the filter
+	CHECK(!touch_filter_flush(&filter, &x, &y));
+}
+
+static void test_swipe_has_little_lag(void)
+{
+	const struct totals t = PLAY(swipe_trace);
+
+	// Most of a fast swipe comes out while the finger moves
+	CHECK(t.out_x * 10 >= t.in_x * 9);
+	CHECK_EQ(t.out_x + t.flush_x, t.in_x);
+	CHECK_EQ(t.out_y + t.flush_y, t.in_y);
+}
+
+static void test_jitter_is_smoothed(void)
+{
+	const struct totals t = PLAY(jitter_trace);
+
+	// Back and forth counts cancel out instead of passing through
+	CHECK(t.max_step <= 1);
+	CHECK_EQ(t.out_x + t.flush_x, t.in_x);
+	CHECK_EQ(t.out_y + t.flush_y, t.in_y);
+}
+
+static void test_low_quality_has_no_weight(void)
+{
+	const struct totals t = PLAY(lifted_trace);
+
+	CHECK_EQ(t.out_x, 0);
+	CHECK_EQ(t.out_y, 0);
+	CHECK_EQ(t.flush_x, 0);
+	CHECK_EQ(t.flush_y, 0);
+}
+
+// Less of it comes out while the finger moves, but all of it in the end
+static void test_partial_quality_adds_lag(void)
+{
+	struct sample full_quality_trace[sizeof(half_quality_trace) / sizeof(half_quality_trace[0])];
+	struct totals half, full;
+	size_t i;
+
+	for (i = 0; i < sizeof(full_quality_trace) / sizeof(full_quality_trace[0]); i++) {
+		full_quality_trace[i] = half_quality_trace[i];
+		full_quality_trace[i].squal = params.full_squal;
+	}
+
+	half = PLAY(half_quality_trace);
+	full = PLAY(full_quality_trace);
+
+	CHECK(half.out_x < full.out_x);
+	CHECK(half.out_y <= full.out_y);
+	CHECK(half.max_step <= full.max_step);
+	CHECK_EQ(half.out_x + half.flush_x, half.in_x);
+	CHECK_EQ(half.out_y + half.flush_y, half.in_y);
+}
+
+static void test_output_is_clamped(void)
+{
+	struct touch_filter filter;
+	const struct touch_filter_params sharp = { 0, 1, 255, 0 };
+	int8_t x = 127, y = -128;
+	int i, sum_x = 0, sum_y = 0;
+
+	touch_filter_reset(&filter);
+
+	for (i = 0; i < 4; i++) {
+		x = 127;
+		y = -128;
+		touch_filter_apply(&filter, &sharp, 255, &x, &y);
+		sum_x += x;
+		sum_y += y;
+	}
+	touch_filter_flush(&filter, &x, &y);
+
+	CHECK_EQ(sum_x + x, 4 * 127);
+	CHECK_EQ(sum_y + y, 4 * -128);
+}
+
+int main(void)
+{
+	RUN(test_slow_motion_is_not_swallowed);
+	RUN(test_single_count_flushed);
+	RUN(test_swipe_has_little_lag);
+	RUN(test_jitter_is_smoothed);
+	RUN(test_low_quality_has_no_weight);
+	RUN(test_partial_quality_adds_lag);
+	RUN(test_output_is_clamped);
+
+	return TEST_RESULT();
+}
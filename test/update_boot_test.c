@@ -0,0 +1,148 @@
+#include "test.h"
+#include "update_fake.h"
+
+#include "update.c"
+
+static uint8_t running[24 * 1024];
+static uint8_t update[30 * 1024 + 77];
+
+static void fill_random(uint8_t *data, uint32_t len, uint32_t seed)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (uint8_t)(seed >> 16);
+	}
+}
+
+// Stage `data` over the running firmware and commit it
+static bool send_update(const uint8_t *data, uint32_t len)
+{
+	const uint8_t start = 0;
+	uint32_t pos;
+	uint8_t seq = 1;
+
+	if (fake_send_frame(UPDATE_FRAME_START, 0, &start, 1) != 1)
+		return false;
+	for (pos = 0; pos < len; pos += UPDATE_FRAME_PAYLOAD_MAX)
+		if (fake_send_frame(UPDATE_FRAME_DATA, seq++, &data[pos], MIN(len - pos, UPDATE_FRAME_PAYLOAD_MAX)) != 1)
+			return false;
+	if (fake_send_frame(UPDATE_FRAME_END, seq, NULL, 0) != 0)
+		return false;
+
+	return fake_commit();
+}
+
+static bool running_is(const uint8_t *data, uint32_t len)
+{
+	return (running_image_len() == len) && (memcmp(fake_image_start, data, len) == 0);
+}
+
+static void test_normal_boot(void)
+{
+	fake_flash_reset(running, sizeof(running));
+
+	update_check_boot();
+	CHECK_EQ(update_get_boot_state(), UPDATE_BOOT_NORMAL);
+}
+
+static void test_confirm(void)
+{
+	fake_flash_reset(running, sizeof(running));
+	CHECK(send_update(update, sizeof(update)));
+
+	CHECK(fake_flashloader_boot(FAKE_STAGING_OFFSET));
+	CHECK(running_is(update, sizeof(update)));
+	update_check_boot();
+	CHECK_EQ(update_get_boot_state(), UPDATE_BOOT_TRIAL);
+	CHECK_EQ(watchdog_hw->scratch[1], (uint32_t)(XIP_BASE + FAKE_BACKUP_OFFSET));
+
+	update_confirm_boot();
+	CHECK_EQ(update_get_boot_state(), UPDATE_BOOT_CONFIRMED);
+	CHECK_EQ(watchdog_hw->scratch[0], 0);
+
+	// Later boots are normal
+	update_check_boot();
+	CHECK_EQ(update_get_boot_state(), UPDATE_BOOT_NORMAL);
+}
+
+// A reset before confirming makes the flashloader restore the backup
+static void test_roll_back(void)
+{
+	fake_flash_reset(running, sizeof(running));
+	CHECK(send_update(update, sizeof(update)));
+
+	CHECK(fake_flashloader_boot(FAKE_STAGING_OFFSET));
+	update_check_boot();
+	CHECK_EQ(update_get_boot_state(), UPDATE_BOOT_TRIAL);
+
+	CHECK(fake_flashloader_boot(FAKE_BACKUP_OFFSET));
+	CHECK(running_is(running, sizeof(running)));
+	update_check_boot();
+	CHECK_EQ(update_get_boot_state(), UPDATE_BOOT_ROLLED_BACK);
+
+	update_check_boot();
+	CHECK_EQ(update_get_boot_state(), UPDATE_BOOT_NORMAL);
+}
+
+// The running firmware flashed again matches the backup, but is an update
+static void test_reflash_same(void)
+{
+	fake_flash_reset(running, sizeof(running));
+	CHECK(send_update(running, sizeof(running)));
+
+	CHECK(fake_flashloader_boot(FAKE_STAGING_OFFSET));
+	CHECK(running_is(running, sizeof(running)));
+	update_check_boot();
+	CHECK_EQ(update_get_boot_state(), UPDATE_BOOT_TRIAL);
+
+	update_confirm_boot();
+	CHECK_EQ(update_get_boot_state(), UPDATE_BOOT_CONFIRMED);
+}
+
+// Same length and contents except one byte is still an update to roll back
+static void test_roll_back_same_length(void)
+{
+	memcpy(update, running, sizeof(running));
+	update[100] ^= 0x01;
+
+	fake_flash_reset(running, sizeof(running));
+	CHECK(send_update(update, sizeof(running)));
+
+	CHECK(fake_flashloader_boot(FAKE_BACKUP_OFFSET));
+	update_check_boot();
+	CHECK_EQ(update_get_boot_state(), UPDATE_BOOT_ROLLED_BACK);
+}
+
+// Up to the staging area, less the flashloader before the app
+static void test_image_size_limit(void)
+{
+	static uint8_t largest[FAKE_APP_MAX_SIZE + 1];
+
+	fill_random(largest, sizeof(largest), 3);
+
+	fake_flash_reset(running, sizeof(running));
+	CHECK(!send_update(largest, sizeof(largest)));
+	CHECK_EQ(update_frame_get_status(), UPDATE_FRAME_FAILED);
+
+	fake_flash_reset(running, sizeof(running));
+	CHECK(send_update(largest, FAKE_APP_MAX_SIZE));
+	CHECK(fake_flashloader_boot(FAKE_STAGING_OFFSET));
+	CHECK(running_is(largest, FAKE_APP_MAX_SIZE));
+}
+
+int main(void)
+{
+	fill_random(running, sizeof(running), 1);
+	fill_random(update, sizeof(update), 2);
+
+	RUN(test_normal_boot);
+	RUN(test_confirm);
+	RUN(test_roll_back);
+	RUN(test_reflash_same);
+	RUN(test_roll_back_same_length);
+	RUN(test_image_size_limit);
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,132 @@
+#include "test.h"
+#include "update_fake.h"
+
+#include <time.h>
+
+#include "update.c"
+
+#define BENCH_LEN	(120 * 1024)
+#define BENCH_ROUNDS	20
+
+static uint8_t buffer[BENCH_LEN];
+
+static void fill_random(uint8_t *data, uint32_t len, uint32_t seed)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (uint8_t)(seed >> 16);
+	}
+}
+
+// CRC-32/MPEG-2, which is what the sniffer computes with an all ones seed
+static void test_check_value(void)
+{
+	static const uint8_t check[] = "123456789";
+
+	CHECK_EQ(fake_crc32(check, 9, 0xffffffff), 0x0376e6e7);
+	CHECK_EQ(crc32(check, 9, 0xffffffff), 0x0376e6e7);
+	CHECK_EQ(crc32(check, 0, 0xffffffff), 0xffffffff);
+}
+
+static void test_matches_bitwise(void)
+{
+	uint32_t len;
+
+	fill_random(buffer, 4096, 1);
+
+	for (len = 0; len <= 4096; len += (len < 64) ? 1 : 61)
+		CHECK_EQ(crc32(buffer, len, 0xffffffff), fake_crc32(buffer, len, 0xffffffff));
+
+	// Same bytes every value, the table covers each nibble
+	for (len = 0; len < 256; len++) {
+		memset(buffer, len, 16);
+		CHECK_EQ(crc32(buffer, 16, 0), fake_crc32(buffer, 16, 0));
+	}
+}
+
+// Staging computes the CRC a sector at a time
+static void test_chained(void)
+{
+	uint32_t crc = 0xffffffff, pos, len;
+
+	fill_random(buffer, BENCH_LEN, 2);
+
+	for (pos = 0; pos < BENCH_LEN; pos += len) {
+		len = MIN(BENCH_LEN - pos, 1 + (pos % 5000));
+		crc = crc32(&buffer[pos], len, crc);
+	}
+
+	CHECK_EQ(crc, crc32(buffer, BENCH_LEN, 0xffffffff));
+}
+
+// What the flashloader verifies after the reboot
+static void test_staged_header(void)
+{
+	static uint8_t running[40 * 1024], image[70 * 1024 + 123];
+	const tFlashHeader *backup = (const tFlashHeader *)&fake_flash[FAKE_BACKUP_OFFSET];
+	const uint8_t start = 0;
+	const uint8_t *staged;
+	uint32_t len = 0, pos;
+	uint8_t seq = 1;
+
+	fill_random(running, sizeof(running), 3);
+	fill_random(image, sizeof(image), 4);
+	fake_flash_reset(running, sizeof(running));
+
+	CHECK_EQ(fake_send_frame(UPDATE_FRAME_START, 0, &start, 1), 1);
+	for (pos = 0; pos < sizeof(image); pos += UPDATE_FRAME_PAYLOAD_MAX)
+		CHECK_EQ(fake_send_frame(UPDATE_FRAME_DATA, seq++, &image[pos], MIN(sizeof(image) - pos, UPDATE_FRAME_PAYLOAD_MAX)), 1);
+	CHECK_EQ(fake_send_frame(UPDATE_FRAME_END, seq, NULL, 0), 0);
+
+	CHECK(fake_commit());
+
+	staged = fake_staged_image(&len);
+	CHECK(staged != NULL);
+	CHECK_EQ(len, sizeof(image));
+	if (staged)
+		CHECK(memcmp(staged, image, sizeof(image)) == 0);
+
+	// The backup of the running image has to pass the same check
+	CHECK_EQ(backup->length, sizeof(running));
+	CHECK_EQ(backup->crc32, fake_crc32(running, sizeof(running), 0xffffffff));
+}
+
+static double bench(uint32_t (*func)(const uint8_t *, uint32_t, uint32_t))
+{
+	struct timespec start, end;
+	volatile uint32_t sink = 0;
+	int round;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0; round < BENCH_ROUNDS; round++)
+		sink += func(buffer, BENCH_LEN, 0xffffffff);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	(void)sink;
+
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ((double)BENCH_ROUNDS * BENCH_LEN);
+}
+
+// Host numbers only compare the two, the device runs at 125 MHz from flash
+static void bench_crc(void)
+{
+	const double nibble = bench(crc32);
+	const double bitwise = bench(fake_crc32);
+
+	printf("     crc32 nibble table %.2f ns/byte, bitwise %.2f ns/byte, %.1fx\n",
+		nibble, bitwise, bitwise / nibble);
+}
+
+int main(void)
+{
+	RUN(test_check_value);
+	RUN(test_matches_bitwise);
+	RUN(test_chained);
+	RUN(test_staged_header);
+
+	bench_crc();
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,191 @@
+#include "update_fake.h"
+
+#include <hardware/flash.h>
+#include <hardware/structs/watchdog.h>
+#include <hardware/watchdog.h>
+#include <pico/time.h>
+
+#include <flashloader.h>
+#include <string.h>
+
+#include "timer.h"
+#include "update.h"
+
+uint8_t fake_flash[FAKE_FLASH_SIZE];
+char *fake_image_start;
+char *fake_image_end;
+uint32_t fake_erase_count;
+uint32_t fake_program_count;
+
+static watchdog_hw_t watchdog;
+watchdog_hw_t *watchdog_hw = &watchdog;
+
+static jmp_buf reboot;
+static uint64_t time_us;
+
+static irq_handler_t irq_handlers[32];
+static bool worker_started;
+static int last_rc;
+
+static void recv_callback(int rc)
+{
+	last_rc = rc;
+}
+static struct update_callback update_callback = { .func = recv_callback };
+
+void fake_irq_set_exclusive_handler(uint num, irq_handler_t handler)
+{
+	irq_handlers[num] = handler;
+}
+
+void fake_irq_set_pending(uint num)
+{
+	if (irq_handlers[num])
+		irq_handlers[num]();
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count)
+{
+	memset(&fake_flash[flash_offs], 0xff, count);
+	fake_erase_count++;
+}
+
+// Programming can only clear bits
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		fake_flash[flash_offs + i] &= data[i];
+
+	fake_program_count++;
+}
+
+void watchdog_reboot(uint32_t pc, uint32_t sp, uint32_t delay_ms)
+{
+	(void)pc;
+	(void)sp;
+	(void)delay_ms;
+
+	longjmp(reboot, 1);
+}
+
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug) { (void)delay_ms; (void)pause_on_debug; }
+void watchdog_update(void) { }
+
+// Every call is a millisecond later, so rates and elapsed times move
+absolute_time_t get_absolute_time(void)
+{
+	time_us += 1000;
+
+	return time_us;
+}
+
+void timer_arm_ms(struct timer *timer, uint32_t delay_ms) { (void)timer; (void)delay_ms; }
+void timer_cancel(struct timer *timer) { (void)timer; }
+
+void fake_flash_reset(const uint8_t *running, uint32_t len)
+{
+	memset(fake_flash, 0xff, sizeof(fake_flash));
+	memcpy(&fake_flash[FAKE_APP_OFFSET], running, len);
+	fake_image_start = (char *)&fake_flash[FAKE_APP_OFFSET];
+	fake_image_end = (char *)&fake_flash[FAKE_APP_OFFSET + len];
+	memset(&watchdog, 0, sizeof(watchdog));
+	fake_erase_count = 0;
+	fake_program_count = 0;
+
+	if (!worker_started) {
+		update_worker_init();
+		update_add_recv_callback(&update_callback);
+		worker_started = true;
+	}
+}
+
+uint32_t fake_crc32(const uint8_t *data, uint32_t len, uint32_t crc)
+{
+	int bit;
+
+	while (len--) {
+		crc ^= (uint32_t)*data++ << 24;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : (crc << 1);
+	}
+
+	return crc;
+}
+
+int fake_send_frame(uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len)
+{
+	uint8_t buf[UPDATE_FRAME_HEADER_LEN + UPDATE_FRAME_PAYLOAD_MAX + UPDATE_FRAME_CRC_LEN];
+	uint32_t crc;
+	int i;
+
+	buf[0] = type;
+	buf[1] = seq;
+	buf[2] = len;
+	memcpy(&buf[UPDATE_FRAME_HEADER_LEN], payload, len);
+
+	crc = fake_crc32(buf, UPDATE_FRAME_HEADER_LEN + len, 0xffffffff);
+	for (i = 0; i < UPDATE_FRAME_CRC_LEN; i++)
+		buf[UPDATE_FRAME_HEADER_LEN + len + i] = (uint8_t)(crc >> (8 * i));
+
+	last_rc = 1;
+	update_frame_begin();
+	for (i = 0; i < UPDATE_FRAME_HEADER_LEN + len + UPDATE_FRAME_CRC_LEN; i++)
+		update_frame_recv(buf[i]);
+
+	return last_rc;
+}
+
+int fake_send_hex(const char *text, uint32_t len)
+{
+	uint32_t i;
+
+	last_rc = 1;
+	for (i = 0; (i < len) && (last_rc != 0); i++)
+		update_recv((uint8_t)text[i]);
+
+	return last_rc;
+}
+
+bool fake_commit(void)
+{
+	if (setjmp(reboot) == 0) {
+		update_commit_and_reboot();
+		return false;
+	}
+
+	return (watchdog.scratch[0] == FLASH_MAGIC1)
+		&& (watchdog.scratch[1] == (uint32_t)(XIP_BASE + FAKE_STAGING_OFFSET));
+}
+
+const uint8_t *fake_staged_image(uint32_t *len)
+{
+	const tFlashHeader *header = (const tFlashHeader *)&fake_flash[FAKE_STAGING_OFFSET];
+
+	if ((header->magic1 != FLASH_MAGIC1) || (header->magic2 != FLASH_MAGIC2)
+	 || (header->length > FAKE_STAGING_OFFSET - sizeof(*header))
+	 || (fake_crc32(header->data, header->length, 0xffffffff) != header->crc32))
+		return NULL;
+
+	*len = header->length;
+
+	return header->data;
+}
+
+bool fake_flashloader_boot(uint32_t offset)
+{
+	const tFlashHeader *header = (const tFlashHeader *)&fake_flash[offset];
+
+	if ((header->magic1 != FLASH_MAGIC1) || (header->magic2 != FLASH_MAGIC2)
+	 || (header->length > FAKE_APP_MAX_SIZE)
+	 || (fake_crc32(header->data, header->length, 0xffffffff) != header->crc32))
+		return false;
+
+	memset(&fake_flash[FAKE_APP_OFFSET], 0xff, FAKE_APP_MAX_SIZE);
+	memcpy(&fake_flash[FAKE_APP_OFFSET], header->data, header->length);
+	fake_image_end = (char *)&fake_flash[FAKE_APP_OFFSET + header->length];
+	memset(&watchdog, 0, sizeof(watchdog));
+
+	return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+// Flash, watchdog and clock behind update.c on the host. Include before
+// update.c, the running image is redirected into the fake flash.
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <hardware/irq.h>
+
+// Flash offsets used by update.c
+#define FAKE_STAGING_OFFSET	(128 * 1024)
+#define FAKE_BACKUP_OFFSET	(2 * FAKE_STAGING_OFFSET)
+#define FAKE_SPARE_OFFSET	(FAKE_BACKUP_OFFSET + FAKE_STAGING_OFFSET + 4096)
+#define FAKE_FLASH_SIZE		(FAKE_SPARE_OFFSET + FAKE_STAGING_OFFSET)
+
+// The running image starts after the flashloader
+#define FAKE_APP_OFFSET		(16 * 1024)
+#define FAKE_APP_MAX_SIZE	(FAKE_STAGING_OFFSET - FAKE_APP_OFFSET)
+
+extern uint8_t fake_flash[FAKE_FLASH_SIZE];
+
+// Running image, at FAKE_APP_OFFSET in the fake flash
+extern char *fake_image_start;
+extern char *fake_image_end;
+#define __flash_binary_start	(*fake_image_start)
+#define __flash_binary_end		(*fake_image_end)
+
+// The update worker interrupt runs as soon as it is made pending
+void fake_irq_set_exclusive_handler(uint num, irq_handler_t handler);
+void fake_irq_set_pending(uint num);
+#define irq_set_exclusive_handler	fake_irq_set_exclusive_handler
+#define irq_set_pending			fake_irq_set_pending
+
+extern uint32_t fake_erase_count;
+extern uint32_t fake_program_count;
+
+// Erased flash holding `running` as the current firmware
+void fake_flash_reset(const uint8_t *running, uint32_t len);
+
+// Same CRC-32 as the flashloader and etc/update_fw.py, a bit at a time
+uint32_t fake_crc32(const uint8_t *data, uint32_t len, uint32_t crc);
+
+// Send one binary update frame, return the result the worker reported for
+// it, or 1 if it reported nothing
+int fake_send_frame(uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len);
+
+// Write HEX text a byte at a time up to the first result of 0, return
+// that or the last result the worker reported
+int fake_send_hex(const char *text, uint32_t len);
+
+// Commit the staged update, return true if it got as far as the reboot
+bool fake_commit(void);
+
+// Image in the staging area as the flashloader would accept it, or NULL
+// if the header or CRC is wrong
+const uint8_t *fake_staged_image(uint32_t *len);
+
+// Reboot through the flashloader, copying the image at `offset` over the
+// running firmware. Return false if the flashloader would reject it.
+bool fake_flashloader_boot(uint32_t offset);
@@ -0,0 +1,538 @@
+#include "test.h"
+#include "update_fake.h"
+
+#include <time.h>
+
+#include "update.c"
+
+#define IMAGE_MAX	(8 * 1024)
+#define TEXT_MAX	(4 * IMAGE_MAX)
+#define FUZZ_ROUNDS	1500
+
+static uint8_t image[IMAGE_MAX];
+static uint8_t reference[FAKE_APP_MAX_SIZE];
+static char text[TEXT_MAX];
+static uint32_t seed = 1;
+
+static uint32_t next_random(void)
+{
+	seed = seed * 1103515245 + 12345;
+
+	return seed >> 8;
+}
+
+//--------------------------------------------------------------------+
+// Intel HEX writer, varying record sizes, case and line ends
+//--------------------------------------------------------------------+
+
+static struct
+{
+	char *out;
+	uint32_t len;
+	const char *eol;
+	bool upper;
+} writer;
+
+static void put_text(const char *s)
+{
+	while (*s)
+		writer.out[writer.len++] = *s++;
+}
+
+static void put_byte(uint8_t b)
+{
+	const char *digits = (writer.upper) ? "0123456789ABCDEF" : "0123456789abcdef";
+
+	writer.out[writer.len++] = digits[b >> 4];
+	writer.out[writer.len++] = digits[b & 0x0f];
+}
+
+static void put_record(uint8_t type, uint16_t addr, const uint8_t *data, uint8_t count)
+{
+	uint8_t sum = count + (addr >> 8) + (addr & 0xff) + type;
+	uint8_t i;
+
+	// Blank lines are ignored, junk before the start code is skipped
+	if ((next_random() % 16) == 0)
+		put_text(writer.eol);
+	if ((next_random() % 16) == 0)
+		put_text("  ");
+
+	put_text(":");
+	put_byte(count);
+	put_byte(addr >> 8);
+	put_byte(addr & 0xff);
+	put_byte(type);
+	for (i = 0; i < count; i++) {
+		put_byte(data[i]);
+		sum += data[i];
+	}
+	put_byte((uint8_t)-sum);
+	put_text(writer.eol);
+}
+
+// Random image of up to three sections, as HEX text. Return the text length,
+// the flattened image with gaps as erased flash is left in `image`.
+static uint32_t generate(char *out, uint32_t *image_len)
+{
+	static const char *eols[] = { "\n", "\r\n", "\r" };
+	const uint32_t base = 0x10000000 + ((next_random() % 2) ? 0xf000 + (next_random() % 0x1000) : 0x100);
+	const uint32_t sections = 1 + next_random() % 3;
+	uint32_t addr = base, end, ext = 0xffffffff, section, count, i;
+	uint8_t start[4];
+
+	writer.out = out;
+	writer.len = 0;
+	writer.eol = eols[next_random() % 3];
+	writer.upper = next_random() % 2;
+
+	put_text("+Beepy");
+	put_text(writer.eol);
+
+	*image_len = 0;
+	for (section = 0; section < sections; section++) {
+		end = addr + 1 + next_random() % (IMAGE_MAX / 4);
+		if (end - base > IMAGE_MAX)
+			end = base + IMAGE_MAX;
+
+		for (; addr < end; addr += count) {
+			count = MIN(end - addr, 1 + next_random() % 64);
+
+			// Records do not cross a 64 KB boundary
+			count = MIN(count, 0x10000 - (addr & 0xffff));
+
+			if ((addr >> 16) != ext) {
+				ext = addr >> 16;
+				start[0] = ext >> 8;
+				start[1] = ext & 0xff;
+				put_record(TYPE_EXTLIN, 0, start, 2);
+			}
+
+			for (i = 0; i < count; i++)
+				image[addr - base + i] = (uint8_t)next_random();
+
+			put_record(TYPE_DATA, addr & 0xffff, &image[addr - base], count);
+		}
+		*image_len = addr - base;
+
+		// Gap, filled as erased flash
+		end = addr + next_random() % 300;
+		if (end - base >= IMAGE_MAX)
+			break;
+		for (; addr < end; addr++)
+			image[addr - base] = 0xff;
+	}
+
+	// Ignored, but must not upset the parser
+	if (next_random() % 2) {
+		memcpy(start, &base, sizeof(start));
+		put_record(TYPE_STARTLIN, 0, start, 4);
+	}
+
+	put_record(TYPE_EOF, 0, NULL, 0);
+
+	return writer.len;
+}
+
+// `data` at address 0 in records of 16 bytes, as HEX text. With
+// `bad_checksum` the last data record fails its checksum.
+static uint32_t put_image(char *out, const uint8_t *data, uint32_t len, bool bad_checksum)
+{
+	uint32_t addr;
+
+	writer.out = out;
+	writer.len = 0;
+	writer.eol = "\n";
+	writer.upper = true;
+
+	put_text("+");
+	put_text(writer.eol);
+	for (addr = 0; addr < len; addr += 16)
+		put_record(TYPE_DATA, addr, &data[addr], MIN(len - addr, 16));
+	if (bad_checksum)
+		out[writer.len - 2] = (out[writer.len - 2] == '0') ? '1' : '0';
+	put_record(TYPE_EOF, 0, NULL, 0);
+
+	return writer.len;
+}
+
+//--------------------------------------------------------------------+
+// Reference decoder, a line at a time like the parser before streaming,
+// but as strict as the firmware is meant to be
+//--------------------------------------------------------------------+
+
+static int hex_digit(char c)
+{
+	if ((c >= '0') && (c <= '9'))
+		return c - '0';
+	if ((c >= 'a') && (c <= 'f'))
+		return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F'))
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+static bool is_line_end(char c)
+{
+	return (c == '\r') || (c == '\n');
+}
+
+// Return true if `in` is a complete update, its image in `out`
+static bool reference_decode(const char *in, uint32_t len, uint8_t *out, uint32_t *out_len)
+{
+	uint32_t pos = 0, line_len, n, i, ext = 0, base = 0, data_len = 0, addr, value;
+	uint8_t record[5 + 255], sum;
+	const char *line, *colon;
+	bool have_data = false;
+	int hi, lo;
+
+	// Header line
+	while ((pos < len) && !is_line_end(in[pos]))
+		pos++;
+
+	for (;;) {
+		line = &in[++pos];
+		for (line_len = 0; (pos < len) && !is_line_end(in[pos]); pos++)
+			line_len++;
+
+		// Unterminated lines are not processed yet
+		if (pos >= len)
+			return false;
+
+		if (line_len == 0)
+			continue;
+
+		colon = memchr(line, ':', line_len);
+		if (!colon)
+			return false;
+		line_len -= colon + 1 - line;
+		line = colon + 1;
+
+		if ((line_len % 2) || (line_len / 2 < 5) || (line_len / 2 > sizeof(record)))
+			return false;
+
+		sum = 0;
+		for (n = 0; n < line_len / 2; n++) {
+			hi = hex_digit(line[2 * n]);
+			lo = hex_digit(line[2 * n + 1]);
+			if ((hi < 0) || (lo < 0))
+				return false;
+			record[n] = (uint8_t)((hi << 4) | lo);
+			sum += record[n];
+		}
+
+		if ((n != 5u + record[0]) || (sum != 0))
+			return false;
+
+		addr = ext + ((record[1] << 8) | record[2]);
+
+		if (record[3] == TYPE_DATA) {
+			if (record[0] == 0)
+				continue;
+			if (!have_data) {
+				base = addr;
+				have_data = true;
+			}
+			if ((addr < base) || (addr - base < data_len) || (addr - base + record[0] > FAKE_APP_MAX_SIZE))
+				return false;
+			for (; data_len < addr - base; data_len++)
+				out[data_len] = 0xff;
+			for (i = 0; i < record[0]; i++)
+				out[data_len++] = record[4 + i];
+			continue;
+		}
+
+		value = 0;
+		for (i = 0; i < record[0]; i++)
+			value = (value << 8) | record[4 + i];
+
+		if (record[3] == TYPE_EOF) {
+			*out_len = data_len;
+			return have_data;
+		}
+
+		if (record[3] == TYPE_EXTLIN)
+			ext = (value & 0xffff) << 16;
+	}
+}
+
+//--------------------------------------------------------------------+
+// Mutations
+//--------------------------------------------------------------------+
+
+// Change a field of a random record and fix up its checksum, so the line
+// is still valid but the image, address or record type changes
+static void mutate_record(char *t, uint32_t len, uint32_t keep)
+{
+	uint32_t pos = keep + next_random() % (len - keep), n, count;
+	uint8_t sum = 0, b;
+	int hi, lo;
+
+	while ((pos < len) && (t[pos] != ':'))
+		pos++;
+	if ((pos + 3 >= len) || (hex_digit(t[pos + 1]) < 0) || (hex_digit(t[pos + 2]) < 0))
+		return;
+
+	count = (hex_digit(t[pos + 1]) << 4) | hex_digit(t[pos + 2]);
+	if (pos + 1 + 2 * (5 + count) > len)
+		return;
+
+	// Any byte but the count
+	n = 1 + next_random() % (3 + count);
+	t[pos + 1 + 2 * n + next_random() % 2] = "0123456789abcdef"[next_random() % 16];
+
+	for (n = 0; n < 4 + count; n++) {
+		hi = hex_digit(t[pos + 1 + 2 * n]);
+		lo = hex_digit(t[pos + 2 + 2 * n]);
+		if ((hi < 0) || (lo < 0))
+			return;
+		sum += (uint8_t)((hi << 4) | lo);
+	}
+
+	b = (uint8_t)-sum;
+	t[pos + 1 + 2 * n] = "0123456789ABCDEF"[b >> 4];
+	t[pos + 2 + 2 * n] = "0123456789ABCDEF"[b & 0x0f];
+}
+
+// Leave the header line alone, a '+' would restart the update
+static uint32_t mutate(char *t, uint32_t len, uint32_t keep)
+{
+	static const char alphabet[] = "0123456789abcdefABCDEF::\r\n\n g";
+	const uint32_t mutations = 1 + next_random() % 3;
+	uint32_t i, pos;
+
+	for (i = 0; i < mutations; i++) {
+		pos = keep + next_random() % (len - keep);
+
+		switch (next_random() % 4) {
+		case 0:
+			t[pos] = alphabet[next_random() % (sizeof(alphabet) - 1)];
+			break;
+
+		case 1:
+			memmove(&t[pos], &t[pos + 1], len - pos - 1);
+			len--;
+			break;
+
+		case 2:
+			if (len < TEXT_MAX) {
+				memmove(&t[pos + 1], &t[pos], len - pos);
+				t[pos] = alphabet[next_random() % (sizeof(alphabet) - 1)];
+				len++;
+			}
+			break;
+
+		default:
+			mutate_record(t, len, keep);
+			break;
+		}
+	}
+
+	return len;
+}
+
+//--------------------------------------------------------------------+
+// Tests
+//--------------------------------------------------------------------+
+
+static uint8_t running[4096];
+
+static void reset(void)
+{
+	fake_flash_reset(running, sizeof(running));
+}
+
+// Send `t` and check it is accepted exactly when the reference accepts
+// it, and that what would be flashed is what the reference decoded
+static bool check_against_reference(const char *t, uint32_t len)
+{
+	const uint8_t *staged;
+	uint32_t ref_len = 0, staged_len = 0;
+	bool ref_ok, ok;
+
+	ref_ok = reference_decode(t, len, reference, &ref_len);
+
+	reset();
+	ok = (fake_send_hex(t, len) == 0);
+	CHECK_EQ(ok, ref_ok);
+
+	if (!ok || !ref_ok)
+		return false;
+
+	CHECK(fake_commit());
+	staged = fake_staged_image(&staged_len);
+	CHECK(staged != NULL);
+	CHECK_EQ(staged_len, ref_len);
+	if (staged && (staged_len == ref_len))
+		CHECK(memcmp(staged, reference, ref_len) == 0);
+
+	return true;
+}
+
+static void test_valid_images(void)
+{
+	uint32_t round, len, image_len, ref_len;
+
+	for (round = 0; round < 200; round++) {
+		len = generate(text, &image_len);
+
+		// The reference agrees with the generator
+		ref_len = 0;
+		CHECK(reference_decode(text, len, reference, &ref_len));
+		CHECK_EQ(ref_len, image_len);
+		CHECK(memcmp(reference, image, image_len) == 0);
+
+		CHECK(check_against_reference(text, len));
+	}
+}
+
+static void test_fuzz(void)
+{
+	uint32_t round, len, image_len, keep, accepted = 0;
+
+	for (round = 0; round < FUZZ_ROUNDS; round++) {
+		len = generate(text, &image_len);
+
+		for (keep = 0; !is_line_end(text[keep]); keep++)
+			;
+		keep++;
+
+		len = mutate(text, len, keep);
+		accepted += check_against_reference(text, len);
+	}
+
+	printf("     %u mutated updates, %u accepted by both parsers\n", FUZZ_ROUNDS, accepted);
+}
+
+static void test_errors(void)
+{
+	static const struct {
+		const char *text;
+		int rc;
+	} cases[] = {
+		{ "+\n:0400000001020304F1\n", -UPDATE_FAILED_BAD_CHECKSUM },
+		{ "+\n:0400000001020304F\n", -UPDATE_FAILED_BAD_LINE },
+		{ "+\n:0400000001020304f2\n:00000001ff\n", 0 },
+		{ "+\n:0400000001020g04F2\n", -UPDATE_FAILED_BAD_LINE },
+		{ "+\n:04000000010203F6\n", -UPDATE_FAILED_BAD_LINE },
+		{ "+\n:0400000001020304F200\n", -UPDATE_FAILED_BAD_LINE },
+		{ "+\nx\n", -UPDATE_FAILED_BAD_LINE },
+		{ "+\n:00000001FF\n", -UPDATE_FAILED_FLASH_EMPTY },
+		{ "+\n:0100100001EE\n:0100000002FD\n", -UPDATE_FAILED_BAD_ADDRESS },
+		{ "+\n:020000040001F9\n:0100000001FE\n:020000040000FA\n:0100000002FD\n", -UPDATE_FAILED_BAD_ADDRESS },
+		{ "+\n:020000040001F9\n:0100000001FE\n:020000040003F7\n:0100000002FD\n", -UPDATE_FAILED_FLASH_OVERFLOW },
+		{ "+\n:0100000001FE\n:00000001FF", 1 },
+	};
+	uint32_t i;
+	char line[64];
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		reset();
+		CHECK_EQ(fake_send_hex(cases[i].text, strlen(cases[i].text)), cases[i].rc);
+	}
+
+	// Failures stick until the update is restarted
+	reset();
+	CHECK_EQ(fake_send_hex(cases[0].text, strlen(cases[0].text)), -UPDATE_FAILED_BAD_CHECKSUM);
+	strcpy(line, ":0100000001FE\n:00000001FF\n");
+	CHECK_EQ(fake_send_hex(line, strlen(line)), -UPDATE_FAILED_BAD_CHECKSUM);
+	strcpy(line, "+\n:0100000001FE\n:00000001FF\n");
+	CHECK_EQ(fake_send_hex(line, strlen(line)), 0);
+}
+
+// A failed update erases what it programmed, so the next boot has nothing
+// to erase and a different image can be sent in the same boot
+static void test_retry(void)
+{
+	static uint8_t old[IMAGE_MAX], first[IMAGE_MAX], second[IMAGE_MAX];
+	const uint8_t *staged;
+	uint32_t len, i, offset, staged_len = 0;
+
+	for (i = 0; i < sizeof(old); i++)
+		old[i] = (uint8_t)next_random();
+
+	// Same length, changed in the second sector so that neither can be
+	// programmed over the running image or each other
+	old[6000] = 0x00;
+	memcpy(first, old, sizeof(old));
+	first[6000] = 0x0f;
+	memcpy(second, old, sizeof(old));
+	second[6000] = 0xf0;
+
+	// Booted from an update that was flashed from the staging area
+	fake_flash_reset(old, sizeof(old));
+	memcpy(&fake_flash[FAKE_STAGING_OFFSET + sizeof(tFlashHeader)], old, sizeof(old));
+	update_erase_staging();
+
+	len = put_image(text, first, sizeof(first), true);
+	CHECK_EQ(fake_send_hex(text, len), -UPDATE_FAILED_BAD_CHECKSUM);
+
+	// Nothing is left for the next boot to erase
+	CHECK(flash_sector_is_blank(staging_flash(0)));
+	for (offset = 0; offset < FAKE_STAGING_OFFSET; offset += FLASH_SECTOR_SIZE)
+		CHECK(flash_sector_is_blank(spare_flash(offset)));
+
+	len = put_image(text, second, sizeof(second), false);
+	CHECK_EQ(fake_send_hex(text, len), 0);
+	CHECK(fake_commit());
+
+	staged = fake_staged_image(&staged_len);
+	CHECK(staged && (staged_len == sizeof(second)) && (memcmp(staged, second, sizeof(second)) == 0));
+}
+
+// A record failing its checksum programs nothing, even the one that would
+// complete a sector
+static void test_bad_checksum_not_programmed(void)
+{
+	const uint32_t image_len = FLASH_SECTOR_SIZE - sizeof(tFlashHeader);
+	const uint8_t *staged;
+	uint32_t len, i, staged_len = 0;
+
+	for (i = 0; i < image_len; i++)
+		image[i] = (uint8_t)next_random();
+	reset();
+
+	len = put_image(text, image, image_len, true);
+	CHECK_EQ(fake_send_hex(text, len), -UPDATE_FAILED_BAD_CHECKSUM);
+	CHECK_EQ(fake_program_count, 0);
+
+	len = put_image(text, image, image_len, false);
+	CHECK_EQ(fake_send_hex(text, len), 0);
+	CHECK(fake_commit());
+
+	staged = fake_staged_image(&staged_len);
+	CHECK(staged && (staged_len == image_len) && (memcmp(staged, image, image_len) == 0));
+}
+
+// Host numbers only, the device parses from the worker at 125 MHz
+static void bench_parse(void)
+{
+	struct timespec start, end;
+	uint32_t len, image_len, round, chars = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0; round < 50; round++) {
+		len = generate(text, &image_len);
+		reset();
+		fake_send_hex(text, len);
+		chars += len;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("     %.1f ns per HEX character, staging and CRC included\n",
+		((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / chars);
+}
+
+int main(void)
+{
+	RUN(test_valid_images);
+	RUN(test_fuzz);
+	RUN(test_errors);
+	RUN(test_retry);
+	RUN(test_bad_checksum_not_programmed);
+
+	bench_parse();
+
+	return TEST_RESULT();
+}
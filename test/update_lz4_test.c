@@ -0,0 +1,322 @@
+#include "test.h"
+#include "update_fake.h"
+
+#include <time.h>
+
+#include "update.c"
+
+#define IMAGE_MAX	(120 * 1024)
+#define BLOCK_MAX	(IMAGE_MAX + IMAGE_MAX / 255 + 64)
+
+static uint8_t image[IMAGE_MAX];
+static uint8_t block[BLOCK_MAX];
+static const char *firmware_path;
+
+//--------------------------------------------------------------------+
+// LZ4 block encoder, greedy like etc/pack_fw.py
+//--------------------------------------------------------------------+
+
+static uint32_t put_length(uint8_t *out, uint32_t len)
+{
+	uint32_t n = 0;
+
+	for (; len >= 255; len -= 255)
+		out[n++] = 255;
+	out[n++] = (uint8_t)len;
+
+	return n;
+}
+
+// Literals, then a match unless `match_len` is 0, return bytes written
+static uint32_t put_sequence(uint8_t *out, const uint8_t *literals, uint32_t literal_len, uint16_t offset, uint32_t match_len)
+{
+	const uint32_t ml = match_len ? match_len - 4 : 0;
+	uint32_t n = 1;
+
+	out[0] = (uint8_t)((MIN(literal_len, 15) << 4) | MIN(ml, 15));
+	if (literal_len >= 15)
+		n += put_length(&out[n], literal_len - 15);
+
+	if (literal_len)
+		memcpy(&out[n], literals, literal_len);
+	n += literal_len;
+
+	if (match_len) {
+		out[n++] = (uint8_t)(offset & 0xff);
+		out[n++] = (uint8_t)(offset >> 8);
+		if (ml >= 15)
+			n += put_length(&out[n], ml - 15);
+	}
+
+	return n;
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t lz4_compress(const uint8_t *in, uint32_t len, uint8_t *out)
+{
+	static int32_t table[1 << 14];
+	uint32_t pos = 0, anchor = 0, n = 0, match_len;
+	int32_t candidate;
+
+	memset(table, 0xff, sizeof(table));
+
+	while (pos + 4 <= len) {
+		const uint32_t hash = (read32(&in[pos]) * 2654435761u) >> 18;
+
+		candidate = table[hash];
+		table[hash] = pos;
+
+		if ((candidate < 0) || (pos - candidate > 0xffff) || (read32(&in[candidate]) != read32(&in[pos]))) {
+			pos++;
+			continue;
+		}
+
+		match_len = 4;
+		while ((pos + match_len < len) && (in[candidate + match_len] == in[pos + match_len]))
+			match_len++;
+
+		n += put_sequence(&out[n], &in[anchor], pos - anchor, pos - candidate, match_len);
+		pos += match_len;
+		anchor = pos;
+	}
+
+	return n + put_sequence(&out[n], &in[anchor], len - anchor, 0, 0);
+}
+
+//--------------------------------------------------------------------+
+// Helpers
+//--------------------------------------------------------------------+
+
+static void fill_random(uint8_t *data, uint32_t len, uint32_t seed)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (uint8_t)(seed >> 16);
+	}
+}
+
+// Send an LZ4 block in frames of varying size, so tokens, lengths and
+// offsets are split across frames. Return the result of the END frame.
+static int send_block(const uint8_t *data, uint32_t len)
+{
+	static const uint8_t sizes[] = { 255, 1, 7, 200, 2, 254, 3, 128 };
+	const uint8_t flags = UPDATE_FRAME_FLAG_LZ4;
+	uint32_t pos = 0, i = 0;
+	uint8_t seq = 1, chunk;
+	int rc;
+
+	if ((rc = fake_send_frame(UPDATE_FRAME_START, 0, &flags, 1)) != 1)
+		return rc;
+
+	while (pos < len) {
+		chunk = MIN(len - pos, sizes[i % sizeof(sizes)]);
+		if ((rc = fake_send_frame(UPDATE_FRAME_DATA, seq++, &data[pos], chunk)) != 1)
+			return rc;
+		pos += chunk;
+		i++;
+	}
+
+	return fake_send_frame(UPDATE_FRAME_END, seq, NULL, 0);
+}
+
+// Compress, send and commit, then check what the flashloader would flash
+static void check_round_trip(const uint8_t *data, uint32_t len, const char *name)
+{
+	static uint8_t running[16 * 1024];
+	struct timespec start, end;
+	const uint8_t *staged;
+	uint32_t block_len, staged_len = 0;
+	double ns;
+
+	fill_random(running, sizeof(running), 99);
+	fake_flash_reset(running, sizeof(running));
+
+	block_len = lz4_compress(data, len, block);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	CHECK_EQ(send_block(block, block_len), 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	CHECK(fake_commit());
+
+	staged = fake_staged_image(&staged_len);
+	CHECK(staged != NULL);
+	CHECK_EQ(staged_len, len);
+	if (staged && (staged_len == len))
+		CHECK(memcmp(staged, data, len) == 0);
+
+	ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / (len ? len : 1);
+	printf("     %s: %u -> %u bytes (%.0f%%), %.1f ns per output byte with frame CRC\n",
+		name, len, block_len, 100.0 * block_len / (len ? len : 1), ns);
+}
+
+//--------------------------------------------------------------------+
+// Tests
+//--------------------------------------------------------------------+
+
+// A real binary, this test's own unless a firmware image is given
+static void test_round_trip_binary(void)
+{
+	FILE *file = fopen(firmware_path, "rb");
+	uint32_t len;
+
+	CHECK(file != NULL);
+	if (!file)
+		return;
+
+	len = fread(image, 1, sizeof(image), file);
+	fclose(file);
+
+	check_round_trip(image, len, firmware_path);
+}
+
+// Long runs need extra length bytes, offset 1 overlaps the match
+static void test_round_trip_runs(void)
+{
+	memset(image, 0, 70000);
+	memset(&image[5000], 0xff, 300);
+	memset(&image[40000], 0x55, 4096);
+
+	check_round_trip(image, 70000, "runs");
+}
+
+// Nothing to match, one sequence of literals with many length bytes
+static void test_round_trip_random(void)
+{
+	fill_random(image, 20000, 5);
+
+	check_round_trip(image, 20000, "random");
+}
+
+// Matches reach back into sectors already programmed, up to the 64 KB limit
+static void test_far_match(void)
+{
+	const uint8_t *staged;
+	uint32_t n, staged_len = 0;
+
+	fill_random(image, 66000, 6);
+	memcpy(&image[65535], &image[0], 465);
+
+	n = put_sequence(block, image, 65535, 65535, 465);
+	n += put_sequence(&block[n], NULL, 0, 0, 0);
+
+	fake_flash_reset(image, 1024);
+	CHECK_EQ(send_block(block, n), 0);
+	CHECK_EQ(staging.pos - sizeof(tFlashHeader), 66000);
+	CHECK(fake_commit());
+
+	staged = fake_staged_image(&staged_len);
+	CHECK(staged && (staged_len == 66000) && (memcmp(staged, image, 66000) == 0));
+}
+
+static void test_bad_offset(void)
+{
+	uint32_t n;
+
+	fill_random(image, 64, 7);
+	fake_flash_reset(image, 1024);
+
+	// Before the start of the image
+	n = put_sequence(block, image, 16, 17, 4);
+	CHECK_EQ(send_block(block, n), -UPDATE_FAILED_BAD_STREAM);
+	CHECK_EQ(update_frame_get_status(), UPDATE_FRAME_FAILED);
+
+	// Offset 0 is invalid
+	n = put_sequence(block, image, 16, 0, 4);
+	CHECK_EQ(send_block(block, n), -UPDATE_FAILED_BAD_STREAM);
+}
+
+static void test_truncated(void)
+{
+	uint32_t n;
+
+	fill_random(image, 64, 8);
+	fake_flash_reset(image, 1024);
+
+	// Ends inside the literals
+	n = put_sequence(block, image, 40, 0, 0);
+	CHECK_EQ(send_block(block, n - 1), -UPDATE_FAILED_BAD_STREAM);
+
+	// Ends between the two offset bytes
+	n = put_sequence(block, image, 8, 4, 4);
+	CHECK_EQ(send_block(block, n - 1), -UPDATE_FAILED_BAD_STREAM);
+}
+
+// Restarting after a complete but uncommitted update erases what it
+// programmed, so a different image can be sent in the same boot
+static void test_restart(void)
+{
+	static uint8_t old[12 * 1024];
+	const uint8_t *staged;
+	uint32_t n, staged_len = 0;
+
+	fill_random(old, sizeof(old), 9);
+	old[6000] = 0x00;
+
+	fake_flash_reset(old, sizeof(old));
+	memcpy(&fake_flash[FAKE_STAGING_OFFSET + sizeof(tFlashHeader)], old, sizeof(old));
+	update_erase_staging();
+
+	memcpy(image, old, sizeof(old));
+	image[6000] = 0x0f;
+	n = lz4_compress(image, sizeof(old), block);
+	CHECK_EQ(send_block(block, n), 0);
+
+	image[6000] = 0xf0;
+	n = lz4_compress(image, sizeof(old), block);
+	CHECK_EQ(send_block(block, n), 0);
+	CHECK(fake_commit());
+
+	staged = fake_staged_image(&staged_len);
+	CHECK(staged && (staged_len == sizeof(old)) && (memcmp(staged, image, sizeof(old)) == 0));
+}
+
+// The progress register reports the offset into the image, not the address
+// of an earlier HEX update
+static void test_progress_address(void)
+{
+	const char *hex_text = "+\n:020000041000EA\n:0100000001FE\n:00000001FF\n";
+	uint8_t progress_buf[UPDATE_PROGRESS_LEN];
+	uint32_t n;
+
+	fake_flash_reset(image, 1024);
+	CHECK_EQ(fake_send_hex(hex_text, strlen(hex_text)), 0);
+	update_pack_progress(progress_buf);
+	CHECK_EQ(read32(&progress_buf[8]), 0x10000001);
+
+	fill_random(image, 3000, 10);
+	n = lz4_compress(image, 3000, block);
+	CHECK_EQ(send_block(block, n), 0);
+	update_pack_progress(progress_buf);
+	CHECK_EQ(read32(&progress_buf[8]), 3000);
+}
+
+// All decoder state, matches are read back from the staged image
+static void report_ram(void)
+{
+	printf("     decoder state %zu bytes, staging buffers %zu bytes\n", sizeof(lz), sizeof(staging));
+}
+
+int main(int argc, char **argv)
+{
+	firmware_path = (argc > 1) ? argv[1] : argv[0];
+
+	RUN(test_round_trip_binary);
+	RUN(test_round_trip_runs);
+	RUN(test_round_trip_random);
+	RUN(test_far_match);
+	RUN(test_bad_offset);
+	RUN(test_truncated);
+	RUN(test_restart);
+	RUN(test_progress_address);
+
+	report_ram();
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,524 @@
+#include "test.h"
+
+// Built with the stand-ins in stubs/, static functions are tested directly
+#include "usb.c"
+#include "usb_descriptors.c"
+
+//--------------------------------------------------------------------+
+// Device stack and firmware fakes
+//--------------------------------------------------------------------+
+
+#define MAX_REPORTS	16
+
+struct sent_report
+{
+	uint8_t itf;
+	uint8_t report_id;
+	uint8_t len;
+	uint8_t data[CFG_TUD_HID_EP_BUFSIZE];
+};
+
+static struct
+{
+	uint8_t cf2;
+	uint8_t protocol;
+	bool busy[CFG_TUD_HID];
+	struct sent_report reports[MAX_REPORTS];
+	int report_count;
+} fake;
+
+bool tusb_init(void) { return true; }
+void tud_task(void) { }
+bool tud_ready(void) { return true; }
+bool tud_suspended(void) { return false; }
+bool tud_remote_wakeup(void) { return true; }
+
+bool tud_hid_n_ready(uint8_t instance)
+{
+	return !fake.busy[instance];
+}
+
+bool tud_hid_n_report(uint8_t instance, uint8_t report_id, void const *report, uint16_t len)
+{
+	struct sent_report *sent = &fake.reports[fake.report_count];
+
+	if (fake.busy[instance] || (fake.report_count == MAX_REPORTS) || (len > sizeof(sent->data)))
+		return false;
+
+	sent->itf = instance;
+	sent->report_id = report_id;
+	sent->len = len;
+	memcpy(sent->data, report, len);
+	fake.report_count++;
+
+	fake.busy[instance] = true;
+
+	return true;
+}
+
+uint8_t tud_hid_n_get_protocol(uint8_t instance)
+{
+	return (instance == USB_ITF_KEYBOARD) ? fake.protocol : HID_PROTOCOL_REPORT;
+}
+
+uint32_t tud_vendor_n_available(uint8_t itf) { (void)itf; return 0; }
+uint32_t tud_vendor_n_read(uint8_t itf, void *buffer, uint32_t bufsize) { (void)itf; (void)buffer; (void)bufsize; return 0; }
+uint32_t tud_vendor_n_write(uint8_t itf, void const *buffer, uint32_t bufsize) { (void)itf; (void)buffer; return bufsize; }
+
+bool reg_is_bit_set(enum reg_id reg, uint8_t bit) { return (reg == REG_ID_CF2) && (fake.cf2 & bit); }
+uint8_t reg_get_value(enum reg_id reg) { (void)reg; return 0; }
+void reg_set_value(enum reg_id reg, uint8_t value) { (void)reg; (void)value; }
+uint8_t reg_get_read_len(uint8_t reg) { (void)reg; return 1; }
+void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, uint8_t *out_len) { (void)in_reg; (void)in_data; (void)out_buffer; *out_len = 0; }
+
+void keyboard_add_key_callback(struct key_callback *callback) { (void)callback; }
+void keyboard_set_lock_state(bool capslock, bool numlock) { (void)capslock; (void)numlock; }
+void keyboard_set_low_power(bool enable) { (void)enable; }
+void touchpad_add_touch_callback(struct touch_callback *callback) { (void)callback; }
+void timer_arm_us(struct timer *timer, uint64_t delay_us) { (void)timer; (void)delay_us; }
+void debug_usb_drain(void) { }
+
+static void reset(uint8_t cf2)
+{
+	memset(&self, 0, sizeof(self));
+	memset(&fake, 0, sizeof(fake));
+	fake.cf2 = cf2;
+	fake.protocol = HID_PROTOCOL_REPORT;
+}
+
+// Run the USB task, then let the host take every report it was sent
+static void run_usb(void)
+{
+	bool busy = true;
+	uint8_t itf;
+
+	low_priority_worker_irq();
+
+	while (busy) {
+		busy = false;
+
+		for (itf = 0; itf < CFG_TUD_HID; itf++) {
+			if (fake.busy[itf]) {
+				fake.busy[itf] = false;
+				busy = true;
+				tud_hid_report_complete_cb(itf, NULL, 0);
+			}
+		}
+	}
+}
+
+//--------------------------------------------------------------------+
+// HID report descriptor parser, HID 1.11 section 6.2.2
+//--------------------------------------------------------------------+
+
+#define MAX_FIELDS	16
+
+struct hid_field
+{
+	uint8_t report_id;
+	uint16_t usage_page;
+	uint32_t usage_min, usage_max;
+	int32_t logical_min, logical_max;
+	uint32_t size, count;
+	bool variable;
+};
+
+struct hid_summary
+{
+	uint32_t input_bits[256]; // by report ID
+	uint32_t output_bits[256];
+	struct hid_field fields[MAX_FIELDS]; // data input fields
+	int field_count;
+};
+
+static int32_t item_signed(uint32_t value, uint8_t size)
+{
+	if (size == 1)
+		return (int8_t)value;
+	if (size == 2)
+		return (int16_t)value;
+	return (int32_t)value;
+}
+
+// Return false if the descriptor is malformed
+static bool hid_parse(uint8_t const *desc, size_t len, struct hid_summary *out)
+{
+	struct hid_field global = { 0 };
+	uint32_t usage_min = 0, usage_max = 0, usage = 0;
+	bool have_usage = false;
+	int depth = 0;
+	size_t i = 0;
+
+	memset(out, 0, sizeof(*out));
+
+	while (i < len) {
+		const uint8_t prefix = desc[i++];
+		const uint8_t size = (prefix & 0x03) == 3 ? 4 : (prefix & 0x03);
+		const uint8_t type = (prefix >> 2) & 0x03;
+		const uint8_t tag = prefix >> 4;
+		uint32_t value = 0;
+		uint8_t b;
+
+		if (i + size > len)
+			return false;
+
+		for (b = 0; b < size; b++)
+			value |= (uint32_t)desc[i++] << (8 * b);
+
+		if (type == 0) { // main
+			if ((tag == 0x8) || (tag == 0x9)) {
+				uint32_t *bits = (tag == 0x8) ? out->input_bits : out->output_bits;
+
+				bits[global.report_id] += global.size * global.count;
+
+				if ((tag == 0x8) && !(value & HID_CONSTANT)) {
+					struct hid_field *field = &out->fields[out->field_count++];
+
+					if (out->field_count > MAX_FIELDS)
+						return false;
+
+					*field = global;
+					field->usage_min = have_usage ? usage : usage_min;
+					field->usage_max = have_usage ? usage : usage_max;
+					field->variable = (value & HID_VARIABLE);
+				}
+			} else if (tag == 0xA) {
+				depth++;
+			} else if (tag == 0xC) {
+				if (--depth < 0)
+					return false;
+			} else {
+				return false;
+			}
+
+			// Local items only apply to the next main item
+			usage_min = usage_max = usage = 0;
+			have_usage = false;
+
+		} else if (type == 1) { // global
+			switch (tag) {
+			case 0x0: global.usage_page = value; break;
+			case 0x1: global.logical_min = item_signed(value, size); break;
+			case 0x2: global.logical_max = item_signed(value, size); break;
+			case 0x7: global.size = value; break;
+			case 0x8: global.report_id = value; break;
+			case 0x9: global.count = value; break;
+			default: return false;
+			}
+
+		} else if (type == 2) { // local
+			switch (tag) {
+			case 0x0: usage = value; have_usage = true; break;
+			case 0x1: usage_min = value; break;
+			case 0x2: usage_max = value; break;
+			default: return false;
+			}
+
+		} else {
+			return false;
+		}
+	}
+
+	return (depth == 0);
+}
+
+// Decode a value of an array field into the usage it selects, 0 for none
+static uint32_t hid_array_usage(struct hid_field const *field, int32_t value)
+{
+	if ((value < field->logical_min) || (value > field->logical_max))
+		return 0;
+
+	return field->usage_min + (value - field->logical_min);
+}
+
+static struct hid_field const *hid_find_field(struct hid_summary const *summary, uint8_t report_id, uint16_t usage_page)
+{
+	int i;
+
+	for (i = 0; i < summary->field_count; i++) {
+		if ((summary->fields[i].report_id == report_id) && (summary->fields[i].usage_page == usage_page))
+			return &summary->fields[i];
+	}
+
+	return NULL;
+}
+
+//--------------------------------------------------------------------+
+// Descriptor tests
+//--------------------------------------------------------------------+
+
+static void test_config_descriptor(void)
+{
+	const uint8_t *desc = tud_descriptor_configuration_cb(0);
+	uint8_t interfaces = 0, itf = 0xFF;
+	size_t i = 0;
+
+	CHECK_EQ(desc[1], TUSB_DESC_CONFIGURATION);
+	CHECK_EQ(desc[2] | (desc[3] << 8), sizeof(config_descriptor));
+	CHECK_EQ(CONFIG_TOTAL_LEN, sizeof(config_descriptor));
+
+	while (i < sizeof(config_descriptor)) {
+		CHECK(desc[i] > 0);
+		if (desc[i] == 0)
+			return;
+
+		if ((desc[i + 1] == TUSB_DESC_INTERFACE) && (desc[i + 3] == 0)) {
+			itf = desc[i + 2];
+			interfaces++;
+		}
+
+		// Length of the report descriptor the host will ask for
+		if (desc[i + 1] == HID_DESC_TYPE_HID) {
+			const uint16_t report_len = desc[i + 7] | (desc[i + 8] << 8);
+
+			if (itf == USB_ITF_KEYBOARD)
+				CHECK_EQ(report_len, sizeof(hid_keyboard_descriptor));
+			else if (itf == USB_ITF_MOUSE)
+				CHECK_EQ(report_len, sizeof(hid_mouse_descriptor));
+			else if (itf == USB_ITF_CONTROL)
+				CHECK_EQ(report_len, sizeof(hid_control_descriptor));
+			else
+				CHECK(false);
+		}
+
+		i += desc[i];
+	}
+
+	CHECK_EQ(i, sizeof(config_descriptor));
+	CHECK_EQ(interfaces, desc[4]);
+	CHECK_EQ(interfaces, USB_ITF_MAX);
+}
+
+static void test_keyboard_descriptor(void)
+{
+	struct hid_summary summary;
+	struct hid_field const *keys;
+
+	CHECK(tud_hid_descriptor_report_cb(USB_ITF_KEYBOARD) == hid_keyboard_descriptor);
+	CHECK(hid_parse(hid_keyboard_descriptor, sizeof(hid_keyboard_descriptor), &summary));
+
+	// No report ID, the report is exactly the NKRO struct
+	CHECK_EQ(summary.input_bits[0], sizeof(struct usb_nkro_report) * 8);
+	CHECK_EQ(summary.output_bits[0], 8);
+
+	CHECK_EQ(summary.field_count, 2);
+	keys = &summary.fields[1];
+	CHECK_EQ(keys->usage_page, HID_USAGE_PAGE_KEYBOARD);
+	CHECK(keys->variable);
+	CHECK_EQ(keys->usage_min, 0);
+	CHECK_EQ(keys->usage_max, USB_NKRO_KEY_COUNT - 1);
+	CHECK_EQ(keys->count * keys->size, sizeof(((struct usb_nkro_report *)0)->keys) * 8);
+}
+
+static void test_mouse_descriptor(void)
+{
+	struct hid_summary summary;
+
+	CHECK(tud_hid_descriptor_report_cb(USB_ITF_MOUSE) == hid_mouse_descriptor);
+	CHECK(hid_parse(hid_mouse_descriptor, sizeof(hid_mouse_descriptor), &summary));
+	CHECK_EQ(summary.input_bits[0], MOUSE_REPORT_LEN * 8);
+}
+
+static void test_control_descriptor(void)
+{
+	struct hid_summary summary;
+	uint i;
+
+	CHECK(tud_hid_descriptor_report_cb(USB_ITF_CONTROL) == hid_control_descriptor);
+	CHECK(hid_parse(hid_control_descriptor, sizeof(hid_control_descriptor), &summary));
+
+	// Report lengths queued by control_queue, without the report ID
+	CHECK_EQ(summary.input_bits[USB_REPORT_ID_CONSUMER], sizeof(uint16_t) * 8);
+	CHECK_EQ(summary.input_bits[USB_REPORT_ID_SYSTEM], sizeof(uint8_t) * 8);
+	CHECK_EQ(summary.input_bits[0], 0);
+
+	// Every routed key can be expressed in its report
+	for (i = 0; i < sizeof(key_controls) / sizeof(key_controls[0]); i++) {
+		const uint16_t page = (key_controls[i].report_id == USB_REPORT_ID_CONSUMER) ? HID_USAGE_PAGE_CONSUMER : HID_USAGE_PAGE_DESKTOP;
+		struct hid_field const *field = hid_find_field(&summary, key_controls[i].report_id, page);
+
+		CHECK(field != NULL);
+		if (field)
+			CHECK(hid_array_usage(field, key_controls[i].usage) != 0);
+	}
+}
+
+//--------------------------------------------------------------------+
+// Report encoder tests
+//--------------------------------------------------------------------+
+
+static bool key_bit(struct sent_report const *report, uint8_t usage)
+{
+	return report->data[1 + usage / 8] & (1 << (usage % 8));
+}
+
+static void test_key_press_release(void)
+{
+	reset(CF2_USB_KEYB_ON);
+
+	key_cb(KEY_A, KEY_STATE_PRESSED);
+	run_usb();
+	key_cb(KEY_A, KEY_STATE_RELEASED);
+	run_usb();
+
+	CHECK_EQ(fake.report_count, 2);
+	CHECK_EQ(fake.reports[0].itf, USB_ITF_KEYBOARD);
+	CHECK_EQ(fake.reports[0].len, sizeof(struct usb_nkro_report));
+	CHECK(key_bit(&fake.reports[0], KEY_A));
+	CHECK(!key_bit(&fake.reports[1], KEY_A));
+}
+
+// Press and release within one scan still reach the host as two reports
+static void test_key_tap(void)
+{
+	reset(CF2_USB_KEYB_ON);
+
+	key_cb(KEY_A, KEY_STATE_PRESSED);
+	key_cb(KEY_A, KEY_STATE_RELEASED);
+	run_usb();
+
+	CHECK_EQ(fake.report_count, 2);
+	CHECK(key_bit(&fake.reports[0], KEY_A));
+	CHECK(!key_bit(&fake.reports[1], KEY_A));
+}
+
+static void test_key_modifier_and_remap(void)
+{
+	reset(CF2_USB_KEYB_ON);
+
+	key_cb(KEY_LEFTSHIFT, KEY_STATE_PRESSED);
+	key_cb(KEY_OPEN, KEY_STATE_PRESSED);
+	key_cb(KEY_B, KEY_STATE_PRESSED);
+	run_usb();
+
+	CHECK_EQ(fake.report_count, 1);
+	CHECK_EQ(fake.reports[0].data[0], (1 << (KEY_LEFTSHIFT - KEY_LEFTCTRL)) | (1 << 0));
+	CHECK(key_bit(&fake.reports[0], KEY_B));
+	CHECK(!key_bit(&fake.reports[0], KEY_OPEN));
+}
+
+static void test_key_boot_protocol(void)
+{
+	uint8_t key;
+
+	reset(CF2_USB_KEYB_ON);
+	fake.protocol = HID_PROTOCOL_BOOT;
+
+	key_cb(KEY_A, KEY_STATE_PRESSED);
+	key_cb(KEY_B, KEY_STATE_PRESSED);
+	run_usb();
+
+	CHECK_EQ(fake.report_count, 1);
+	CHECK_EQ(fake.reports[0].len, 8);
+	CHECK_EQ(fake.reports[0].data[2], KEY_A);
+	CHECK_EQ(fake.reports[0].data[3], KEY_B);
+	CHECK_EQ(fake.reports[0].data[4], 0);
+
+	// More than 6 keys is a rollover error in every slot
+	for (key = KEY_A + 2; key < KEY_A + 7; key++)
+		key_cb(key, KEY_STATE_PRESSED);
+	run_usb();
+
+	CHECK_EQ(fake.report_count, 2);
+	CHECK_EQ(fake.reports[1].data[2], BOOT_ERR_ROLLOVER);
+	CHECK_EQ(fake.reports[1].data[7], BOOT_ERR_ROLLOVER);
+}
+
+static void test_consumer_tap(void)
+{
+	struct hid_summary summary;
+	struct hid_field const *field;
+
+	CHECK(hid_parse(hid_control_descriptor, sizeof(hid_control_descriptor), &summary));
+	field = hid_find_field(&summary, USB_REPORT_ID_CONSUMER, HID_USAGE_PAGE_CONSUMER);
+	CHECK(field != NULL);
+	if (!field)
+		return;
+
+	reset(CF2_USB_KEYB_ON);
+
+	key_cb(KEY_MUTE, KEY_STATE_PRESSED);
+	key_cb(KEY_MUTE, KEY_STATE_RELEASED);
+	run_usb();
+
+	// Mute reaches the host on the control interface, never as a key
+	CHECK_EQ(fake.report_count, 2);
+	CHECK_EQ(fake.reports[0].itf, USB_ITF_CONTROL);
+	CHECK_EQ(fake.reports[0].report_id, USB_REPORT_ID_CONSUMER);
+	CHECK_EQ(fake.reports[0].len, 2);
+	CHECK_EQ(hid_array_usage(field, fake.reports[0].data[0] | (fake.reports[0].data[1] << 8)), HID_USAGE_CONSUMER_MUTE);
+	CHECK_EQ(fake.reports[1].data[0] | (fake.reports[1].data[1] << 8), 0);
+}
+
+static void test_system_power(void)
+{
+	struct hid_summary summary;
+	struct hid_field const *field;
+
+	CHECK(hid_parse(hid_control_descriptor, sizeof(hid_control_descriptor), &summary));
+	field = hid_find_field(&summary, USB_REPORT_ID_SYSTEM, HID_USAGE_PAGE_DESKTOP);
+	CHECK(field != NULL);
+	if (!field)
+		return;
+
+	reset(CF2_USB_KEYB_ON);
+
+	key_cb(KEY_POWER, KEY_STATE_PRESSED);
+	run_usb();
+	key_cb(KEY_POWER, KEY_STATE_RELEASED);
+	run_usb();
+
+	CHECK_EQ(fake.report_count, 2);
+	CHECK_EQ(fake.reports[0].itf, USB_ITF_CONTROL);
+	CHECK_EQ(fake.reports[0].report_id, USB_REPORT_ID_SYSTEM);
+	CHECK_EQ(fake.reports[0].len, 1);
+	CHECK_EQ(hid_array_usage(field, fake.reports[0].data[0]), HID_USAGE_DESKTOP_SYSTEM_POWER_DOWN);
+
+	// Released is outside the logical range, no usage
+	CHECK_EQ(hid_array_usage(field, fake.reports[1].data[0]), 0);
+}
+
+// A newer control replaces the older one, whose release is then ignored
+static void test_control_replaced(void)
+{
+	reset(CF2_USB_KEYB_ON);
+
+	key_cb(KEY_VOLUMEUP, KEY_STATE_PRESSED);
+	run_usb();
+	key_cb(KEY_MUTE, KEY_STATE_PRESSED);
+	key_cb(KEY_VOLUMEUP, KEY_STATE_RELEASED);
+	run_usb();
+
+	CHECK_EQ(fake.report_count, 2);
+	CHECK_EQ(fake.reports[0].data[0], HID_USAGE_CONSUMER_VOLUME_INCREMENT);
+	CHECK_EQ(fake.reports[1].data[0], HID_USAGE_CONSUMER_MUTE);
+}
+
+static void test_keys_not_routed(void)
+{
+	reset(0);
+
+	key_cb(KEY_A, KEY_STATE_PRESSED);
+	key_cb(KEY_MUTE, KEY_STATE_PRESSED);
+	run_usb();
+
+	CHECK_EQ(fake.report_count, 0);
+}
+
+int main(void)
+{
+	RUN(test_config_descriptor);
+	RUN(test_keyboard_descriptor);
+	RUN(test_mouse_descriptor);
+	RUN(test_control_descriptor);
+	RUN(test_key_press_release);
+	RUN(test_key_tap);
+	RUN(test_key_modifier_and_remap);
+	RUN(test_key_boot_protocol);
+	RUN(test_consumer_tap);
+	RUN(test_system_power);
+	RUN(test_control_replaced);
+	RUN(test_keys_not_routed);
+
+	return TEST_RESULT();
+}